@@ -0,0 +1,193 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Local BA with g2o (Optimizer.LocalBAEngine: 0) and with the Schur complement solver
+// (Optimizer.LocalBAEngine: 1) on the local windows of a saved map. The map is loaded
+// twice, one copy per engine, and windows are run in keyframe order as local mapping
+// would. Before each window the second copy gets the estimates of the first one, so
+// both engines start from the same values and the pose differences are per window.
+// With fresh set, the Schur problem is built from scratch in each window instead of
+// being updated, to compare setup times.
+
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <vector>
+#include <algorithm>
+#include <Eigen/Dense>
+#include "System.h"
+#include "Map.h"
+#include "KeyFrame.h"
+#include "MapPoint.h"
+#include "Optimizer.h"
+#include "Config.h"
+#include "extra/timer.h"
+
+using namespace std;
+
+namespace {
+
+vector<SD_SLAM::MapPoint*> SortedMapPoints(SD_SLAM::Map *map) {
+  vector<SD_SLAM::MapPoint*> points = map->GetAllMapPoints();
+  sort(points.begin(), points.end(), [](SD_SLAM::MapPoint *a, SD_SLAM::MapPoint *b) {
+    return a->mnId < b->mnId;
+  });
+  return points;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  if (argc < 3 || argc > 6) {
+    cerr << endl << "Usage: ./localba_benchmark path_to_settings path_to_saved_map [rgbd (0/1)] [max_windows] [fresh (0/1)]" << endl;
+    return 1;
+  }
+
+  SD_SLAM::Config &config = SD_SLAM::Config::GetInstance();
+  if (!config.ReadParameters(argv[1])) {
+    cerr << "[ERROR] Config file contains errors" << endl;
+    return 1;
+  }
+
+  // The time budget adapts the Schur windows to the time used, they would not be the same
+  if (SD_SLAM::Config::LocalBABudget() > 0) {
+    cerr << "[ERROR] Set Optimizer.LocalBABudget to 0, both engines must use the same windows" << endl;
+    return 1;
+  }
+
+  const bool rgbd = argc > 3 && atoi(argv[3]) != 0;
+  const int maxWindows = argc > 4 ? atoi(argv[4]) : 0;
+  const bool fresh = argc > 5 && atoi(argv[5]) != 0;
+  const SD_SLAM::System::eSensor sensor = rgbd ? SD_SLAM::System::RGBD : SD_SLAM::System::MONOCULAR;
+
+  // One copy of the map for each engine
+  SD_SLAM::System slamG2o(sensor, false);
+  SD_SLAM::System slamSchur(sensor, false);
+  if (!slamG2o.LoadTrajectory(argv[2]) || !slamSchur.LoadTrajectory(argv[2])) {
+    cerr << "[ERROR] Couldn't load map " << argv[2] << endl;
+    return 1;
+  }
+
+  SD_SLAM::Map *mapG2o = slamG2o.GetMap();
+  SD_SLAM::Map *mapSchur = slamSchur.GetMap();
+
+  // Points are created in file order, pair them by id order
+  const vector<SD_SLAM::MapPoint*> pointsG2o = SortedMapPoints(mapG2o);
+  const vector<SD_SLAM::MapPoint*> pointsSchur = SortedMapPoints(mapSchur);
+  if (pointsG2o.size() != pointsSchur.size()) {
+    cerr << "[ERROR] Map copies differ" << endl;
+    return 1;
+  }
+
+  vector<SD_SLAM::KeyFrame*> keyframes = mapG2o->GetAllKeyFrames();
+  sort(keyframes.begin(), keyframes.end(), SD_SLAM::KeyFrame::lId);
+
+  cout << "[INFO] Map has " << keyframes.size() << " keyframes and " << pointsG2o.size() << " points" << endl;
+
+  SD_SLAM::LocalBAProblem problem;
+  bool abort = false;
+  int windows = 0;
+  double timeG2o = 0.0, timeSchur = 0.0, timeSetup = 0.0;
+  double maxDt = 0.0, maxDr = 0.0;
+
+  cout << fixed << setprecision(3);
+
+  for (size_t k = 0; k < keyframes.size(); k++) {
+    SD_SLAM::KeyFrame *pKF = keyframes[k];
+    if (pKF->mnId == 0 || pKF->isBad())
+      continue;
+    if (maxWindows > 0 && windows >= maxWindows)
+      break;
+
+    SD_SLAM::KeyFrame *pKFSchur = mapSchur->GetKeyFrame(pKF->mnId);
+    if (!pKFSchur || pKFSchur->isBad())
+      continue;
+
+    // Same starting estimates for both engines
+    for (size_t i = 0; i < keyframes.size(); i++) {
+      SD_SLAM::KeyFrame *pKFi = mapSchur->GetKeyFrame(keyframes[i]->mnId);
+      if (pKFi)
+        pKFi->SetPose(keyframes[i]->GetPose());
+    }
+    for (size_t i = 0; i < pointsG2o.size(); i++) {
+      if (!pointsG2o[i]->isBad() && !pointsSchur[i]->isBad())
+        pointsSchur[i]->SetWorldPos(pointsG2o[i]->GetWorldPos());
+    }
+
+    config.SetLocalBAEngine(0);
+    SD_SLAM::Timer tG2o(true);
+    SD_SLAM::Optimizer::LocalBundleAdjustment(pKF, &abort, mapG2o);
+    tG2o.Stop();
+
+    config.SetLocalBAEngine(1);
+    if (fresh)
+      problem.Clear();
+    SD_SLAM::Timer tSchur(true);
+    SD_SLAM::Optimizer::LocalBundleAdjustment(pKFSchur, &abort, mapSchur, &problem);
+    tSchur.Stop();
+
+    // Differences of the optimized keyframes
+    int nLocal = 0;
+    double dt = 0.0, dr = 0.0;
+    for (size_t i = 0; i < keyframes.size(); i++) {
+      SD_SLAM::KeyFrame *pKFi = keyframes[i];
+      if (pKFi->mnBALocalForKF != pKF->mnId || pKFi->isBad())
+        continue;
+
+      SD_SLAM::KeyFrame *pKFj = mapSchur->GetKeyFrame(pKFi->mnId);
+      if (!pKFj)
+        continue;
+
+      const Eigen::Matrix4d Ti = pKFi->GetPose();
+      const Eigen::Matrix4d Tj = pKFj->GetPose();
+      const Eigen::Matrix3d dR = Ti.block<3, 3>(0, 0)*Tj.block<3, 3>(0, 0).transpose();
+      dt = max(dt, (pKFi->GetCameraCenter()-pKFj->GetCameraCenter()).norm());
+      dr = max(dr, Eigen::AngleAxisd(dR).angle()*180.0/M_PI);
+      nLocal++;
+    }
+
+    cout << "[INFO] KeyFrame " << pKF->mnId << ": " << nLocal << " local keyframes, g2o "
+         << tG2o.GetMsTime() << "ms, Schur " << tSchur.GetMsTime() << "ms (" << problem.mdSetupTime
+         << "ms setup), max difference "
+         << dt << " (translation) " << dr << " (degrees)" << endl;
+
+    timeG2o += tG2o.GetMsTime();
+    timeSchur += tSchur.GetMsTime();
+    timeSetup += problem.mdSetupTime;
+    maxDt = max(maxDt, dt);
+    maxDr = max(maxDr, dr);
+    windows++;
+  }
+
+  slamG2o.Shutdown();
+  slamSchur.Shutdown();
+
+  if (windows == 0) {
+    cerr << "[ERROR] No local windows in map" << endl;
+    return 1;
+  }
+
+  cout << "[INFO] " << windows << " windows, g2o " << timeG2o/windows << "ms, Schur "
+       << timeSchur/windows << "ms per window (x" << timeG2o/timeSchur << ")" << endl;
+  cout << "[INFO] Schur setup " << timeSetup/windows << "ms per window ("
+       << (fresh ? "built from scratch" : "updated") << ")" << endl;
+  cout << "[INFO] Max pose difference " << maxDt << " (translation) " << maxDr << " (degrees)" << endl;
+
+  return 0;
+}
@@ -0,0 +1,216 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+// Throughput of pose and position reads while LocalBA-like writers update them.
+// Compares the previous mutex getters with the SeqLock ones used by KeyFrame
+// (GetPose) and MapPoint (GetWorldPos).
+
+#include <iostream>
+#include <cstdlib>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <Eigen/Dense>
+#include "extra/seqlock.h"
+#include "extra/timer.h"
+
+using namespace std;
+
+namespace {
+
+const int kKeyFrames = 200;
+const int kMapPoints = 20000;
+const int kWindowKeyFrames = 20;  // Keyframes optimized by each LocalBA
+const int kWindowPoints = 2000;   // MapPoints optimized by each LocalBA
+
+// Previous implementation: getters lock the pose mutex
+class MutexPose {
+ public:
+  MutexPose() : Tcw_(Eigen::Matrix4d::Identity()), Ow_(Eigen::Vector3d::Zero()) {}
+
+  void SetPose(const Eigen::Matrix4d &Tcw) {
+    unique_lock<mutex> lock(mutex_);
+    Tcw_ = Tcw;
+    Ow_ = -Tcw.block<3, 3>(0, 0).transpose()*Tcw.block<3, 1>(0, 3);
+  }
+
+  Eigen::Matrix4d GetPose() {
+    unique_lock<mutex> lock(mutex_);
+    return Tcw_;
+  }
+
+  void SetWorldPos(const Eigen::Vector3d &pos) {
+    unique_lock<mutex> lock(mutex_);
+    Ow_ = pos;
+  }
+
+  Eigen::Vector3d GetWorldPos() {
+    unique_lock<mutex> lock(mutex_);
+    return Ow_;
+  }
+
+ private:
+  mutex mutex_;
+  Eigen::Matrix4d Tcw_;
+  Eigen::Vector3d Ow_;
+};
+
+// Current implementation: writers keep the mutex, readers go through the SeqLock
+class SeqLockPose {
+ public:
+  SeqLockPose() : Tcw_(Eigen::Matrix4d::Identity()), Ow_(Eigen::Vector3d::Zero()) {}
+
+  void SetPose(const Eigen::Matrix4d &Tcw) {
+    unique_lock<mutex> lock(mutex_);
+    SD_SLAM::SeqLockWriter writer(seq_);
+    Tcw_.Store(Tcw);
+    Ow_.Store(-Tcw.block<3, 3>(0, 0).transpose()*Tcw.block<3, 1>(0, 3));
+  }
+
+  Eigen::Matrix4d GetPose() {
+    return seq_.Read(Tcw_);
+  }
+
+  void SetWorldPos(const Eigen::Vector3d &pos) {
+    unique_lock<mutex> lock(mutex_);
+    SD_SLAM::SeqLockWriter writer(seq_);
+    Ow_.Store(pos);
+  }
+
+  Eigen::Vector3d GetWorldPos() {
+    return seq_.Read(Ow_);
+  }
+
+ private:
+  mutex mutex_;
+  SD_SLAM::SeqLock seq_;
+  SD_SLAM::SeqLockValue<Eigen::Matrix4d> Tcw_;
+  SD_SLAM::SeqLockValue<Eigen::Vector3d> Ow_;
+};
+
+struct Result {
+  double reads;   // Reads per second
+  double writes;  // Writes per second
+};
+
+template<typename T>
+Result Run(int readers, int writers, double seconds) {
+  vector<T> keyframes(kKeyFrames);
+  vector<T> points(kMapPoints);
+  atomic<bool> stop(false);
+  vector<long> vReads(readers, 0), vWrites(writers, 0);
+  vector<double> vDepths(readers, 0.0);
+  vector<thread> threads;
+
+  // Writers: each LocalBA updates a window of keyframes and their points
+  for (int w = 0; w < writers; w++) {
+    threads.push_back(thread([&, w]() {
+      unsigned int seed = 1000+w;
+      Eigen::Matrix4d Tcw = Eigen::Matrix4d::Identity();
+      long n = 0;
+      while (!stop.load(memory_order_relaxed)) {
+        const int kf0 = rand_r(&seed) % (kKeyFrames-kWindowKeyFrames);
+        const int mp0 = rand_r(&seed) % (kMapPoints-kWindowPoints);
+        for (int i = 0; i < kWindowKeyFrames; i++) {
+          Tcw(0, 3) = n;
+          keyframes[kf0+i].SetPose(Tcw);
+          n++;
+        }
+        for (int i = 0; i < kWindowPoints; i++) {
+          points[mp0+i].SetWorldPos(Eigen::Vector3d(n, n, n));
+          n++;
+        }
+      }
+      vWrites[w] = n;
+    }));
+  }
+
+  // Readers: tracking and matching threads projecting points into keyframes
+  for (int r = 0; r < readers; r++) {
+    threads.push_back(thread([&, r]() {
+      unsigned int seed = r;
+      double depth = 0.0;
+      long n = 0;
+      while (!stop.load(memory_order_relaxed)) {
+        T &kf = keyframes[rand_r(&seed) % kKeyFrames];
+        const Eigen::Matrix4d Tcw = kf.GetPose();
+        for (int i = 0; i < 64; i++) {
+          const Eigen::Vector3d pos = points[rand_r(&seed) % kMapPoints].GetWorldPos();
+          depth += Tcw.block<3, 3>(0, 0).row(2).dot(pos) + Tcw(2, 3);
+        }
+        n += 65;
+      }
+      vReads[r] = n;
+      vDepths[r] = depth;
+    }));
+  }
+
+  SD_SLAM::Timer timer(true);
+  this_thread::sleep_for(chrono::duration<double>(seconds));
+  stop = true;
+  for (thread &t : threads)
+    t.join();
+  timer.Stop();
+
+  Result res = {0.0, 0.0};
+  for (long n : vReads)
+    res.reads += n;
+  for (long n : vWrites)
+    res.writes += n;
+  res.reads /= timer.GetTime();
+  res.writes /= timer.GetTime();
+  return res;
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  int readers = 3;
+  int writers = 1;
+  double seconds = 2.0;
+
+  if (argc > 4) {
+    cerr << endl << "Usage: ./seqlock_benchmark [readers] [writers] [seconds]" << endl;
+    return 1;
+  }
+  if (argc > 1)
+    readers = atoi(argv[1]);
+  if (argc > 2)
+    writers = atoi(argv[2]);
+  if (argc > 3)
+    seconds = atof(argv[3]);
+
+  cout << "[INFO] " << readers << " readers, " << writers << " LocalBA writers, "
+       << seconds << " s per run" << endl;
+
+  for (int w = 0; w <= writers; w += (writers > 0 ? writers : 1)) {
+    Result mutex_res = Run<MutexPose>(readers, w, seconds);
+    Result seq_res = Run<SeqLockPose>(readers, w, seconds);
+
+    cout << endl << "Writers: " << w << endl;
+    cout << "- Mutex:   " << mutex_res.reads/1e6 << " M reads/s, " << mutex_res.writes/1e6 << " M writes/s" << endl;
+    cout << "- SeqLock: " << seq_res.reads/1e6 << " M reads/s, " << seq_res.writes/1e6 << " M writes/s" << endl;
+    cout << "- Read speedup: " << seq_res.reads/mutex_res.reads << "x" << endl;
+    if (writers == 0)
+      break;
+  }
+
+  return 0;
+}
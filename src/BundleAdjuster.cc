@@ -0,0 +1,980 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "BundleAdjuster.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <map>
+#include "extra/timer.h"
+#include "extra/parallel_for.h"
+
+using std::vector;
+
+namespace SD_SLAM {
+
+namespace {
+
+// Chi2 thresholds (95%) for 2 and 3 DoF, also used as Huber deltas
+const double kChi2Mono = 5.991;
+const double kChi2Stereo = 7.815;
+
+// Levenberg-Marquardt parameters, same as g2o defaults
+const double kTau = 1e-5;
+const double kGoodStepLowerScale = 1./3.;
+const double kGoodStepUpperScale = 2./3.;
+const int kMaxTrialsAfterFailure = 10;
+
+// Points are linearized in up to this many chunks, each one accumulating its own camera
+// blocks. It does not depend on the number of threads, and neither do the results
+const int kSystemChunks = 16;
+
+}  // namespace
+
+BundleAdjuster::BundleAdjuster() {
+  robust_ = true;
+  threads_ = 1;
+  n_blocks_ = 0;
+  n_groups_ = 0;
+  n_separator_ = 0;
+  n_chunks_ = 0;
+}
+
+void BundleAdjuster::Clear() {
+  cameras_.clear();
+  fixed_.clear();
+  group_.clear();
+  valid_cameras_.clear();
+  points_.clear();
+  prior_H_.clear();
+  prior_h_.clear();
+  prior_c_.clear();
+  has_prior_.clear();
+  obs_.clear();
+  free_cameras_.clear();
+  free_points_.clear();
+  free_obs_.clear();
+}
+
+int BundleAdjuster::AddCamera(const Eigen::Matrix4d &Tcw, bool fixed) {
+  int camera;
+  if (!free_cameras_.empty()) {
+    camera = free_cameras_.back();
+    free_cameras_.pop_back();
+  } else {
+    camera = cameras_.size();
+    cameras_.push_back(g2o::SE3Quat());
+    fixed_.push_back(fixed);
+    group_.push_back(0);
+    valid_cameras_.push_back(true);
+  }
+
+  valid_cameras_[camera] = true;
+  group_[camera] = 0;
+  SetCamera(camera, Tcw, fixed);
+  return camera;
+}
+
+int BundleAdjuster::AddPoint(const Eigen::Vector3d &pos) {
+  if (!free_points_.empty()) {
+    int point = free_points_.back();
+    free_points_.pop_back();
+    points_[point] = pos;
+    ClearPointPrior(point);
+    return point;
+  }
+
+  points_.push_back(pos);
+  prior_H_.push_back(Eigen::Matrix3d::Zero());
+  prior_h_.push_back(Eigen::Vector3d::Zero());
+  prior_c_.push_back(0.0);
+  has_prior_.push_back(false);
+  return points_.size()-1;
+}
+
+int BundleAdjuster::AddObservation(int camera, int point, double u, double v, double ur, double inv_sigma2,
+                                   double fx, double fy, double cx, double cy, double bf) {
+  int obs;
+  if (!free_obs_.empty()) {
+    obs = free_obs_.back();
+    free_obs_.pop_back();
+  } else {
+    obs = obs_.size();
+    obs_.push_back(Observation());
+  }
+
+  obs_[obs].camera = camera;
+  obs_[obs].point = point;
+  obs_[obs].valid = true;
+  SetObservation(obs, u, v, ur, inv_sigma2, fx, fy, cx, cy, bf);
+  return obs;
+}
+
+void BundleAdjuster::SetCamera(int camera, const Eigen::Matrix4d &Tcw, bool fixed) {
+  Eigen::Matrix3d R = Tcw.block<3, 3>(0, 0);
+  Eigen::Vector3d t = Tcw.block<3, 1>(0, 3);
+  cameras_[camera] = g2o::SE3Quat(R, t);
+  fixed_[camera] = fixed;
+}
+
+void BundleAdjuster::SetPoint(int point, const Eigen::Vector3d &pos) {
+  if (has_prior_[point]) {
+    // Prior mean moves with the point: m' = m + d
+    Eigen::Vector3d d = pos - points_[point];
+    prior_c_[point] += 2*d.dot(prior_h_[point]) + d.dot(prior_H_[point]*d);
+    prior_h_[point] += prior_H_[point]*d;
+  }
+  points_[point] = pos;
+}
+
+void BundleAdjuster::SetObservation(int obs, double u, double v, double ur, double inv_sigma2,
+                                    double fx, double fy, double cx, double cy, double bf) {
+  Observation &o = obs_[obs];
+  o.stereo = ur >= 0;
+  o.z = Eigen::Vector3d(u, v, o.stereo ? ur : 0.0);
+  o.inv_sigma2 = inv_sigma2;
+  o.fx = fx;
+  o.fy = fy;
+  o.cx = cx;
+  o.cy = cy;
+  o.bf = bf;
+  o.active = true;
+}
+
+void BundleAdjuster::RemoveCamera(int camera) {
+  valid_cameras_[camera] = false;
+  free_cameras_.push_back(camera);
+}
+
+void BundleAdjuster::RemovePoint(int point) {
+  ClearPointPrior(point);
+  free_points_.push_back(point);
+}
+
+void BundleAdjuster::RemoveObservation(int obs) {
+  obs_[obs].valid = false;
+  obs_[obs].active = false;
+  free_obs_.push_back(obs);
+}
+
+void BundleAdjuster::MarginalizeCamera(int camera) {
+  Matrix36 Jc;
+  Eigen::Matrix3d Jp;
+  Eigen::Vector3d r;
+  double w;
+
+  // Camera information from its own observations
+  Matrix6d Hcc = Matrix6d::Zero();
+  for (size_t i = 0; i < obs_.size(); i++) {
+    const Observation &o = obs_[i];
+    if (!o.active || o.camera != camera)
+      continue;
+    Linearize(o, &Jc, &Jp, &r, &w);
+    Hcc.noalias() += w*Jc.transpose()*Jc;
+  }
+
+  // Fixed cameras have no uncertainty to propagate
+  const bool fixed = fixed_[camera];
+  Eigen::LDLT<Matrix6d> ldlt(Hcc);
+
+  // Point blocks of Hpp - Hpc Hcc^-1 Hcp
+  for (size_t i = 0; i < obs_.size(); i++) {
+    const Observation &o = obs_[i];
+    if (!o.active || o.camera != camera)
+      continue;
+    Linearize(o, &Jc, &Jp, &r, &w);
+
+    Eigen::Matrix3d H = w*Jp.transpose()*Jp;
+    if (!fixed) {
+      Matrix63 Hcp = w*Jc.transpose()*Jp;
+      H.noalias() -= Hcp.transpose()*ldlt.solve(Hcp);
+      H = 0.5*(H + H.transpose());
+    }
+
+    // Accumulate with mean at the current estimate
+    const Eigen::Vector3d &x = points_[o.point];
+    prior_H_[o.point] += H;
+    prior_h_[o.point] += H*x;
+    prior_c_[o.point] += x.dot(H*x);
+    has_prior_[o.point] = true;
+  }
+}
+
+void BundleAdjuster::ClearPointPrior(int point) {
+  prior_H_[point].setZero();
+  prior_h_[point].setZero();
+  prior_c_[point] = 0.0;
+  has_prior_[point] = false;
+}
+
+int BundleAdjuster::Optimize(int iterations, bool *stop_flag, double max_time) {
+  Timer timer(true);
+  BuildStructure();
+
+  double lambda = 0.0;
+  int ni = 2;
+  int n_bad = 0;
+  int it = 0;
+  double it_time = 0.0;
+  bool timeout = false;
+
+  while (it < iterations) {
+    if (stop_flag && *stop_flag)
+      break;
+
+    if (max_time > 0.0) {
+      // Stop if last iteration time does not fit in the remaining time
+      timer.Stop();
+      if (timer.GetMsTime() + it_time > max_time)
+        break;
+      it_time = timer.GetMsTime();
+    }
+
+    double current_chi2 = ComputeChi2();
+    double ini_chi2 = current_chi2;
+
+    BuildSystem();
+
+    if (it == 0) {
+      lambda = kTau*MaxDiagonal();
+      ni = 2;
+      n_bad = 0;
+    }
+    it++;
+
+    double rho = 0;
+    int trials = 0;
+    do {
+      cameras_backup_ = cameras_;
+      points_backup_ = points_;
+
+      double temp_chi2 = std::numeric_limits<double>::max();
+      double scale = 0.0;
+      if (Solve(lambda)) {
+        scale = ComputeScale(lambda);
+        Update();
+        temp_chi2 = ComputeChi2();
+      }
+
+      rho = (current_chi2-temp_chi2)/(scale+1e-3);
+
+      if (rho > 0 && std::isfinite(temp_chi2)) {
+        // Good step, decrease damping
+        double alpha = 1.0-std::pow(2*rho-1, 3);
+        alpha = std::min(alpha, kGoodStepUpperScale);
+        lambda *= std::max(kGoodStepLowerScale, alpha);
+        ni = 2;
+        current_chi2 = temp_chi2;
+      } else {
+        // Bad step, restore estimates and increase damping
+        lambda *= ni;
+        ni *= 2;
+        cameras_.swap(cameras_backup_);
+        points_.swap(points_backup_);
+      }
+      trials++;
+
+      if (max_time > 0.0) {
+        timer.Stop();
+        timeout = timer.GetMsTime() > max_time;
+      }
+    } while (rho < 0 && trials < kMaxTrialsAfterFailure && !(stop_flag && *stop_flag) && !timeout);
+
+    if (max_time > 0.0)
+      it_time = timer.GetMsTime() - it_time;
+
+    if (trials == kMaxTrialsAfterFailure || rho == 0 || timeout)
+      break;
+
+    // Stop if chi2 does not decrease in several iterations
+    if ((ini_chi2-current_chi2)*1e3 < ini_chi2)
+      n_bad++;
+    else
+      n_bad = 0;
+
+    if (n_bad >= 3)
+      break;
+  }
+
+  return it;
+}
+
+bool BundleAdjuster::IsOutlier(int obs) const {
+  const Observation &o = obs_[obs];
+  double depth;
+  Eigen::Vector3d r = Residual(o, cameras_[o.camera], points_[o.point], &depth);
+  double chi2 = o.inv_sigma2*r.squaredNorm();
+  return chi2 > (o.stereo ? kChi2Stereo : kChi2Mono) || depth <= 0.0;
+}
+
+int BundleAdjuster::DisableOutliers() {
+  int n = 0;
+  for (size_t i = 0; i < obs_.size(); i++) {
+    if (obs_[i].active && IsOutlier(i)) {
+      obs_[i].active = false;
+      n++;
+    }
+  }
+  return n;
+}
+
+void BundleAdjuster::EnableObservations() {
+  for (size_t i = 0; i < obs_.size(); i++) {
+    if (obs_[i].valid)
+      obs_[i].active = true;
+  }
+}
+
+Eigen::Matrix4d BundleAdjuster::GetCameraPose(int camera) const {
+  const g2o::SE3Quat &T = cameras_[camera];
+  Eigen::Matrix4d Tcw = Eigen::Matrix4d::Identity();
+  Tcw.block<3, 3>(0, 0) = T.rotation().toRotationMatrix();
+  Tcw.block<3, 1>(0, 3) = T.translation();
+  return Tcw;
+}
+
+Eigen::Vector3d BundleAdjuster::Residual(const Observation &o, const g2o::SE3Quat &Tcw,
+                                         const Eigen::Vector3d &pos, double *depth) const {
+  Eigen::Vector3d Xc = Tcw.map(pos);
+  double invz = 1.0/Xc(2);
+  double u = o.fx*Xc(0)*invz + o.cx;
+  double v = o.fy*Xc(1)*invz + o.cy;
+
+  Eigen::Vector3d r;
+  r(0) = o.z(0) - u;
+  r(1) = o.z(1) - v;
+  r(2) = o.stereo ? o.z(2) - (u - o.bf*invz) : 0.0;
+
+  if (depth)
+    *depth = Xc(2);
+  return r;
+}
+
+void BundleAdjuster::Linearize(const Observation &o, Matrix36 *Jc, Eigen::Matrix3d *Jp,
+                               Eigen::Vector3d *r, double *w) const {
+  const g2o::SE3Quat &T = cameras_[o.camera];
+  const Eigen::Vector3d Xc = T.map(points_[o.point]);
+  const Eigen::Matrix3d R = T.rotation().toRotationMatrix();
+  const double x = Xc(0), y = Xc(1), z = Xc(2);
+  const double z_2 = z*z;
+
+  // Jacobians of the residual wrt point and pose (rotation first), as in g2o types
+  (*Jp)(0, 0) = -o.fx*R(0, 0)/z + o.fx*x*R(2, 0)/z_2;
+  (*Jp)(0, 1) = -o.fx*R(0, 1)/z + o.fx*x*R(2, 1)/z_2;
+  (*Jp)(0, 2) = -o.fx*R(0, 2)/z + o.fx*x*R(2, 2)/z_2;
+  (*Jp)(1, 0) = -o.fy*R(1, 0)/z + o.fy*y*R(2, 0)/z_2;
+  (*Jp)(1, 1) = -o.fy*R(1, 1)/z + o.fy*y*R(2, 1)/z_2;
+  (*Jp)(1, 2) = -o.fy*R(1, 2)/z + o.fy*y*R(2, 2)/z_2;
+
+  (*Jc)(0, 0) = x*y/z_2*o.fx;
+  (*Jc)(0, 1) = -(1+(x*x/z_2))*o.fx;
+  (*Jc)(0, 2) = y/z*o.fx;
+  (*Jc)(0, 3) = -1./z*o.fx;
+  (*Jc)(0, 4) = 0;
+  (*Jc)(0, 5) = x/z_2*o.fx;
+  (*Jc)(1, 0) = (1+y*y/z_2)*o.fy;
+  (*Jc)(1, 1) = -x*y/z_2*o.fy;
+  (*Jc)(1, 2) = -x/z*o.fy;
+  (*Jc)(1, 3) = 0;
+  (*Jc)(1, 4) = -1./z*o.fy;
+  (*Jc)(1, 5) = y/z_2*o.fy;
+
+  if (o.stereo) {
+    (*Jp)(2, 0) = (*Jp)(0, 0) - o.bf*R(2, 0)/z_2;
+    (*Jp)(2, 1) = (*Jp)(0, 1) - o.bf*R(2, 1)/z_2;
+    (*Jp)(2, 2) = (*Jp)(0, 2) - o.bf*R(2, 2)/z_2;
+
+    (*Jc)(2, 0) = (*Jc)(0, 0) - o.bf*y/z_2;
+    (*Jc)(2, 1) = (*Jc)(0, 1) + o.bf*x/z_2;
+    (*Jc)(2, 2) = (*Jc)(0, 2);
+    (*Jc)(2, 3) = (*Jc)(0, 3);
+    (*Jc)(2, 4) = 0;
+    (*Jc)(2, 5) = (*Jc)(0, 5) - o.bf/z_2;
+  } else {
+    Jp->row(2).setZero();
+    Jc->row(2).setZero();
+  }
+
+  *r = Residual(o, T, points_[o.point], nullptr);
+
+  // Weight with Huber kernel first derivative
+  *w = o.inv_sigma2;
+  if (robust_) {
+    double e = *w*r->squaredNorm();
+    double d2 = o.stereo ? kChi2Stereo : kChi2Mono;
+    if (e > d2)
+      *w *= std::sqrt(d2)/std::sqrt(e);
+  }
+}
+
+double BundleAdjuster::Chi2(const Observation &o, const g2o::SE3Quat &Tcw, const Eigen::Vector3d &pos) const {
+  return o.inv_sigma2*Residual(o, Tcw, pos, nullptr).squaredNorm();
+}
+
+double BundleAdjuster::ComputeChi2() {
+  chi2_.resize(obs_.size());
+  ParallelFor(0, obs_.size(), threads_, [&](int i) {
+    const Observation &o = obs_[i];
+    if (!o.active) {
+      chi2_[i] = 0.0;
+      return;
+    }
+
+    double e = Chi2(o, cameras_[o.camera], points_[o.point]);
+    if (robust_) {
+      // Huber cost
+      double d2 = o.stereo ? kChi2Stereo : kChi2Mono;
+      if (e > d2)
+        e = 2*std::sqrt(e)*std::sqrt(d2) - d2;
+    }
+    chi2_[i] = e;
+  });
+
+  // Sum in observation order, results do not depend on the number of threads
+  double chi2 = 0.0;
+  for (size_t i = 0; i < chi2_.size(); i++)
+    chi2 += chi2_[i];
+
+  for (size_t i = 0; i < points_.size(); i++) {
+    if (has_prior_[i])
+      chi2 += points_[i].dot(prior_H_[i]*points_[i] - 2*prior_h_[i]) + prior_c_[i];
+  }
+  return chi2;
+}
+
+void BundleAdjuster::BuildStructure() {
+  // Observations grouped by point, keeping slot order. Removed points have none
+  point_obs_start_.assign(points_.size()+1, 0);
+  for (size_t i = 0; i < obs_.size(); i++) {
+    if (obs_[i].valid)
+      point_obs_start_[obs_[i].point+1]++;
+  }
+  for (size_t i = 0; i < points_.size(); i++)
+    point_obs_start_[i+1] += point_obs_start_[i];
+
+  next_obs_.assign(point_obs_start_.begin(), point_obs_start_.end()-1);
+  point_obs_.resize(point_obs_start_.back());
+  for (size_t i = 0; i < obs_.size(); i++) {
+    if (obs_[i].valid)
+      point_obs_[next_obs_[obs_[i].point]++] = i;
+  }
+
+  // A free camera is in the separator if it shares a point with a free camera of another group
+  vector<bool> is_free(cameras_.size());
+  vector<bool> separator(cameras_.size(), false);
+  for (size_t i = 0; i < cameras_.size(); i++)
+    is_free[i] = valid_cameras_[i] && !fixed_[i];
+
+  for (size_t p = 0; p < points_.size(); p++) {
+    int group = -1;
+    bool shared = false;
+    for (int k = point_obs_start_[p]; k < point_obs_start_[p+1] && !shared; k++) {
+      int c = obs_[point_obs_[k]].camera;
+      if (!is_free[c])
+        continue;
+      if (group < 0)
+        group = group_[c];
+      else
+        shared = group_[c] != group;
+    }
+
+    if (shared) {
+      for (int k = point_obs_start_[p]; k < point_obs_start_[p+1]; k++) {
+        int c = obs_[point_obs_[k]].camera;
+        separator[c] = is_free[c];
+      }
+    }
+  }
+
+  // Interior cameras numbered consecutively by group, in order of first camera
+  std::map<int, int> group_index;
+  vector<int> camera_group(cameras_.size(), -1);
+  vector<vector<int> > group_cameras;
+  for (size_t i = 0; i < cameras_.size(); i++) {
+    if (!is_free[i] || separator[i])
+      continue;
+    std::map<int, int>::iterator it = group_index.find(group_[i]);
+    if (it == group_index.end()) {
+      it = group_index.insert(std::make_pair(group_[i], static_cast<int>(group_cameras.size()))).first;
+      group_cameras.push_back(vector<int>());
+    }
+    camera_group[i] = it->second;
+    group_cameras[it->second].push_back(i);
+  }
+
+  n_groups_ = group_cameras.size();
+  n_blocks_ = 0;
+  camera_block_.assign(cameras_.size(), -1);
+  group_start_.resize(n_groups_+1);
+  for (int g = 0; g < n_groups_; g++) {
+    group_start_[g] = n_blocks_;
+    for (size_t i = 0; i < group_cameras[g].size(); i++)
+      camera_block_[group_cameras[g][i]] = n_blocks_++;
+  }
+  group_start_[n_groups_] = n_blocks_;
+
+  n_separator_ = 0;
+  for (size_t i = 0; i < cameras_.size(); i++) {
+    if (separator[i]) {
+      camera_block_[i] = n_blocks_++;
+      n_separator_++;
+    }
+  }
+
+  // Points of each group and the separator cameras they couple it with
+  group_points_.assign(n_groups_, vector<int>());
+  group_separator_.assign(n_groups_, vector<int>());
+  if (n_groups_ > 1) {
+    const int n_interior = group_start_[n_groups_];
+    for (size_t p = 0; p < points_.size(); p++) {
+      int group = -1;
+      for (int k = point_obs_start_[p]; k < point_obs_start_[p+1] && group < 0; k++)
+        group = camera_group[obs_[point_obs_[k]].camera];
+      if (group < 0)
+        continue;
+
+      group_points_[group].push_back(p);
+      for (int k = point_obs_start_[p]; k < point_obs_start_[p+1]; k++) {
+        int c = camera_block_[obs_[point_obs_[k]].camera];
+        if (c >= n_interior)
+          group_separator_[group].push_back(c);
+      }
+    }
+
+    for (int g = 0; g < n_groups_; g++) {
+      vector<int> &seps = group_separator_[g];
+      std::sort(seps.begin(), seps.end());
+      seps.erase(std::unique(seps.begin(), seps.end()), seps.end());
+    }
+
+    // Separator blocks coupled by a point or through the interior of a group
+    vector<vector<int> > rows(n_separator_);
+    for (int a = 0; a < n_separator_; a++)
+      rows[a].push_back(a);
+
+    vector<int> point_seps;
+    for (size_t p = 0; p < points_.size(); p++) {
+      point_seps.clear();
+      for (int k = point_obs_start_[p]; k < point_obs_start_[p+1]; k++) {
+        int c = camera_block_[obs_[point_obs_[k]].camera];
+        if (c >= n_interior)
+          point_seps.push_back(c-n_interior);
+      }
+      for (size_t a = 0; a < point_seps.size(); a++) {
+        for (size_t b = 0; b < point_seps.size(); b++) {
+          if (point_seps[a] < point_seps[b])
+            rows[point_seps[a]].push_back(point_seps[b]);
+        }
+      }
+    }
+
+    for (int g = 0; g < n_groups_; g++) {
+      const vector<int> &seps = group_separator_[g];
+      for (size_t a = 0; a < seps.size(); a++) {
+        for (size_t b = a+1; b < seps.size(); b++)
+          rows[seps[a]-n_interior].push_back(seps[b]-n_interior);
+      }
+    }
+
+    separator_row_start_.assign(n_separator_+1, 0);
+    separator_cols_.clear();
+    for (int a = 0; a < n_separator_; a++) {
+      std::sort(rows[a].begin(), rows[a].end());
+      rows[a].erase(std::unique(rows[a].begin(), rows[a].end()), rows[a].end());
+      separator_cols_.insert(separator_cols_.end(), rows[a].begin(), rows[a].end());
+      separator_row_start_[a+1] = separator_cols_.size();
+    }
+
+    // Upper triangle pattern, analyzed once per structure
+    vector<Eigen::Triplet<double> > triplets;
+    triplets.reserve(36*separator_cols_.size());
+    for (int a = 0; a < n_separator_; a++) {
+      for (int k = separator_row_start_[a]; k < separator_row_start_[a+1]; k++) {
+        const int b = separator_cols_[k];
+        for (int c = 0; c < 6; c++) {
+          for (int r = 0; r < (a == b ? c+1 : 6); r++)
+            triplets.push_back(Eigen::Triplet<double>(6*a+r, 6*b+c, 0.0));
+        }
+      }
+    }
+
+    separator_S_.resize(6*n_separator_, 6*n_separator_);
+    separator_S_.setFromTriplets(triplets.begin(), triplets.end());
+    separator_S_.makeCompressed();
+
+    // Rows of a block are consecutive in each column, store where they start
+    const int *outer = separator_S_.outerIndexPtr();
+    const int *inner = separator_S_.innerIndexPtr();
+    separator_offsets_.resize(6*separator_cols_.size());
+    for (int a = 0; a < n_separator_; a++) {
+      for (int k = separator_row_start_[a]; k < separator_row_start_[a+1]; k++) {
+        const int b = separator_cols_[k];
+        for (int c = 0; c < 6; c++) {
+          const int col = 6*b+c;
+          separator_offsets_[6*k+c] = std::lower_bound(inner+outer[col], inner+outer[col+1], 6*a) - inner;
+        }
+      }
+    }
+
+    separator_H_.resize(separator_cols_.size());
+    if (n_separator_ > 0)
+      separator_ldlt_.analyzePattern(separator_S_);
+  }
+
+  group_Y_.resize(n_groups_);
+  group_y_.resize(n_groups_);
+  group_BY_.resize(n_groups_);
+  group_By_.resize(n_groups_);
+
+  U_.resize(n_blocks_);
+  bc_.resize(n_blocks_);
+  V_.resize(points_.size());
+  bp_.resize(points_.size());
+  Vinv_.resize(points_.size());
+  W_.resize(obs_.size());
+  dx_points_.resize(points_.size());
+
+  n_chunks_ = std::min<int>(kSystemChunks, points_.size());
+  chunk_U_.resize(n_chunks_*n_blocks_);
+  chunk_bc_.resize(n_chunks_*n_blocks_);
+
+  // Dense reduced system only without groups
+  const int n_dense = n_groups_ > 1 ? 0 : n_blocks_;
+  S_.resize(6*n_dense, 6*n_dense);
+  rhs_.resize(6*(n_groups_ > 1 ? n_separator_ : n_blocks_));
+}
+
+void BundleAdjuster::BuildSystem() {
+  // Linearize observations by chunks of points. V, bp and W belong to a single point,
+  // U and bc are accumulated per chunk
+  ParallelFor(0, n_chunks_, threads_, [&](int j) {
+    Matrix6d *U = chunk_U_.data() + j*n_blocks_;
+    Vector6d *bc = chunk_bc_.data() + j*n_blocks_;
+    for (int i = 0; i < n_blocks_; i++) {
+      U[i].setZero();
+      bc[i].setZero();
+    }
+
+    Matrix36 Jc;
+    Eigen::Matrix3d Jp;
+    Eigen::Vector3d r;
+    double w;
+    const int p_end = (j+1)*points_.size()/n_chunks_;
+    for (int p = j*points_.size()/n_chunks_; p < p_end; p++) {
+      if (has_prior_[p]) {
+        // Prior gradient: h - H x
+        V_[p] = prior_H_[p];
+        bp_[p] = prior_h_[p] - prior_H_[p]*points_[p];
+      } else {
+        V_[p].setZero();
+        bp_[p].setZero();
+      }
+
+      for (int k = point_obs_start_[p]; k < point_obs_start_[p+1]; k++) {
+        const int i = point_obs_[k];
+        const Observation &o = obs_[i];
+        W_[i].setZero();
+        if (!o.active)
+          continue;
+
+        Linearize(o, &Jc, &Jp, &r, &w);
+
+        V_[p].noalias() += w*Jp.transpose()*Jp;
+        bp_[p].noalias() -= w*Jp.transpose()*r;
+
+        int c = camera_block_[o.camera];
+        if (c >= 0) {
+          U[c].noalias() += w*Jc.transpose()*Jc;
+          bc[c].noalias() -= w*Jc.transpose()*r;
+          W_[i].noalias() = w*Jc.transpose()*Jp;
+        }
+      }
+    }
+  });
+
+  // Sum chunks in order
+  ParallelFor(0, n_blocks_, threads_, [&](int c) {
+    U_[c].setZero();
+    bc_[c].setZero();
+    for (int j = 0; j < n_chunks_; j++) {
+      U_[c] += chunk_U_[j*n_blocks_+c];
+      bc_[c] += chunk_bc_[j*n_blocks_+c];
+    }
+  });
+}
+
+bool BundleAdjuster::Solve(double lambda) {
+  if (n_groups_ > 1)
+    return SolvePartitioned(lambda);
+
+  InvertPointBlocks(lambda);
+
+  // Schur complement of the point blocks: S = U - W V^-1 W^T, upper triangle.
+  // Block rows are split among threads, each one going through every point in order,
+  // so blocks are accumulated as with a single thread
+  const int threads = std::max(1, std::min(threads_, n_blocks_));
+  ParallelFor(0, threads, threads, [&](int t) {
+    for (int c = t; c < n_blocks_; c += threads) {
+      S_.block(6*c, 6*c, 6, 6*(n_blocks_-c)).setZero();
+      S_.block<6, 6>(6*c, 6*c) = U_[c] + lambda*Matrix6d::Identity();
+      rhs_.segment<6>(6*c) = bc_[c];
+    }
+
+    for (size_t p = 0; p < points_.size(); p++) {
+      for (int k1 = point_obs_start_[p]; k1 < point_obs_start_[p+1]; k1++) {
+        const Observation &o1 = obs_[point_obs_[k1]];
+        int c1 = camera_block_[o1.camera];
+        if (!o1.active || c1 < 0 || c1 % threads != t)
+          continue;
+
+        Matrix63 WV = W_[point_obs_[k1]]*Vinv_[p];
+        rhs_.segment<6>(6*c1).noalias() -= WV*bp_[p];
+
+        for (int k2 = point_obs_start_[p]; k2 < point_obs_start_[p+1]; k2++) {
+          const Observation &o2 = obs_[point_obs_[k2]];
+          int c2 = camera_block_[o2.camera];
+          if (!o2.active || c2 < c1)
+            continue;
+          S_.block<6, 6>(6*c1, 6*c2).noalias() -= WV*W_[point_obs_[k2]].transpose();
+        }
+      }
+    }
+  });
+
+  // Reduced camera system, only the upper triangle is filled
+  if (n_blocks_ > 0) {
+    Eigen::LLT<Eigen::MatrixXd, Eigen::Upper> llt(S_);
+    if (llt.info() != Eigen::Success)
+      return false;
+    dx_cameras_ = llt.solve(rhs_);
+    if (!dx_cameras_.allFinite())
+      return false;
+  } else {
+    dx_cameras_.resize(0);
+  }
+
+  SolvePoints();
+  return true;
+}
+
+bool BundleAdjuster::SolvePartitioned(double lambda) {
+  InvertPointBlocks(lambda);
+  const int n_interior = group_start_[n_groups_];
+
+  // Reduced camera system split as [A B; B^T C], with A block diagonal by group.
+  // Eliminate the interior of each group: C -= B^T A^-1 B, rhs -= B^T A^-1 r
+  vector<char> ok(n_groups_, 1);
+  ParallelFor(0, n_groups_, threads_, [&](int g) {
+    const int start = group_start_[g];
+    const int n = group_start_[g+1]-start;
+    const vector<int> &seps = group_separator_[g];
+    const int m = seps.size();
+
+    Eigen::MatrixXd A = Eigen::MatrixXd::Zero(6*n, 6*n);
+    Eigen::MatrixXd B = Eigen::MatrixXd::Zero(6*n, 6*m);
+    Eigen::VectorXd r(6*n);
+    for (int i = 0; i < n; i++) {
+      A.block<6, 6>(6*i, 6*i) = U_[start+i] + lambda*Matrix6d::Identity();
+      r.segment<6>(6*i) = bc_[start+i];
+    }
+
+    const vector<int> &points = group_points_[g];
+    for (size_t j = 0; j < points.size(); j++) {
+      const int p = points[j];
+      for (int k1 = point_obs_start_[p]; k1 < point_obs_start_[p+1]; k1++) {
+        const Observation &o1 = obs_[point_obs_[k1]];
+        int c1 = camera_block_[o1.camera]-start;
+        if (!o1.active || camera_block_[o1.camera] < 0 || c1 < 0 || c1 >= n)
+          continue;
+
+        Matrix63 WV = W_[point_obs_[k1]]*Vinv_[p];
+        r.segment<6>(6*c1).noalias() -= WV*bp_[p];
+
+        for (int k2 = point_obs_start_[p]; k2 < point_obs_start_[p+1]; k2++) {
+          const Observation &o2 = obs_[point_obs_[k2]];
+          int b2 = camera_block_[o2.camera];
+          if (!o2.active || b2 < 0)
+            continue;
+
+          if (b2 >= n_interior) {
+            int s = std::lower_bound(seps.begin(), seps.end(), b2)-seps.begin();
+            B.block<6, 6>(6*c1, 6*s).noalias() -= WV*W_[point_obs_[k2]].transpose();
+          } else if (b2-start >= c1) {
+            A.block<6, 6>(6*c1, 6*(b2-start)).noalias() -= WV*W_[point_obs_[k2]].transpose();
+          }
+        }
+      }
+    }
+
+    Eigen::LLT<Eigen::MatrixXd, Eigen::Upper> llt(A);
+    if (llt.info() != Eigen::Success) {
+      ok[g] = 0;
+      return;
+    }
+    group_Y_[g] = llt.solve(B);
+    group_y_[g] = llt.solve(r);
+    group_BY_[g].noalias() = B.transpose()*group_Y_[g];
+    group_By_[g].noalias() = B.transpose()*group_y_[g];
+  });
+
+  for (int g = 0; g < n_groups_; g++) {
+    if (!ok[g])
+      return false;
+  }
+
+  // Separator rows (C and its rhs): contributions of every point, then the eliminated
+  // interiors. Rows are split among threads as in Solve
+  const int threads = std::max(1, std::min(threads_, n_separator_));
+  ParallelFor(0, threads, threads, [&](int t) {
+    for (int a = t; a < n_separator_; a += threads) {
+      for (int k = separator_row_start_[a]; k < separator_row_start_[a+1]; k++)
+        separator_H_[k].setZero();
+      separator_H_[separator_row_start_[a]] = U_[n_interior+a] + lambda*Matrix6d::Identity();
+      rhs_.segment<6>(6*a) = bc_[n_interior+a];
+    }
+
+    for (size_t p = 0; p < points_.size(); p++) {
+      for (int k1 = point_obs_start_[p]; k1 < point_obs_start_[p+1]; k1++) {
+        const Observation &o1 = obs_[point_obs_[k1]];
+        int c1 = camera_block_[o1.camera]-n_interior;
+        if (!o1.active || camera_block_[o1.camera] < 0 || c1 < 0 || c1 % threads != t)
+          continue;
+
+        Matrix63 WV = W_[point_obs_[k1]]*Vinv_[p];
+        rhs_.segment<6>(6*c1).noalias() -= WV*bp_[p];
+
+        for (int k2 = point_obs_start_[p]; k2 < point_obs_start_[p+1]; k2++) {
+          const Observation &o2 = obs_[point_obs_[k2]];
+          int c2 = camera_block_[o2.camera]-n_interior;
+          if (!o2.active || camera_block_[o2.camera] < 0 || c2 < c1)
+            continue;
+          separator_H_[SeparatorBlock(c1, c2)].noalias() -= WV*W_[point_obs_[k2]].transpose();
+        }
+      }
+    }
+
+    for (int g = 0; g < n_groups_; g++) {
+      const vector<int> &seps = group_separator_[g];
+      for (size_t a = 0; a < seps.size(); a++) {
+        const int sa = seps[a]-n_interior;
+        if (sa % threads != t)
+          continue;
+
+        rhs_.segment<6>(6*sa) -= group_By_[g].segment<6>(6*a);
+        for (size_t b = a; b < seps.size(); b++)
+          separator_H_[SeparatorBlock(sa, seps[b]-n_interior)] -= group_BY_[g].block<6, 6>(6*a, 6*b);
+      }
+    }
+  });
+
+  // Separator system, upper triangle of the sparse pattern
+  dx_cameras_.resize(6*n_blocks_);
+  if (n_separator_ > 0) {
+    double *values = separator_S_.valuePtr();
+    for (int a = 0; a < n_separator_; a++) {
+      for (int k = separator_row_start_[a]; k < separator_row_start_[a+1]; k++) {
+        const int b = separator_cols_[k];
+        for (int c = 0; c < 6; c++) {
+          double *col = values + separator_offsets_[6*k+c];
+          for (int r = 0; r < (a == b ? c+1 : 6); r++)
+            col[r] = separator_H_[k](r, c);
+        }
+      }
+    }
+
+    separator_ldlt_.factorize(separator_S_);
+    if (separator_ldlt_.info() != Eigen::Success)
+      return false;
+    dx_cameras_.tail(6*n_separator_) = separator_ldlt_.solve(rhs_);
+  }
+
+  // Back substitution of each interior: dx = A^-1 r - A^-1 B dx_separator
+  ParallelFor(0, n_groups_, threads_, [&](int g) {
+    const vector<int> &seps = group_separator_[g];
+    Eigen::VectorXd xs(6*seps.size());
+    for (size_t a = 0; a < seps.size(); a++)
+      xs.segment<6>(6*a) = dx_cameras_.segment<6>(6*seps[a]);
+
+    const int start = group_start_[g];
+    const int n = group_start_[g+1]-start;
+    dx_cameras_.segment(6*start, 6*n) = group_y_[g];
+    dx_cameras_.segment(6*start, 6*n).noalias() -= group_Y_[g]*xs;
+  });
+
+  if (!dx_cameras_.allFinite())
+    return false;
+
+  SolvePoints();
+  return true;
+}
+
+void BundleAdjuster::InvertPointBlocks(double lambda) {
+  const Eigen::Matrix3d lambda3 = lambda*Eigen::Matrix3d::Identity();
+  ParallelFor(0, points_.size(), threads_, [&](int p) {
+    Vinv_[p] = (V_[p] + lambda3).inverse();
+  });
+}
+
+void BundleAdjuster::SolvePoints() {
+  ParallelFor(0, points_.size(), threads_, [&](int p) {
+    Eigen::Vector3d b = bp_[p];
+    for (int k = point_obs_start_[p]; k < point_obs_start_[p+1]; k++) {
+      const Observation &o = obs_[point_obs_[k]];
+      int c = camera_block_[o.camera];
+      if (!o.active || c < 0)
+        continue;
+      b.noalias() -= W_[point_obs_[k]].transpose()*dx_cameras_.segment<6>(6*c);
+    }
+    dx_points_[p] = Vinv_[p]*b;
+  });
+}
+
+double BundleAdjuster::ComputeScale(double lambda) const {
+  double scale = 0.0;
+  for (int i = 0; i < n_blocks_; i++) {
+    Vector6d dx = dx_cameras_.segment<6>(6*i);
+    scale += dx.dot(lambda*dx + bc_[i]);
+  }
+  for (size_t p = 0; p < points_.size(); p++)
+    scale += dx_points_[p].dot(lambda*dx_points_[p] + bp_[p]);
+  return scale;
+}
+
+void BundleAdjuster::Update() {
+  for (size_t i = 0; i < cameras_.size(); i++) {
+    int c = camera_block_[i];
+    if (c < 0)
+      continue;
+    Vector6d dx = dx_cameras_.segment<6>(6*c);
+    cameras_[i] = g2o::SE3Quat::exp(dx)*cameras_[i];
+  }
+  for (size_t p = 0; p < points_.size(); p++)
+    points_[p] += dx_points_[p];
+}
+
+double BundleAdjuster::MaxDiagonal() const {
+  double max_diag = 0.0;
+  for (int i = 0; i < n_blocks_; i++)
+    max_diag = std::max(max_diag, U_[i].diagonal().cwiseAbs().maxCoeff());
+  for (size_t p = 0; p < points_.size(); p++)
+    max_diag = std::max(max_diag, V_[p].diagonal().cwiseAbs().maxCoeff());
+  return max_diag;
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,255 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_BUNDLEADJUSTER_H_
+#define SD_SLAM_BUNDLEADJUSTER_H_
+
+#include <vector>
+#include <algorithm>
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <Eigen/StdVector>
+#include "extra/g2o/types/se3quat.h"
+
+namespace SD_SLAM {
+
+// Levenberg-Marquardt bundle adjustment specialised for SE3 cameras and XYZ points.
+// Points are eliminated with dense 3x3 blocks and the reduced camera system is
+// solved densely, which suits local windows of a few tens of keyframes.
+// Observations are linearized and accumulated in parallel, in an order that does
+// not depend on the number of threads.
+// Iterations, damping and stop criteria follow g2o::OptimizationAlgorithmLevenberg.
+// Elements can be removed and updated, so the same problem and its buffers can be
+// kept between consecutive optimizations of overlapping windows. Cameras leaving
+// the window can be marginalized into priors on the points they observed.
+// Cameras can be split in groups (submaps): cameras sharing points with another
+// group form the separator, the interior of each group is eliminated in parallel
+// onto it and recovered by back substitution. Steps are the same as without groups.
+// The separator system is block sparse and solved with a sparse LDLT.
+class BundleAdjuster {
+ public:
+  BundleAdjuster();
+
+  // Remove all cameras, points and observations
+  void Clear();
+
+  // Add elements, return their index
+  int AddCamera(const Eigen::Matrix4d &Tcw, bool fixed);
+  int AddPoint(const Eigen::Vector3d &pos);
+
+  // Add observation of a point in a camera. ur < 0 means monocular observation
+  int AddObservation(int camera, int point, double u, double v, double ur, double inv_sigma2,
+                     double fx, double fy, double cx, double cy, double bf);
+
+  // Update elements. Updated observations are active again
+  void SetCamera(int camera, const Eigen::Matrix4d &Tcw, bool fixed);
+  void SetPoint(int point, const Eigen::Vector3d &pos);
+  void SetObservation(int obs, double u, double v, double ur, double inv_sigma2,
+                      double fx, double fy, double cx, double cy, double bf);
+
+  // Remove elements, their slots are reused by next additions.
+  // Observations of removed cameras and points must be removed too
+  void RemoveCamera(int camera);
+  void RemovePoint(int point);
+  void RemoveObservation(int obs);
+
+  // Marginalize a camera into priors on the points it observes, linearized at current
+  // estimates. Only the 3x3 diagonal blocks of the point marginal are kept.
+  // Observations of the camera must be removed afterwards
+  void MarginalizeCamera(int camera);
+
+  // Remove the prior of a point. A moved point (SetPoint) moves its prior too
+  void ClearPointPrior(int point);
+  inline bool HasPointPrior(int point) const { return has_prior_[point]; }
+
+  // Use Huber kernel in observations
+  inline void SetRobust(bool robust) { robust_ = robust; }
+
+  // Group of a camera, all cameras are in group 0 by default
+  inline void SetCameraGroup(int camera, int group) { group_[camera] = group; }
+
+  // Threads used to eliminate groups
+  inline void SetThreads(int threads) { threads_ = threads; }
+
+  // Optimize, returns number of iterations done. If max_time (ms) is set, no iteration is
+  // started unless it is expected to end in time. Estimates are only replaced by better
+  // ones, so they can be used whenever the optimization is interrupted
+  int Optimize(int iterations, bool *stop_flag = nullptr, double max_time = 0.0);
+
+  // Chi2 above threshold or point behind camera, using current estimates
+  bool IsOutlier(int obs) const;
+  inline bool IsActive(int obs) const { return obs_[obs].active; }
+
+  // Exclude outliers from next optimizations, returns number of excluded observations
+  int DisableOutliers();
+
+  // Use again the observations excluded by DisableOutliers
+  void EnableObservations();
+
+  Eigen::Matrix4d GetCameraPose(int camera) const;
+  inline const Eigen::Vector3d &GetPoint(int point) const { return points_[point]; }
+
+  // Number of elements, removed ones not included
+  inline int NumCameras() const { return cameras_.size()-free_cameras_.size(); }
+  inline int NumPoints() const { return points_.size()-free_points_.size(); }
+  inline int NumObservations() const { return obs_.size()-free_obs_.size(); }
+
+  // Free cameras in the separator in last optimization
+  inline int NumSeparatorCameras() const { return n_separator_; }
+
+ private:
+  typedef Eigen::Matrix<double, 6, 1> Vector6d;
+  typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+  typedef Eigen::Matrix<double, 6, 3> Matrix63;
+  typedef Eigen::Matrix<double, 3, 6> Matrix36;
+  typedef Eigen::SparseMatrix<double, Eigen::ColMajor> SparseMatrix;
+
+  struct Observation {
+    int camera;
+    int point;
+    Eigen::Vector3d z;
+    double inv_sigma2;
+    double fx, fy, cx, cy, bf;
+    bool stereo;
+    bool active;
+    bool valid;
+  };
+
+  // Projection residual and depth in camera
+  Eigen::Vector3d Residual(const Observation &o, const g2o::SE3Quat &Tcw,
+                           const Eigen::Vector3d &pos, double *depth) const;
+
+  // Jacobians wrt pose and point, residual and (robust) weight of an observation
+  void Linearize(const Observation &o, Matrix36 *Jc, Eigen::Matrix3d *Jp,
+                 Eigen::Vector3d *r, double *w) const;
+
+  // Chi2 of an observation (without kernel)
+  double Chi2(const Observation &o, const g2o::SE3Quat &Tcw, const Eigen::Vector3d &pos) const;
+
+  // Sum of (robust) chi2 over active observations, evaluated in parallel
+  double ComputeChi2();
+
+  // Build per point observation lists and camera indices in the reduced system
+  void BuildStructure();
+
+  // Compute Jacobians and build U, V, W and b, by chunks of points in parallel
+  void BuildSystem();
+
+  // Solve damped system, result stored in dx_cameras_ and dx_points_
+  bool Solve(double lambda);
+
+  // Same as Solve, eliminating the interior cameras of each group onto the separator
+  bool SolvePartitioned(double lambda);
+
+  // Separator block (a, b), a <= b, in separator_H_
+  inline int SeparatorBlock(int a, int b) const {
+    const int *cols = separator_cols_.data();
+    return std::lower_bound(cols+separator_row_start_[a], cols+separator_row_start_[a+1], b) - cols;
+  }
+
+  // Point blocks of the Schur complement: V^-1 with damping
+  void InvertPointBlocks(double lambda);
+
+  // Back substitution of points: dp = V^-1 (bp - W^T dc)
+  void SolvePoints();
+
+  // dx^T (lambda*dx + b), used to compute the gain ratio
+  double ComputeScale(double lambda) const;
+
+  // Apply dx_cameras_ and dx_points_ to current estimates
+  void Update();
+
+  // Maximum of the Hessian diagonal
+  double MaxDiagonal() const;
+
+  std::vector<g2o::SE3Quat, Eigen::aligned_allocator<g2o::SE3Quat> > cameras_;
+  std::vector<bool> fixed_;
+  std::vector<int> group_;
+  std::vector<Eigen::Vector3d, Eigen::aligned_allocator<Eigen::Vector3d> > points_;
+  std::vector<Observation, Eigen::aligned_allocator<Observation> > obs_;
+
+  // Removed slots
+  std::vector<bool> valid_cameras_;
+  std::vector<int> free_cameras_;
+  std::vector<int> free_points_;
+  std::vector<int> free_obs_;
+
+  // Point priors in information form: x^T H x - 2 x^T h + c
+  std::vector<Eigen::Matrix3d, Eigen::aligned_allocator<Eigen::Matrix3d> > prior_H_;
+  std::vector<Eigen::Vector3d, Eigen::aligned_allocator<Eigen::Vector3d> > prior_h_;
+  std::vector<double> prior_c_;
+  std::vector<bool> has_prior_;
+
+  bool robust_;
+  int threads_;
+
+  // Structure
+  std::vector<int> camera_block_;     // Index in reduced system, -1 if fixed
+  int n_blocks_;
+  std::vector<int> point_obs_start_;  // Observations of each point (CSR)
+  std::vector<int> point_obs_;
+  std::vector<int> next_obs_;
+
+  // Groups. Interior blocks of each group are consecutive, separator blocks go last
+  int n_groups_;
+  int n_separator_;
+  std::vector<int> group_start_;             // First interior block of each group
+  std::vector<std::vector<int> > group_points_;      // Points observed by interior cameras
+  std::vector<std::vector<int> > group_separator_;   // Separator blocks sharing those points
+
+  // Separator system: upper triangle blocks by row (CSR of block columns) and the
+  // value offsets of each column of every block
+  std::vector<int> separator_row_start_;
+  std::vector<int> separator_cols_;
+  std::vector<int> separator_offsets_;
+
+  // Linear system
+  std::vector<Matrix6d, Eigen::aligned_allocator<Matrix6d> > U_;
+  std::vector<Eigen::Matrix3d, Eigen::aligned_allocator<Eigen::Matrix3d> > V_;
+  std::vector<Matrix63, Eigen::aligned_allocator<Matrix63> > W_;
+  std::vector<Vector6d, Eigen::aligned_allocator<Vector6d> > bc_;
+  std::vector<Eigen::Vector3d, Eigen::aligned_allocator<Eigen::Vector3d> > bp_;
+  std::vector<Eigen::Matrix3d, Eigen::aligned_allocator<Eigen::Matrix3d> > Vinv_;
+  int n_chunks_;
+  std::vector<Matrix6d, Eigen::aligned_allocator<Matrix6d> > chunk_U_;   // U and bc of each chunk of points
+  std::vector<Vector6d, Eigen::aligned_allocator<Vector6d> > chunk_bc_;
+  std::vector<double> chi2_;
+  Eigen::MatrixXd S_;                 // Reduced camera system without groups
+  Eigen::VectorXd rhs_;               // Its rhs, or the separator one with groups
+  std::vector<Matrix6d, Eigen::aligned_allocator<Matrix6d> > separator_H_;
+  SparseMatrix separator_S_;
+  Eigen::SimplicialLDLT<SparseMatrix, Eigen::Upper> separator_ldlt_;
+  std::vector<Eigen::MatrixXd> group_Y_;     // A^-1 B of each group
+  std::vector<Eigen::VectorXd> group_y_;     // A^-1 r of each group
+  std::vector<Eigen::MatrixXd> group_BY_;    // B^T A^-1 B of each group
+  std::vector<Eigen::VectorXd> group_By_;    // B^T A^-1 r of each group
+  Eigen::VectorXd dx_cameras_;
+  std::vector<Eigen::Vector3d, Eigen::aligned_allocator<Eigen::Vector3d> > dx_points_;
+
+  // Estimates before last update, restored if the step is rejected
+  std::vector<g2o::SE3Quat, Eigen::aligned_allocator<g2o::SE3Quat> > cameras_backup_;
+  std::vector<Eigen::Vector3d, Eigen::aligned_allocator<Eigen::Vector3d> > points_backup_;
+
+ public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_BUNDLEADJUSTER_H_
@@ -0,0 +1,189 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "CameraDistortion.h"
+#include <cmath>
+#include <algorithm>
+#include <opencv2/imgproc/imgproc.hpp>
+
+using std::vector;
+
+namespace SD_SLAM {
+
+CameraDistortion::CameraDistortion(const Eigen::Matrix3d &K, const cv::Mat &dist_coef, int width, int height,
+                                   const std::vector<float> &scale_factors) {
+  fx_ = K(0, 0);
+  fy_ = K(1, 1);
+  cx_ = K(0, 2);
+  cy_ = K(1, 2);
+  k1_ = dist_coef.at<float>(0);
+  k2_ = dist_coef.at<float>(1);
+  p1_ = dist_coef.at<float>(2);
+  p2_ = dist_coef.at<float>(3);
+  k3_ = dist_coef.total() > 4 ? dist_coef.at<float>(4) : 0.0;
+
+  // Undistorted position of every raw pixel, including right and bottom borders
+  undistort_cols_ = width+1;
+  undistort_rows_ = height+1;
+  undistort_table_.resize(2*undistort_cols_*undistort_rows_);
+  float *uptr = undistort_table_.data();
+  for (int y = 0; y < undistort_rows_; y++) {
+    for (int x = 0; x < undistort_cols_; x++, uptr += 2) {
+      double u, v;
+      UndistortPoint(x, y, &u, &v);
+      uptr[0] = u;
+      uptr[1] = v;
+    }
+  }
+
+  // Undistorted bounds of the image, from its border
+  double min_x = 0.0, max_x = width, min_y = 0.0, max_y = height;
+  for (int i = 0; i <= width+height; i++) {
+    const int border[4][2] = {{std::min(i, width), 0}, {std::min(i, width), height},
+                              {0, std::min(i, height)}, {width, std::min(i, height)}};
+    for (int j = 0; j < 4; j++) {
+      const float *entry = &undistort_table_[2*(border[j][1]*undistort_cols_ + border[j][0])];
+      min_x = std::min(min_x, static_cast<double>(entry[0]));
+      max_x = std::max(max_x, static_cast<double>(entry[0]));
+      min_y = std::min(min_y, static_cast<double>(entry[1]));
+      max_y = std::max(max_y, static_cast<double>(entry[1]));
+    }
+  }
+
+  // Avoid huge tables with strong distortions
+  min_x = std::max(min_x, -0.5*width);
+  max_x = std::min(max_x, 1.5*width);
+  min_y = std::max(min_y, -0.5*height);
+  max_y = std::min(max_y, 1.5*height);
+
+  levels_.resize(scale_factors.size());
+  for (size_t l = 0; l < scale_factors.size(); l++) {
+    Level &level = levels_[l];
+    const float scale = 1.0f/scale_factors[l];
+    level.scale = scale;
+    level.min_x = std::floor(min_x*scale)-1;
+    level.min_y = std::floor(min_y*scale)-1;
+    level.cols = std::ceil(max_x*scale)+2 - level.min_x;
+    level.rows = std::ceil(max_y*scale)+2 - level.min_y;
+
+    level.table.resize(2*level.cols*level.rows);
+    float *ptr = level.table.data();
+    for (int y = 0; y < level.rows; y++) {
+      for (int x = 0; x < level.cols; x++, ptr += 2) {
+        double ud, vd;
+        DistortPoint((x+level.min_x)/scale, (y+level.min_y)/scale, &ud, &vd);
+        ptr[0] = ud*scale;
+        ptr[1] = vd*scale;
+      }
+    }
+
+    // Remap maps over the image of this level
+    const int level_width = std::round(width*scale);
+    const int level_height = std::round(height*scale);
+    cv::Mat map(level_height, level_width, CV_32FC2);
+    for (int y = 0; y < level_height; y++) {
+      const float *entry = &level.table[2*((y-level.min_y)*level.cols - level.min_x)];
+      std::copy(entry, entry + 2*level_width, map.ptr<float>(y));
+    }
+    cv::convertMaps(map, cv::Mat(), level.map1, level.map2, CV_16SC2);
+  }
+}
+
+bool CameraDistortion::Distort(int level, float u, float v, float *ud, float *vd, Eigen::Matrix2f *J) const {
+  const Level &l = levels_[level];
+  return Interpolate(l.table.data(), l.cols, l.rows, u-l.min_x, v-l.min_y, ud, vd, J);
+}
+
+void CameraDistortion::Undistort(float ud, float vd, float *u, float *v) const {
+  if (Interpolate(undistort_table_.data(), undistort_cols_, undistort_rows_, ud, vd, u, v, NULL))
+    return;
+
+  // Outside the image
+  double x, y;
+  UndistortPoint(ud, vd, &x, &y);
+  *u = x;
+  *v = y;
+}
+
+void CameraDistortion::Rectify(int level, const cv::Mat &src, cv::Mat &dst) const {
+  cv::remap(src, dst, levels_[level].map1, levels_[level].map2, cv::INTER_LINEAR);
+}
+
+bool CameraDistortion::Interpolate(const float *table, int cols, int rows, float x, float y,
+                                   float *a, float *b, Eigen::Matrix2f *J) {
+  const int ix = std::floor(x);
+  const int iy = std::floor(y);
+  if (ix < 0 || iy < 0 || ix >= cols-1 || iy >= rows-1)
+    return false;
+
+  // Bilinear interpolation
+  const float ax = x-ix;
+  const float ay = y-iy;
+  const float *tl = table + 2*(iy*cols + ix);
+  const float *tr = tl+2;
+  const float *bl = tl+2*cols;
+  const float *br = bl+2;
+  const float w_tl = (1.0f-ax)*(1.0f-ay);
+  const float w_tr = ax*(1.0f-ay);
+  const float w_bl = (1.0f-ax)*ay;
+  const float w_br = ax*ay;
+  *a = w_tl*tl[0] + w_tr*tr[0] + w_bl*bl[0] + w_br*br[0];
+  *b = w_tl*tl[1] + w_tr*tr[1] + w_bl*bl[1] + w_br*br[1];
+
+  if (J) {
+    (*J)(0, 0) = (1.0f-ay)*(tr[0]-tl[0]) + ay*(br[0]-bl[0]);
+    (*J)(1, 0) = (1.0f-ay)*(tr[1]-tl[1]) + ay*(br[1]-bl[1]);
+    (*J)(0, 1) = (1.0f-ax)*(bl[0]-tl[0]) + ax*(br[0]-tr[0]);
+    (*J)(1, 1) = (1.0f-ax)*(bl[1]-tl[1]) + ax*(br[1]-tr[1]);
+  }
+
+  return true;
+}
+
+void CameraDistortion::DistortPoint(double u, double v, double *ud, double *vd) const {
+  const double x = (u-cx_)/fx_;
+  const double y = (v-cy_)/fy_;
+  const double r2 = x*x + y*y;
+  const double radial = 1.0 + r2*(k1_ + r2*(k2_ + r2*k3_));
+  const double xd = x*radial + 2.0*p1_*x*y + p2_*(r2 + 2.0*x*x);
+  const double yd = y*radial + p1_*(r2 + 2.0*y*y) + 2.0*p2_*x*y;
+  *ud = xd*fx_ + cx_;
+  *vd = yd*fy_ + cy_;
+}
+
+void CameraDistortion::UndistortPoint(double ud, double vd, double *u, double *v) const {
+  const double xd = (ud-cx_)/fx_;
+  const double yd = (vd-cy_)/fy_;
+  double x = xd, y = yd;
+
+  // Same fixed point iteration as cv::undistortPoints
+  for (int i = 0; i < 20; i++) {
+    const double r2 = x*x + y*y;
+    const double icdist = 1.0/(1.0 + r2*(k1_ + r2*(k2_ + r2*k3_)));
+    const double dx = 2.0*p1_*x*y + p2_*(r2 + 2.0*x*x);
+    const double dy = p1_*(r2 + 2.0*y*y) + 2.0*p2_*x*y;
+    x = (xd-dx)*icdist;
+    y = (yd-dy)*icdist;
+  }
+
+  *u = x*fx_ + cx_;
+  *v = y*fy_ + cy_;
+}
+
+}  // namespace SD_SLAM
@@ -0,0 +1,81 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_CAMERADISTORTION_H_
+#define SD_SLAM_CAMERADISTORTION_H_
+
+#include <vector>
+#include <Eigen/Dense>
+#include <opencv2/core/core.hpp>
+
+namespace SD_SLAM {
+
+// Precomputed OpenCV distortion model (k1, k2, p1, p2, k3) of a camera.
+// For each pyramid level a lookup table gives the distorted position of every
+// undistorted pixel, so points can be projected onto raw images without evaluating
+// the model. An inverse table over the raw image undistorts keypoints.
+// Read only after construction, shared by all frames.
+class CameraDistortion {
+ public:
+  CameraDistortion(const Eigen::Matrix3d &K, const cv::Mat &dist_coef, int width, int height,
+                   const std::vector<float> &scale_factors);
+
+  inline int GetLevels() const { return levels_.size(); }
+
+  // Distorted position of an undistorted pixel, both at a pyramid level.
+  // J is the derivative of the distorted position, if not NULL
+  bool Distort(int level, float u, float v, float *ud, float *vd, Eigen::Matrix2f *J = NULL) const;
+
+  // Undistorted position of a raw image pixel at level 0
+  void Undistort(float ud, float vd, float *u, float *v) const;
+
+  // Undistorted image of a pyramid level, with the same calibration and size
+  void Rectify(int level, const cv::Mat &src, cv::Mat &dst) const;
+
+ private:
+  struct Level {
+    float scale;                // Inverse scale factor
+    int min_x, min_y;           // Origin of the table in level pixels
+    int cols, rows;             // Size of the table
+    std::vector<float> table;   // Distorted u, v of each undistorted pixel
+    cv::Mat map1, map2;         // Remap maps over the image
+  };
+
+  // Bilinear interpolation of a table with two values per node
+  static bool Interpolate(const float *table, int cols, int rows, float x, float y,
+                          float *a, float *b, Eigen::Matrix2f *J);
+
+  // Apply distortion model to a pixel at level 0
+  void DistortPoint(double u, double v, double *ud, double *vd) const;
+
+  // Invert distortion model iteratively (only used to compute tables)
+  void UndistortPoint(double ud, double vd, double *u, double *v) const;
+
+  double fx_, fy_, cx_, cy_;
+  double k1_, k2_, p1_, p2_, k3_;
+
+  std::vector<Level> levels_;
+
+  int undistort_cols_, undistort_rows_;   // Size of undistortion table
+  std::vector<float> undistort_table_;   // Undistorted u, v of each raw pixel
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_CAMERADISTORTION_H_
@@ -50,6 +50,33 @@ Config::Config() {
   kNumLevels_ = 5;
   kThresholdFAST_ = 20;
 
+  kCovarianceWindows_ = false;
+  kOpticalFlow_ = false;
+  kOpticalFlowMinPoints_ = 50;
+
+  kMapVoxelSize_ = 0.2;
+  kMaxLocalMapCandidates_ = 0;
+  kLocalMapMaxDepth_ = 10.0;
+  kLocalMapThreads_ = 1;
+
+  kAlignMaxPoints_ = 300;
+  kAlignFastMaxPoints_ = 100;
+  kAlignDistortion_ = 0;
+
+  kKeyFrameVoxelSize_ = 1.0;
+  kPriorRadius_ = 0.0;
+  kPriorMaxAngle_ = 60.0;
+  kPlaceRecognitionThreads_ = 1;
+  kUseDescriptorIndex_ = false;
+
+  kOptimizerThreads_ = 1;
+  kLocalBAEngine_ = 0;
+  kLocalBABudget_ = 0.0;
+  kLocalBAWindow_ = 0;
+  kLoopBAKeyFrames_ = 0;
+  kSubmapKeyFrames_ = 0;
+  kEssentialGraphEngine_ = 0;
+
   kKeyFrameSize_ = 0.05;
   kKeyFrameLineWidth_ = 1.0;
   kGraphLineWidth_ = 0.9;
@@ -110,6 +137,38 @@ bool Config::ReadParameters(std::string filename) {
   if (fs["ORBextractor.nLevels"].isNamed()) fs["ORBextractor.nLevels"] >> kNumLevels_;
   if (fs["ORBextractor.thresholdFAST"].isNamed()) fs["ORBextractor.thresholdFAST"] >> kThresholdFAST_;
 
+  // Tracking
+  if (fs["Tracking.CovarianceWindows"].isNamed()) fs["Tracking.CovarianceWindows"] >> kCovarianceWindows_;
+  if (fs["Tracking.OpticalFlow"].isNamed()) fs["Tracking.OpticalFlow"] >> kOpticalFlow_;
+  if (fs["Tracking.OpticalFlowMinPoints"].isNamed()) fs["Tracking.OpticalFlowMinPoints"] >> kOpticalFlowMinPoints_;
+
+  // Local map
+  if (fs["LocalMap.VoxelSize"].isNamed()) fs["LocalMap.VoxelSize"] >> kMapVoxelSize_;
+  if (fs["LocalMap.MaxCandidates"].isNamed()) fs["LocalMap.MaxCandidates"] >> kMaxLocalMapCandidates_;
+  if (fs["LocalMap.MaxDepth"].isNamed()) fs["LocalMap.MaxDepth"] >> kLocalMapMaxDepth_;
+  if (fs["LocalMap.Threads"].isNamed()) fs["LocalMap.Threads"] >> kLocalMapThreads_;
+
+  // Image align
+  if (fs["ImageAlign.MaxPoints"].isNamed()) fs["ImageAlign.MaxPoints"] >> kAlignMaxPoints_;
+  if (fs["ImageAlign.FastMaxPoints"].isNamed()) fs["ImageAlign.FastMaxPoints"] >> kAlignFastMaxPoints_;
+  if (fs["ImageAlign.Distortion"].isNamed()) fs["ImageAlign.Distortion"] >> kAlignDistortion_;
+
+  // Place recognition
+  if (fs["PlaceRecognition.VoxelSize"].isNamed()) fs["PlaceRecognition.VoxelSize"] >> kKeyFrameVoxelSize_;
+  if (fs["PlaceRecognition.PriorRadius"].isNamed()) fs["PlaceRecognition.PriorRadius"] >> kPriorRadius_;
+  if (fs["PlaceRecognition.PriorMaxAngle"].isNamed()) fs["PlaceRecognition.PriorMaxAngle"] >> kPriorMaxAngle_;
+  if (fs["PlaceRecognition.Threads"].isNamed()) fs["PlaceRecognition.Threads"] >> kPlaceRecognitionThreads_;
+  if (fs["PlaceRecognition.DescriptorIndex"].isNamed()) fs["PlaceRecognition.DescriptorIndex"] >> kUseDescriptorIndex_;
+
+  // Optimizer
+  if (fs["Optimizer.Threads"].isNamed()) fs["Optimizer.Threads"] >> kOptimizerThreads_;
+  if (fs["Optimizer.LocalBAEngine"].isNamed()) fs["Optimizer.LocalBAEngine"] >> kLocalBAEngine_;
+  if (fs["Optimizer.LocalBABudget"].isNamed()) fs["Optimizer.LocalBABudget"] >> kLocalBABudget_;
+  if (fs["Optimizer.LocalBAWindow"].isNamed()) fs["Optimizer.LocalBAWindow"] >> kLocalBAWindow_;
+  if (fs["Optimizer.LoopBAKeyFrames"].isNamed()) fs["Optimizer.LoopBAKeyFrames"] >> kLoopBAKeyFrames_;
+  if (fs["Optimizer.SubmapKeyFrames"].isNamed()) fs["Optimizer.SubmapKeyFrames"] >> kSubmapKeyFrames_;
+  if (fs["Optimizer.EssentialGraphEngine"].isNamed()) fs["Optimizer.EssentialGraphEngine"] >> kEssentialGraphEngine_;
+
   // UI
   if (fs["Viewer.KeyFrameSize"].isNamed()) fs["Viewer.KeyFrameSize"] >> kKeyFrameSize_;
   if (fs["Viewer.KeyFrameLineWidth"].isNamed()) fs["Viewer.KeyFrameLineWidth"] >> kKeyFrameLineWidth_;
@@ -156,4 +215,8 @@ void Config::SetUsePattern(bool use_pattern){
 	kUsePattern_ = use_pattern;
 }
 
+void Config::SetLocalBAEngine(int engine) {
+  kLocalBAEngine_ = engine;
+}
+
 }  // namespace SD_SLAM
@@ -56,6 +56,7 @@ class Config {
   void SetCameraIntrinsics(double w, double h, double fx, double fy, double cx, double cy);
   void SetCameraDistortion(double k1, double k2, double p1, double p2, double k3);
   void SetUsePattern(bool use_pattern);
+  void SetLocalBAEngine(int engine);
 
   // Get parameters
   static double Width() { return GetInstance().camera_params_.w; }
@@ -81,6 +82,33 @@ class Config {
   static int NumLevels() { return GetInstance().kNumLevels_; }
   static int ThresholdFAST() { return GetInstance().kThresholdFAST_; }
 
+  static bool CovarianceWindows() { return GetInstance().kCovarianceWindows_; }
+  static bool OpticalFlow() { return GetInstance().kOpticalFlow_; }
+  static int OpticalFlowMinPoints() { return GetInstance().kOpticalFlowMinPoints_; }
+
+  static double MapVoxelSize() { return GetInstance().kMapVoxelSize_; }
+  static int MaxLocalMapCandidates() { return GetInstance().kMaxLocalMapCandidates_; }
+  static double LocalMapMaxDepth() { return GetInstance().kLocalMapMaxDepth_; }
+  static int LocalMapThreads() { return GetInstance().kLocalMapThreads_; }
+
+  static int AlignMaxPoints() { return GetInstance().kAlignMaxPoints_; }
+  static int AlignFastMaxPoints() { return GetInstance().kAlignFastMaxPoints_; }
+  static int AlignDistortion() { return GetInstance().kAlignDistortion_; }
+
+  static double KeyFrameVoxelSize() { return GetInstance().kKeyFrameVoxelSize_; }
+  static double PriorRadius() { return GetInstance().kPriorRadius_; }
+  static double PriorMaxAngle() { return GetInstance().kPriorMaxAngle_; }
+  static int PlaceRecognitionThreads() { return GetInstance().kPlaceRecognitionThreads_; }
+  static bool UseDescriptorIndex() { return GetInstance().kUseDescriptorIndex_; }
+
+  static int OptimizerThreads() { return GetInstance().kOptimizerThreads_; }
+  static int LocalBAEngine() { return GetInstance().kLocalBAEngine_; }
+  static double LocalBABudget() { return GetInstance().kLocalBABudget_; }
+  static int LocalBAWindow() { return GetInstance().kLocalBAWindow_; }
+  static int LoopBAKeyFrames() { return GetInstance().kLoopBAKeyFrames_; }
+  static int SubmapKeyFrames() { return GetInstance().kSubmapKeyFrames_; }
+  static int EssentialGraphEngine() { return GetInstance().kEssentialGraphEngine_; }
+
   static double KeyFrameSize() { return GetInstance().kKeyFrameSize_; }
   static double KeyFrameLineWidth() { return GetInstance().kKeyFrameLineWidth_; }
   static double GraphLineWidth() { return GetInstance().kGraphLineWidth_; }
@@ -115,6 +143,38 @@ class Config {
   int kNumLevels_;
   int kThresholdFAST_;
 
+  // Tracking
+  bool kCovarianceWindows_;
+  bool kOpticalFlow_;
+  int kOpticalFlowMinPoints_;
+
+  // Local map
+  double kMapVoxelSize_;
+  int kMaxLocalMapCandidates_;
+  double kLocalMapMaxDepth_;
+  int kLocalMapThreads_;
+
+  // Image align
+  int kAlignMaxPoints_;
+  int kAlignFastMaxPoints_;
+  int kAlignDistortion_;
+
+  // Place recognition
+  double kKeyFrameVoxelSize_;
+  double kPriorRadius_;
+  double kPriorMaxAngle_;
+  int kPlaceRecognitionThreads_;
+  bool kUseDescriptorIndex_;
+
+  // Optimizer
+  int kOptimizerThreads_;
+  int kLocalBAEngine_;
+  double kLocalBABudget_;
+  int kLocalBAWindow_;
+  int kLoopBAKeyFrames_;
+  int kSubmapKeyFrames_;
+  int kEssentialGraphEngine_;
+
   // UI
   double kKeyFrameSize_;
   double kKeyFrameLineWidth_;
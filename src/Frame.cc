@@ -24,8 +24,10 @@
 
 #include "Frame.h"
 #include <thread>
+#include <opencv2/video/tracking.hpp>
 #include "ORBmatcher.h"
-#include "Converter.h"
+#include "ImageAlign.h"
+#include "Config.h"
 
 using std::vector;
 
@@ -36,20 +38,23 @@ bool Frame::mbInitialComputations = true;
 float Frame::cx, Frame::cy, Frame::fx, Frame::fy, Frame::invfx, Frame::invfy;
 float Frame::mnMinX, Frame::mnMinY, Frame::mnMaxX, Frame::mnMaxY;
 float Frame::mfGridElementWidthInv, Frame::mfGridElementHeightInv;
+CameraDistortion *Frame::mpDistortion = NULL;
 
 Frame::Frame() {
   mTcw.setZero();
+  mbOpticalFlow = false;
 }
 
 // Copy Constructor
 Frame::Frame(const Frame &frame): mpORBextractorLeft(frame.mpORBextractorLeft),
   mK(frame.mK), mDistCoef(frame.mDistCoef.clone()), mbf(frame.mbf), mb(frame.mb), mThDepth(frame.mThDepth),
-  N(frame.N), mvKeys(frame.mvKeys), mvKeysUn(frame.mvKeysUn), mvuRight(frame.mvuRight), mvDepth(frame.mvDepth),
+  N(frame.N), mvKeys(frame.mvKeys), mvKeysUn(frame.mvKeysUn),
+  mvuRight(frame.mvuRight), mvDepth(frame.mvDepth),
   mDescriptors(frame.mDescriptors.clone()), mvpMapPoints(frame.mvpMapPoints), mvbOutlier(frame.mvbOutlier),
-  mnId(frame.mnId), mpReferenceKF(frame.mpReferenceKF), mnScaleLevels(frame.mnScaleLevels),
+  mnId(frame.mnId), mbOpticalFlow(frame.mbOpticalFlow), mpReferenceKF(frame.mpReferenceKF), mnScaleLevels(frame.mnScaleLevels),
   mfScaleFactor(frame.mfScaleFactor), mfLogScaleFactor(frame.mfLogScaleFactor), mvScaleFactors(frame.mvScaleFactors),
   mvInvScaleFactors(frame.mvInvScaleFactors), mvLevelSigma2(frame.mvLevelSigma2),
-  mvInvLevelSigma2(frame.mvInvLevelSigma2) {
+  mvInvLevelSigma2(frame.mvInvLevelSigma2), mvFlowPyramid(frame.mvFlowPyramid) {
   for (int i = 0; i < FRAME_GRID_COLS; i++)
     for (int j = 0; j < FRAME_GRID_ROWS; j++)
       mGrid[i][j] = frame.mGrid[i][j];
@@ -62,6 +67,15 @@ Frame::Frame(const Frame &frame): mpORBextractorLeft(frame.mpORBextractorLeft),
   for (int i = 0; i < size; i++)
     mvImagePyramid[i] = frame.mvImagePyramid[i].clone();
 
+  // Rectified levels are copied, the rest share the new pyramid
+  mvAlignPyramid.resize(frame.mvAlignPyramid.size());
+  for (size_t i = 0; i < mvAlignPyramid.size(); i++) {
+    if (frame.mvAlignPyramid[i].data == frame.mvImagePyramid[i].data)
+      mvAlignPyramid[i] = mvImagePyramid[i];
+    else
+      mvAlignPyramid[i] = frame.mvAlignPyramid[i].clone();
+  }
+
   mDepthImage = frame.mDepthImage.clone();
 }
 
@@ -71,6 +85,7 @@ Frame::Frame(const cv::Mat &imGray, const cv::Mat &imDepth, ORBextractor* extrac
   mpORBextractorLeft(extractor), mK(K), mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth) {
   // Frame ID
   mnId = nNextId++;
+  mbOpticalFlow = false;
 
   mTcw.setZero();
 
@@ -83,8 +98,13 @@ Frame::Frame(const cv::Mat &imGray, const cv::Mat &imDepth, ORBextractor* extrac
   mvLevelSigma2 = mpORBextractorLeft->GetScaleSigmaSquares();
   mvInvLevelSigma2 = mpORBextractorLeft->GetInverseScaleSigmaSquares();
 
+  // Distortion tables are computed only for the first Frame
+  if (!mpDistortion && mDistCoef.at<float>(0) != 0.0)
+    mpDistortion = new CameraDistortion(K, mDistCoef, imGray.cols, imGray.rows, mvScaleFactors);
+
   // ORB extraction
   ExtractORB(imGray);
+  ComputeAlignPyramid();
 
   N = mvKeys.size();
 
@@ -97,7 +117,7 @@ Frame::Frame(const cv::Mat &imGray, const cv::Mat &imDepth, ORBextractor* extrac
   mDepthImage = imDepth.clone();
 
   mvpMapPoints = vector<MapPoint*>(N, static_cast<MapPoint*>(NULL));
-  mvbOutlier = vector<bool>(N, false);
+  mvbOutlier = vector<uint8_t>(N, false);
 
   // This is done only for the first Frame
   if (mbInitialComputations) {
@@ -127,6 +147,7 @@ Frame::Frame(const cv::Mat &imGray, ORBextractor* extractor, const Eigen::Matrix
   mpORBextractorLeft(extractor), mK(K), mDistCoef(distCoef.clone()), mbf(bf), mThDepth(thDepth) {
   // Frame ID
   mnId=nNextId++;
+  mbOpticalFlow = false;
 
   // Scale Level Info
   mnScaleLevels = mpORBextractorLeft->GetLevels();
@@ -137,8 +158,13 @@ Frame::Frame(const cv::Mat &imGray, ORBextractor* extractor, const Eigen::Matrix
   mvLevelSigma2 = mpORBextractorLeft->GetScaleSigmaSquares();
   mvInvLevelSigma2 = mpORBextractorLeft->GetInverseScaleSigmaSquares();
 
+  // Distortion tables are computed only for the first Frame
+  if (!mpDistortion && mDistCoef.at<float>(0) != 0.0)
+    mpDistortion = new CameraDistortion(K, mDistCoef, imGray.cols, imGray.rows, mvScaleFactors);
+
   // ORB extraction
   ExtractORB(imGray);
+  ComputeAlignPyramid();
 
   N = mvKeys.size();
 
@@ -152,7 +178,7 @@ Frame::Frame(const cv::Mat &imGray, ORBextractor* extractor, const Eigen::Matrix
   mvDepth = vector<float>(N, -1);
 
   mvpMapPoints = vector<MapPoint*>(N, static_cast<MapPoint*>(NULL));
-  mvbOutlier = vector<bool>(N, false);
+  mvbOutlier = vector<uint8_t>(N, false);
 
   // This is done only for the first Frame (or after a change in the calibration)
   if (mbInitialComputations) {
@@ -176,6 +202,75 @@ Frame::Frame(const cv::Mat &imGray, ORBextractor* extractor, const Eigen::Matrix
   AssignFeaturesToGrid();
 }
 
+Frame::Frame(const cv::Mat &imGray, const cv::Mat &imDepth, const Frame &LastFrame) :
+  mpORBextractorLeft(LastFrame.mpORBextractorLeft), mK(LastFrame.mK), mDistCoef(LastFrame.mDistCoef.clone()),
+  mbf(LastFrame.mbf), mb(LastFrame.mb), mThDepth(LastFrame.mThDepth) {
+  // Frame ID
+  mnId = nNextId++;
+  mbOpticalFlow = true;
+
+  mTcw.setZero();
+
+  // Scale Level Info
+  mnScaleLevels = LastFrame.mnScaleLevels;
+  mfScaleFactor = LastFrame.mfScaleFactor;
+  mfLogScaleFactor = LastFrame.mfLogScaleFactor;
+  mvScaleFactors = LastFrame.mvScaleFactors;
+  mvInvScaleFactors = LastFrame.mvInvScaleFactors;
+  mvLevelSigma2 = LastFrame.mvLevelSigma2;
+  mvInvLevelSigma2 = LastFrame.mvInvLevelSigma2;
+
+  // Only the pyramid is computed, keypoints come from last frame
+  mpORBextractorLeft->BuildPyramid(imGray, mvImagePyramid);
+  ComputeAlignPyramid();
+  PropagateKeyPoints(LastFrame);
+
+  N = mvKeys.size();
+
+  UndistortKeyPoints();
+
+  if (!imDepth.empty()) {
+    ComputeStereoFromRGBD(imDepth);
+    mDepthImage = imDepth.clone();
+  } else {
+    mvuRight = vector<float>(N, -1);
+    mvDepth = vector<float>(N, -1);
+  }
+
+  mvbOutlier = vector<uint8_t>(N, false);
+
+  AssignFeaturesToGrid();
+}
+
+void Frame::ExtractFeatures(const cv::Mat &imGray, const cv::Mat &imDepth) {
+  mbOpticalFlow = false;
+
+  // ORB extraction
+  ExtractORB(imGray);
+  ComputeAlignPyramid();
+
+  N = mvKeys.size();
+
+  for (int i = 0; i < FRAME_GRID_COLS; i++)
+    for (int j = 0; j < FRAME_GRID_ROWS; j++)
+      mGrid[i][j].clear();
+
+  UndistortKeyPoints();
+
+  if (!imDepth.empty()) {
+    ComputeStereoFromRGBD(imDepth);
+    mDepthImage = imDepth.clone();
+  } else {
+    mvuRight = vector<float>(N, -1);
+    mvDepth = vector<float>(N, -1);
+  }
+
+  mvpMapPoints = vector<MapPoint*>(N, static_cast<MapPoint*>(NULL));
+  mvbOutlier = vector<uint8_t>(N, false);
+
+  AssignFeaturesToGrid();
+}
+
 void Frame::AssignFeaturesToGrid() {
   int nReserve = 0.5f*N/(FRAME_GRID_COLS*FRAME_GRID_ROWS);
   for (unsigned int i = 0; i < FRAME_GRID_COLS; i++)
@@ -183,10 +278,8 @@ void Frame::AssignFeaturesToGrid() {
       mGrid[i][j].reserve(nReserve);
 
   for (int i = 0; i < N; i++) {
-    const cv::KeyPoint &kp = mvKeysUn[i];
-
     int nGridPosX, nGridPosY;
-    if (PosInGrid(kp, nGridPosX, nGridPosY))
+    if (PosInGrid(mvKeysUn.x[i], mvKeysUn.y[i], nGridPosX, nGridPosY))
       mGrid[nGridPosX][nGridPosY].push_back(i);
   }
 }
@@ -195,6 +288,67 @@ void Frame::ExtractORB(const cv::Mat &im) {
   (*mpORBextractorLeft)(im, cv::Mat(), mvKeys, mDescriptors, mvImagePyramid);
 }
 
+void Frame::PropagateKeyPoints(const Frame &LastFrame) {
+  vector<int> vIndices;
+  vector<cv::Point2f> vLastPoints;
+  for (int i = 0; i < LastFrame.N; i++) {
+    MapPoint* pMP = LastFrame.mvpMapPoints[i];
+    if (pMP && !LastFrame.mvbOutlier[i] && !pMP->isBad()) {
+      vIndices.push_back(i);
+      vLastPoints.push_back(LastFrame.mvKeys[i].pt);
+    }
+  }
+
+  mvKeys.clear();
+  mvpMapPoints.clear();
+  mDescriptors = cv::Mat();
+  if (vIndices.empty())
+    return;
+
+  // ORB pyramid borders (EDGE_THRESHOLD) are smaller than the search window, so Lucas-Kanade
+  // uses its own pyramids. The one of this frame is kept for the next optical flow frame
+  const cv::Size window(21, 21);
+  const int kFlowLevels = 3;
+  vector<cv::Mat> vLastPyramid = LastFrame.mvFlowPyramid;
+  if (vLastPyramid.empty())
+    cv::buildOpticalFlowPyramid(LastFrame.mvImagePyramid[0], vLastPyramid, window, kFlowLevels);
+  const int maxLevel = cv::buildOpticalFlowPyramid(mvImagePyramid[0], mvFlowPyramid, window, kFlowLevels);
+
+  vector<cv::Point2f> vPoints;
+  vector<uchar> vStatus;
+  vector<float> vError;
+  cv::calcOpticalFlowPyrLK(vLastPyramid, mvFlowPyramid, vLastPoints, vPoints, vStatus, vError, window, maxLevel);
+
+  const int cols = mvImagePyramid[0].cols;
+  const int rows = mvImagePyramid[0].rows;
+  for (size_t k = 0; k < vIndices.size(); k++) {
+    if (!vStatus[k])
+      continue;
+    if (vPoints[k].x < 0 || vPoints[k].y < 0 || vPoints[k].x > cols-1 || vPoints[k].y > rows-1)
+      continue;
+
+    const int i = vIndices[k];
+    cv::KeyPoint kp = LastFrame.mvKeys[i];
+    kp.pt = vPoints[k];
+    mvKeys.push_back(kp);
+    mvpMapPoints.push_back(LastFrame.mvpMapPoints[i]);
+    mDescriptors.push_back(LastFrame.mDescriptors.row(i));
+  }
+}
+
+void Frame::ComputeAlignPyramid() {
+  mvAlignPyramid = mvImagePyramid;
+  if (!mpDistortion || Config::AlignDistortion() != 2)
+    return;
+
+  // Only levels used by ImageAlign are rectified
+  const int maxLevel = std::min(ImageAlign::kMaxLevel, static_cast<int>(mvImagePyramid.size())-1);
+  for (int i = ImageAlign::kMinLevel; i <= maxLevel; i++) {
+    mvAlignPyramid[i] = cv::Mat();
+    mpDistortion->Rectify(i, mvImagePyramid[i], mvAlignPyramid[i]);
+  }
+}
+
 void Frame::SetPose(const Eigen::Matrix4d &Tcw) {
   Eigen::Matrix4d m = Tcw;  // Somehow it fixes problems with Eigen
   mTcw = m;
@@ -268,6 +422,64 @@ bool Frame::isInFrustum(MapPoint *pMP, float viewingCosLimit) {
   return true;
 }
 
+int Frame::isInFrustum(MapPointArray &points, float viewingCosLimit) {
+  const int n = points.size();
+  const float r00 = mRcw(0, 0), r01 = mRcw(0, 1), r02 = mRcw(0, 2);
+  const float r10 = mRcw(1, 0), r11 = mRcw(1, 1), r12 = mRcw(1, 2);
+  const float r20 = mRcw(2, 0), r21 = mRcw(2, 1), r22 = mRcw(2, 2);
+  const float t0 = mtcw(0), t1 = mtcw(1), t2 = mtcw(2);
+  const float ox = mOw(0), oy = mOw(1), oz = mOw(2);
+  const float bf = mbf;
+  const float minX = mnMinX, maxX = mnMaxX, minY = mnMinY, maxY = mnMaxY;
+
+  const float *x = points.x.data(), *y = points.y.data(), *z = points.z.data();
+  const float *nx = points.nx.data(), *ny = points.ny.data(), *nz = points.nz.data();
+  const float *min_distance = points.min_distance.data(), *max_distance = points.max_distance.data();
+  float *u = points.u.data(), *v = points.v.data(), *ur = points.ur.data();
+  float *distance = points.distance.data(), *view_cos = points.view_cos.data();
+  int *level = points.level.data();
+  uint8_t *visible = points.visible.data();
+
+  // Projection, depth range and viewing angle without branches, so the loop is vectorized.
+  // Arrays never overlap, which the compiler cannot prove on its own
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC ivdep
+#endif
+  for (int i = 0; i < n; i++) {
+    const float pcx = r00*x[i] + r01*y[i] + r02*z[i] + t0;
+    const float pcy = r10*x[i] + r11*y[i] + r12*z[i] + t1;
+    const float pcz = r20*x[i] + r21*y[i] + r22*z[i] + t2;
+    const float invz = 1.0f/pcz;
+    u[i] = fx*pcx*invz + cx;
+    v[i] = fy*pcy*invz + cy;
+    ur[i] = u[i] - bf*invz;
+
+    const float dx = x[i]-ox;
+    const float dy = y[i]-oy;
+    const float dz = z[i]-oz;
+    const float dist = std::sqrt(dx*dx + dy*dy + dz*dz);
+    distance[i] = dist;
+    view_cos[i] = (dx*nx[i] + dy*ny[i] + dz*nz[i])/dist;
+
+    visible[i] = (pcz >= 0.0f) & (u[i] >= minX) & (u[i] <= maxX) & (v[i] >= minY) & (v[i] <= maxY) &
+                 (dist >= 0.8f*min_distance[i]) & (dist <= 1.2f*max_distance[i]) & (view_cos[i] >= viewingCosLimit);
+    level[i] = 0;
+  }
+
+  // Predicted level is the number of scale factors below max_distance/distance (same as PredictScale)
+  for (int l = 0; l < mnScaleLevels-1; l++) {
+    const float scale = mvScaleFactors[l];
+    for (int i = 0; i < n; i++)
+      level[i] += distance[i]*scale < max_distance[i];
+  }
+
+  int nVisible = 0;
+  for (int i = 0; i < n; i++)
+    nVisible += visible[i];
+
+  return nVisible;
+}
+
 vector<size_t> Frame::GetFeaturesInArea(const float &x, const float  &y, const float  &r, const int minLevel, const int maxLevel) const {
   vector<size_t> vIndices;
   vIndices.reserve(N);
@@ -294,22 +506,23 @@ vector<size_t> Frame::GetFeaturesInArea(const float &x, const float  &y, const f
 
   for (int ix = nMinCellX; ix <= nMaxCellX; ix++) {
     for (int iy = nMinCellY; iy <= nMaxCellY; iy++) {
-      const vector<size_t> vCell = mGrid[ix][iy];
+      const vector<size_t> &vCell = mGrid[ix][iy];
       if (vCell.empty())
         continue;
 
       for (size_t j = 0, jend=vCell.size(); j < jend; j++) {
-        const cv::KeyPoint &kpUn = mvKeysUn[vCell[j]];
+        const size_t idx = vCell[j];
         if (bCheckLevels) {
-          if (kpUn.octave < minLevel)
+          const int octave = mvKeysUn.octave[idx];
+          if (octave < minLevel)
             continue;
           if (maxLevel >= 0)
-            if (kpUn.octave > maxLevel)
+            if (octave > maxLevel)
               continue;
         }
 
-        const float distx = kpUn.pt.x-x;
-        const float disty = kpUn.pt.y-y;
+        const float distx = mvKeysUn.x[idx]-x;
+        const float disty = mvKeysUn.y[idx]-y;
 
         if (fabs(distx) < r && fabs(disty) < r)
           vIndices.push_back(vCell[j]);
@@ -320,9 +533,9 @@ vector<size_t> Frame::GetFeaturesInArea(const float &x, const float  &y, const f
   return vIndices;
 }
 
-bool Frame::PosInGrid(const cv::KeyPoint &kp, int &posX, int &posY) {
-  posX = round((kp.pt.x-mnMinX)*mfGridElementWidthInv);
-  posY = round((kp.pt.y-mnMinY)*mfGridElementHeightInv);
+bool Frame::PosInGrid(float x, float y, int &posX, int &posY) {
+  posX = round((x-mnMinX)*mfGridElementWidthInv);
+  posY = round((y-mnMinY)*mfGridElementHeightInv);
 
   // Keypoint's coordinates are undistorted, which could cause to go out of the image
   if (posX < 0 || posX >= FRAME_GRID_COLS || posY < 0 || posY >= FRAME_GRID_ROWS)
@@ -333,60 +546,30 @@ bool Frame::PosInGrid(const cv::KeyPoint &kp, int &posX, int &posY) {
 
 
 void Frame::UndistortKeyPoints() {
-  if (mDistCoef.at<float>(0) == 0.0) {
-    mvKeysUn = mvKeys;
-    return;
-  }
-
-  if (N == 0) {
+  if (!mpDistortion) {
+    mvKeysUn.Assign(mvKeys);
     return;
   }
 
-  // Fill matrix with points
-  cv::Mat mat(N, 2, CV_32F);
-  for (int i = 0; i < N; i++) {
-    mat.at<float>(i, 0) = mvKeys[i].pt.x;
-    mat.at<float>(i, 1) = mvKeys[i].pt.y;
-  }
-
-  // Undistort points
-  mat = mat.reshape(2);
-  cv::Mat mK_cv = Converter::toCvMat(mK);
-  cv::undistortPoints(mat, mat, mK_cv, mDistCoef, cv::Mat(), mK_cv);
-  mat = mat.reshape(1);
-
-  // Fill undistorted keypoint vector
-  mvKeysUn.resize(N);
-  for (int i = 0; i < N; i++) {
-    cv::KeyPoint kp = mvKeys[i];
-    kp.pt.x = mat.at<float>(i, 0);
-    kp.pt.y = mat.at<float>(i, 1);
-    mvKeysUn[i] = kp;
-  }
+  // Undistort points with the precomputed table
+  mvKeysUn.Assign(mvKeys);
+  for (int i = 0; i < N; i++)
+    mpDistortion->Undistort(mvKeys[i].pt.x, mvKeys[i].pt.y, &mvKeysUn.x[i], &mvKeysUn.y[i]);
 }
 
 void Frame::ComputeImageBounds(const cv::Mat &imLeft) {
-  if (mDistCoef.at<float>(0) != 0.0) {
-    cv::Mat mat(4, 2, CV_32F);
-    mat.at<float>(0, 0) = 0.0;
-    mat.at<float>(0, 1) = 0.0;
-    mat.at<float>(1, 0) = imLeft.cols;
-    mat.at<float>(1, 1) = 0.0;
-    mat.at<float>(2, 0) = 0.0;
-    mat.at<float>(2, 1) = imLeft.rows;
-    mat.at<float>(3, 0) = imLeft.cols;
-    mat.at<float>(3, 1) = imLeft.rows;
-
+  if (mpDistortion) {
     // Undistort corners
-    mat = mat.reshape(2);
-    cv::Mat mK_cv = Converter::toCvMat(mK);
-    cv::undistortPoints(mat, mat, mK_cv, mDistCoef, cv::Mat(), mK_cv);
-    mat = mat.reshape(1);
+    float corners[4][2];
+    mpDistortion->Undistort(0.0, 0.0, &corners[0][0], &corners[0][1]);
+    mpDistortion->Undistort(imLeft.cols, 0.0, &corners[1][0], &corners[1][1]);
+    mpDistortion->Undistort(0.0, imLeft.rows, &corners[2][0], &corners[2][1]);
+    mpDistortion->Undistort(imLeft.cols, imLeft.rows, &corners[3][0], &corners[3][1]);
 
-    mnMinX = std::min(mat.at<float>(0, 0), mat.at<float>(2, 0));
-    mnMaxX = std::max(mat.at<float>(1, 0), mat.at<float>(3, 0));
-    mnMinY = std::min(mat.at<float>(0, 1), mat.at<float>(1, 1));
-    mnMaxY = std::max(mat.at<float>(2, 1), mat.at<float>(3, 1));
+    mnMinX = std::min(corners[0][0], corners[2][0]);
+    mnMaxX = std::max(corners[1][0], corners[3][0]);
+    mnMinY = std::min(corners[0][1], corners[1][1]);
+    mnMaxY = std::max(corners[2][1], corners[3][1]);
 
   } else {
     mnMinX = 0.0f;
@@ -402,7 +585,6 @@ void Frame::ComputeStereoFromRGBD(const cv::Mat &imDepth) {
 
   for (int i = 0; i < N; i++) {
     const cv::KeyPoint &kp = mvKeys[i];
-    const cv::KeyPoint &kpU = mvKeysUn[i];
 
     const float &v = kp.pt.y;
     const float &u = kp.pt.x;
@@ -411,7 +593,7 @@ void Frame::ComputeStereoFromRGBD(const cv::Mat &imDepth) {
 
     if (d > 0) {
       mvDepth[i] = d;
-      mvuRight[i] = kpU.pt.x-mbf/d;
+      mvuRight[i] = mvKeysUn.x[i]-mbf/d;
     }
   }
 }
@@ -419,8 +601,8 @@ void Frame::ComputeStereoFromRGBD(const cv::Mat &imDepth) {
 Eigen::Vector3d Frame::UnprojectStereo(const int &i) {
   const float z = mvDepth[i];
   if (z > 0) {
-    const float u = mvKeysUn[i].pt.x;
-    const float v = mvKeysUn[i].pt.y;
+    const float u = mvKeysUn.x[i];
+    const float v = mvKeysUn.y[i];
     const float x = (u-cx)*z*invfx;
     const float y = (v-cy)*z*invfy;
     Eigen::Vector3d x3Dc(x, y, z);
@@ -431,8 +613,11 @@ Eigen::Vector3d Frame::UnprojectStereo(const int &i) {
 }
 
 void Frame::Undistort(const cv::Mat& im, cv::Mat& im_out) {
-  cv::Mat mK_cv = Converter::toCvMat(mK);
-  cv::undistort(im, im_out, mK_cv, mDistCoef);
+  // Remap maps are computed once for the camera
+  if (mpDistortion)
+    mpDistortion->Rectify(0, im, im_out);
+  else
+    im.copyTo(im_out);
 }
 
 }  // namespace SD_SLAM
@@ -31,6 +31,8 @@
 #include "MapPoint.h"
 #include "KeyFrame.h"
 #include "ORBextractor.h"
+#include "CameraDistortion.h"
+#include "extra/keypoints.h"
 
 namespace SD_SLAM {
 
@@ -39,6 +41,7 @@ namespace SD_SLAM {
 
 class MapPoint;
 class KeyFrame;
+struct MapPointArray;
 
 class Frame {
  public:
@@ -53,6 +56,14 @@ class Frame {
   // Constructor for Monocular cameras.
   Frame(const cv::Mat &imGray, ORBextractor* extractor, const Eigen::Matrix3d &K, cv::Mat &distCoef, const float &bf, const float &thDepth);
 
+  // Constructor propagating the MapPoints of the last frame with optical flow, without ORB extraction.
+  // Keypoints keep the octave, angle and descriptor of the last frame. imDepth is empty for monocular cameras.
+  Frame(const cv::Mat &imGray, const cv::Mat &imDepth, const Frame &LastFrame);
+
+  // Replace the keypoints of an optical flow frame by ORB features extracted on its image,
+  // keeping the frame id. imDepth is empty for monocular cameras.
+  void ExtractFeatures(const cv::Mat &imGray, const cv::Mat &imDepth);
+
   // Extract ORB on the image
   void ExtractORB(const cv::Mat &im);
 
@@ -86,8 +97,12 @@ class Frame {
   // and fill variables of the MapPoint to be used by the tracking
   bool isInFrustum(MapPoint* pMP, float viewingCosLimit);
 
-  // Compute the cell of a keypoint (return false if outside the grid)
-  bool PosInGrid(const cv::KeyPoint &kp, int &posX, int &posY);
+  // Same checks for a whole array of points, results are stored in the array.
+  // Returns the number of visible points
+  int isInFrustum(MapPointArray &points, float viewingCosLimit);
+
+  // Compute the cell of a keypoint position (return false if outside the grid)
+  bool PosInGrid(float x, float y, int &posX, int &posY);
 
   std::vector<size_t> GetFeaturesInArea(const float &x, const float  &y, const float  &r, const int minLevel=-1, const int maxLevel=-1) const;
 
@@ -128,9 +143,9 @@ class Frame {
   int N;
 
   // Vector of keypoints (original for visualization) and undistorted (actually used by the system).
-  // In the RGB-D case, RGB images can be distorted.
+  // Undistorted keypoints are stored as struct-of-arrays. In the RGB-D case, RGB images can be distorted.
   std::vector<cv::KeyPoint> mvKeys;
-  std::vector<cv::KeyPoint> mvKeysUn;
+  KeyPointArray mvKeysUn;
 
   // Corresponding stereo coordinate and depth for each keypoint.
   // "Monocular" keypoints have a negative value.
@@ -143,8 +158,8 @@ class Frame {
   // MapPoints associated to keypoints, NULL pointer if no association.
   std::vector<MapPoint*> mvpMapPoints;
 
-  // Flag to identify outlier associations.
-  std::vector<bool> mvbOutlier;
+  // Flag to identify outlier associations (bytes, not packed bits, as they are written per element).
+  std::vector<uint8_t> mvbOutlier;
 
   // Keypoints are assigned to cells in a grid to reduce matching complexity when projecting MapPoints.
   static float mfGridElementWidthInv;
@@ -159,6 +174,9 @@ class Frame {
   static long unsigned int nNextId;
   long unsigned int mnId;
 
+  // True if keypoints were propagated with optical flow instead of extracted.
+  bool mbOpticalFlow;
+
   // Reference Keyframe.
   KeyFrame* mpReferenceKF;
 
@@ -179,8 +197,17 @@ class Frame {
 
   static bool mbInitialComputations;
 
+  // Distortion tables of the camera, NULL without distortion (computed once).
+  static CameraDistortion *mpDistortion;
+
   // Image pyramid
   std::vector<cv::Mat> mvImagePyramid;
+
+  // Pyramid used by ImageAlign, rectified levels or the same images as mvImagePyramid
+  std::vector<cv::Mat> mvAlignPyramid;
+
+  // Lucas-Kanade pyramid with derivatives, only in optical flow frames
+  std::vector<cv::Mat> mvFlowPyramid;
   cv::Mat mDepthImage;
 
  private:
@@ -192,6 +219,12 @@ class Frame {
   // Computes image bounds for the undistorted image (called in the constructor).
   void ComputeImageBounds(const cv::Mat &imLeft);
 
+  // Rectify pyramid levels used by ImageAlign if required (called in the constructor).
+  void ComputeAlignPyramid();
+
+  // Track keypoints of the last frame with MapPoints using pyramidal Lucas-Kanade (called in the constructor).
+  void PropagateKeyPoints(const Frame &LastFrame);
+
   // Assign keypoints to the grid for speed up feature matching (called in the constructor).
   void AssignFeaturesToGrid();
 
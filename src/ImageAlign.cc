@@ -18,8 +18,11 @@
  */
 
 #include "ImageAlign.h"
+#include <algorithm>
 #include "extra/timer.h"
 #include "extra/log.h"
+#include "Config.h"
+#include "extra/parallel_for.h"
 
 using std::vector;
 using std::endl;
@@ -33,19 +36,31 @@ ImageAlign::ImageAlign() {
   error_ = 1e10;
   n_meas_ = 0;
 
-  patch_size_ = 4;
-  max_level_ = 4;
-  min_level_ = 2;
+  max_level_ = kMaxLevel;
+  min_level_ = kMinLevel;
   max_its_ = 30;
+  cur_level_ = min_level_;
+
+  // Rectified pyramids (mode 2) are aligned as pinhole images
+  distortion_ = Config::AlignDistortion() == 1 ? Frame::mpDistortion : NULL;
+
+  level_time_.resize(max_level_+1, 0.0);
+  level_its_.resize(max_level_+1, 0);
+
+  level_ = NULL;
+  reference_kf_ = NULL;
+  reference_version_ = 0;
+  max_points_ = 0;
+  new_levels_ = false;
 }
 
 ImageAlign::~ImageAlign() {
 }
 
 bool ImageAlign::ComputePose(Frame &CurrentFrame, const Frame &LastFrame) {
-  int size, patch_area, counter;
+  int size;
   float scale;
-  int max_points = 300;
+  int max_points = Config::AlignMaxPoints();
 
   cam_fx_ = CurrentFrame.fx;
   cam_fy_ = CurrentFrame.fy;
@@ -60,16 +75,8 @@ bool ImageAlign::ComputePose(Frame &CurrentFrame, const Frame &LastFrame) {
   }
 
   // Save valid points seen in last frame
-  counter = 0;
-  for (int i = 0; i<LastFrame.N && counter<max_points; i++) {
-    MapPoint* pMP = LastFrame.mvpMapPoints[i];
-    if (!pMP || LastFrame.mvbOutlier[i])
-      continue;
-
-    Eigen::Vector3d p = pMP->GetWorldPos();
-    points_.push_back(p);
-    counter++;
-  }
+  SelectPoints(LastFrame.mvKeys, LastFrame.mvpMapPoints, &LastFrame.mvbOutlier, LastFrame.mvImagePyramid[min_level_],
+               LastFrame.mvInvScaleFactors[min_level_], max_points, true);
 
   size = points_.size();
   if (size == 0) {
@@ -77,20 +84,15 @@ bool ImageAlign::ComputePose(Frame &CurrentFrame, const Frame &LastFrame) {
     return false;
   }
 
-  patch_area = patch_size_*patch_size_;
-  patch_cache_ = cv::Mat(size, patch_area, CV_32F);
-  visible_pts_.resize(size, false);
-  jacobian_cache_.resize(Eigen::NoChange, size*patch_area);
+  levels_.assign(max_level_+1, std::shared_ptr<const AlignReference::Level>());
 
   // Initial displacement between frames.
   Eigen::Matrix4d current_se3 = CurrentFrame.GetPose() * LastFrame.GetPoseInverse();
   Eigen::Matrix4d last_pose = LastFrame.GetPose();
 
   for (int level = max_level_; level >= min_level_; level--) {
-    jacobian_cache_.setZero();
-
     scale = CurrentFrame.mvInvScaleFactors[level];
-    Optimize(CurrentFrame.mvImagePyramid[level], LastFrame.mvImagePyramid[level], last_pose, current_se3, scale);
+    Optimize(CurrentFrame.mvAlignPyramid[level], LastFrame.mvAlignPyramid[level], last_pose, current_se3, scale, level);
   }
 
   Eigen::Matrix4d pose = current_se3 * last_pose;
@@ -99,19 +101,28 @@ bool ImageAlign::ComputePose(Frame &CurrentFrame, const Frame &LastFrame) {
   total.Stop();
   LOGD("Align time is %.2fms", total.GetMsTime());
   LOGD("Aligned: [%.4f, %.4f, %.4f]", pose(0, 3), pose(1, 3), pose(2, 3));
+  LogLevelTimes();
 
   return true;
 }
 
 bool ImageAlign::ComputePose(Frame &CurrentFrame, KeyFrame *LastKF, bool fast) {
-  int size, patch_area, counter;
+  return AlignLevels(CurrentFrame, LastKF, fast, max_level_);
+}
+
+bool ImageAlign::ComputeFinePose(Frame &CurrentFrame, KeyFrame *LastKF) {
+  return AlignLevels(CurrentFrame, LastKF, true, max_level_-1);
+}
+
+bool ImageAlign::AlignLevels(Frame &CurrentFrame, KeyFrame *LastKF, bool fast, int start_level) {
+  int size;
   float scale;
   int max_points;
 
   if (fast)
-    max_points = 100;
+    max_points = Config::AlignFastMaxPoints();
   else
-    max_points = 300;
+    max_points = Config::AlignMaxPoints();
 
   cam_fx_ = CurrentFrame.fx;
   cam_fy_ = CurrentFrame.fy;
@@ -126,14 +137,7 @@ bool ImageAlign::ComputePose(Frame &CurrentFrame, KeyFrame *LastKF, bool fast) {
   }
 
   // Save valid points seen in last keyframe
-  const set<MapPoint*> mappoints = LastKF->GetMapPoints();
-  counter = 0;
-  for (auto it = mappoints.begin(); it != mappoints.end() && counter<max_points; it++) {
-    MapPoint* pMP = *it;
-    Eigen::Vector3d p = pMP->GetWorldPos();
-    points_.push_back(p);
-    counter++;
-  }
+  LoadReference(LastKF, max_points);
 
   size = points_.size();
   if (size == 0) {
@@ -141,28 +145,24 @@ bool ImageAlign::ComputePose(Frame &CurrentFrame, KeyFrame *LastKF, bool fast) {
     return false;
   }
 
-  patch_area = patch_size_*patch_size_;
-  patch_cache_ = cv::Mat(size, patch_area, CV_32F);
-  visible_pts_.resize(size, false);
-  jacobian_cache_.resize(Eigen::NoChange, size*patch_area);
-
   // Initial displacement between frames.
   Eigen::Matrix4d current_se3 = CurrentFrame.GetPose() * LastKF->GetPoseInverse();
   Eigen::Matrix4d last_pose = LastKF->GetPose();
 
-  for (int level = max_level_; level >= min_level_; level--) {
-    jacobian_cache_.setZero();
-
+  for (int level = start_level; level >= min_level_; level--) {
     scale = CurrentFrame.mvInvScaleFactors[level];
-    Optimize(CurrentFrame.mvImagePyramid[level], LastKF->mvImagePyramid[level], last_pose, current_se3, scale);
+    Optimize(CurrentFrame.mvAlignPyramid[level], LastKF->mvAlignPyramid[level], last_pose, current_se3, scale, level);
 
     // High error in max level means frames are not close, skip other levels
     if (fast && error_ > 0.01) {
+      StoreReference();
       error_ = 1e10;
       return false;
     }
   }
 
+  StoreReference();
+
   Eigen::Matrix4d pose = current_se3 * last_pose;
   CurrentFrame.SetPose(pose);
 
@@ -170,15 +170,16 @@ bool ImageAlign::ComputePose(Frame &CurrentFrame, KeyFrame *LastKF, bool fast) {
     total.Stop();
     LOGD("Align time is %.2fms", total.GetMsTime());
     LOGD("Aligned: [%.4f, %.4f, %.4f]", pose(0, 3), pose(1, 3), pose(2, 3));
+    LogLevelTimes();
   }
 
   return true;
 }
 
 bool ImageAlign::ComputePose(KeyFrame *CurrentKF, KeyFrame *LastKF) {
-  int size, patch_area, counter;
+  int size;
   float scale;
-  int max_points = 100;
+  int max_points = Config::AlignFastMaxPoints();
 
   cam_fx_ = CurrentKF->fx;
   cam_fy_ = CurrentKF->fy;
@@ -191,14 +192,7 @@ bool ImageAlign::ComputePose(KeyFrame *CurrentKF, KeyFrame *LastKF) {
   }
 
   // Save valid points seen in last keyframe
-  const set<MapPoint*> mappoints = LastKF->GetMapPoints();
-  counter = 0;
-  for (auto it = mappoints.begin(); it != mappoints.end() && counter<max_points; it++) {
-    MapPoint* pMP = *it;
-    Eigen::Vector3d p = pMP->GetWorldPos();
-    points_.push_back(p);
-    counter++;
-  }
+  LoadReference(LastKF, max_points);
 
   size = points_.size();
   if (size == 0) {
@@ -206,21 +200,16 @@ bool ImageAlign::ComputePose(KeyFrame *CurrentKF, KeyFrame *LastKF) {
     return false;
   }
 
-  patch_area = patch_size_*patch_size_;
-  patch_cache_ = cv::Mat(size, patch_area, CV_32F);
-  visible_pts_.resize(size, false);
-  jacobian_cache_.resize(Eigen::NoChange, size*patch_area);
-
   // Initial displacement between frames.
   Eigen::Matrix4d current_se3 = Eigen::Matrix4d::Identity();
   Eigen::Matrix4d last_pose = LastKF->GetPose();
 
   // Only last level
   int level = max_level_;
-  jacobian_cache_.setZero();
 
   scale = 1.0/CurrentKF->mvScaleFactors[level];
-  Optimize(CurrentKF->mvImagePyramid[level], LastKF->mvImagePyramid[level], last_pose, current_se3, scale);
+  Optimize(CurrentKF->mvAlignPyramid[level], LastKF->mvAlignPyramid[level], last_pose, current_se3, scale, level);
+  StoreReference();
 
   // High error in max level means frames are not close, skip other levels
   if (error_ > 0.03) {
@@ -231,20 +220,101 @@ bool ImageAlign::ComputePose(KeyFrame *CurrentKF, KeyFrame *LastKF) {
   return true;
 }
 
+bool ImageAlign::ComputeCoarsePose(const Frame &CurrentFrame, KeyFrame *LastKF, Eigen::Matrix4d *pose) {
+  int max_points = Config::AlignFastMaxPoints();
+
+  cam_fx_ = CurrentFrame.fx;
+  cam_fy_ = CurrentFrame.fy;
+  cam_cx_ = CurrentFrame.cx;
+  cam_cy_ = CurrentFrame.cy;
+
+  if (static_cast<int>(CurrentFrame.mvImagePyramid.size()) <= max_level_) {
+    LOGE("Not enough pyramid levels");
+    return false;
+  }
+
+  // Save valid points seen in last keyframe
+  LoadReference(LastKF, max_points);
+  if (points_.empty())
+    return false;
+
+  // Initial displacement between frames.
+  Eigen::Matrix4d current_se3 = Eigen::Matrix4d::Identity();
+  Eigen::Matrix4d last_pose = LastKF->GetPose();
+
+  // Only last level, same threshold as fast alignment
+  int level = max_level_;
+  float scale = CurrentFrame.mvInvScaleFactors[level];
+  Optimize(CurrentFrame.mvAlignPyramid[level], LastKF->mvAlignPyramid[level], last_pose, current_se3, scale, level);
+  StoreReference();
+
+  if (error_ > 0.01) {
+    error_ = 1e10;
+    return false;
+  }
+
+  *pose = current_se3 * last_pose;
+  return true;
+}
+
+std::vector<std::pair<KeyFrame*, double> > ImageAlign::RankKeyFrames(const Frame &CurrentFrame,
+                                                                     const std::vector<KeyFrame*> &vpKFs, int threads,
+                                                                     std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > *poses) {
+  std::vector<double> errors(vpKFs.size(), -1.0);
+  std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > coarse_poses(vpKFs.size());
+
+  ParallelFor(0, vpKFs.size(), threads, [&](int i) {
+    ImageAlign image_align;
+    if (image_align.ComputeCoarsePose(CurrentFrame, vpKFs[i], &coarse_poses[i]))
+      errors[i] = image_align.GetError();
+  });
+
+  // Keyframes with non negative error sorted by error
+  std::vector<int> indices;
+  for (size_t i = 0; i < vpKFs.size(); i++) {
+    if (errors[i] >= 0.0)
+      indices.push_back(i);
+  }
+
+  std::stable_sort(indices.begin(), indices.end(), [&](int a, int b) {
+    return errors[a] < errors[b];
+  });
+
+  std::vector<std::pair<KeyFrame*, double> > ranked;
+  poses->clear();
+  for (size_t i = 0; i < indices.size(); i++) {
+    ranked.push_back(std::make_pair(vpKFs[indices[i]], errors[indices[i]]));
+    poses->push_back(coarse_poses[indices[i]]);
+  }
+
+  return ranked;
+}
+
 void ImageAlign::Optimize(const cv::Mat &src, const cv::Mat &last_img, const Eigen::Matrix4d &last_pose,
-                          Eigen::Matrix4d &se3, float scale) {
+                          Eigen::Matrix4d &se3, float scale, int level) {
   Eigen::Matrix<double, 6, 1>  x;
   Eigen::Matrix4d se3_bk = se3;
   bool small = false;
+  Timer timer(true);
+  cur_level_ = level;
+
+  // Compute patches only if they are not cached
+  if (!levels_[level]) {
+    const AlignReference::Level *previous = level < max_level_ ? levels_[level+1].get() : NULL;
+    levels_[level] = PrecomputePatches(last_img, last_pose, scale, previous);
+    new_levels_ = true;
+  }
+  level_ = levels_[level].get();
 
   // Perform iterative estimation
+  level_its_[level] = 0;
   for (int i = 0; i < max_its_; i++) {
-    H_.setZero();
+    level_its_[level]++;
     Jres_.setZero();
 
     // compute initial error
     n_meas_ = 0;
-    double new_chi2 = ComputeResiduals(src, last_img, last_pose, se3, scale, i == 0);
+    double new_chi2 = ComputeResiduals(src, last_pose, se3, scale);
     if (n_meas_ == 0)
       stop_ = true;
 
@@ -276,28 +346,34 @@ void ImageAlign::Optimize(const cv::Mat &src, const cv::Mat &last_img, const Eig
     if (error_ <= 1e-10 || small)
       break;
   }
-}
 
-double ImageAlign::ComputeResiduals(const cv::Mat &src, const cv::Mat &last_img, const Eigen::Matrix4d &last_pose,
-                                    const Eigen::Matrix4d &se3, float scale, bool patches) {
-  Eigen::Vector2d p2d;
-  int half_patch, patch_area, border;
+  timer.Stop();
+  level_time_[level] = timer.GetMsTime();
+}
 
-  half_patch = patch_size_/2;
-  patch_area = patch_size_*patch_size_;
-  border = half_patch+1;
+void ImageAlign::LogLevelTimes() {
+  for (int level = max_level_; level >= min_level_; level--) {
+    LOGD("Align level %d: %d its, %.2fms", level, level_its_[level], level_time_[level]);
+  }
+}
 
-  // Compute patches only the first time
-  if (patches)
-    PrecomputePatches(last_img, last_pose, scale);
+double ImageAlign::ComputeResiduals(const cv::Mat &src, const Eigen::Matrix4d &last_pose,
+                                    const Eigen::Matrix4d &se3, float scale) {
+  Eigen::Vector2d p2d;
+  const int half_patch = kPatchSize/2;
+  const int border = half_patch+1;
 
   Eigen::Matrix4d pose = se3 * last_pose;
   Eigen::Matrix3d R = pose.block<3, 3>(0, 0);
   Eigen::Vector3d T = pose.block<3, 1>(0, 3);
 
+  // Start with the Hessian of every visible point and remove points not found in current image
+  H_ = level_->hessian;
+
   float chi2 = 0.0;
   size_t counter = 0;
-  vector<bool>::iterator vit = visible_pts_.begin();
+  vector<bool>::const_iterator vit = level_->visible.begin();
+  PatchVector res;
 
   // Check each point detected in last image
   for (auto it=points_.begin(); it != points_.end(); it++, counter++, vit++) {
@@ -308,15 +384,23 @@ double ImageAlign::ComputeResiduals(const cv::Mat &src, const cv::Mat &last_img,
       continue;
 
     // Project in current frame with candidate pose and check if it fits within image
-    if(!Project(R, T, p, p2d))
+    if(!Project(R, T, p, p2d)) {
+      H_ -= level_->hessians[counter];
       continue;
+    }
 
-    const float u_cur = p2d(0)*scale;
-    const float v_cur = p2d(1)*scale;
+    float u_cur = p2d(0)*scale;
+    float v_cur = p2d(1)*scale;
+    if (distortion_ && !distortion_->Distort(cur_level_, u_cur, v_cur, &u_cur, &v_cur)) {
+      H_ -= level_->hessians[counter];
+      continue;
+    }
     const int u_last_i = floorf(u_cur);
     const int v_last_i = floorf(v_cur);
-    if (u_last_i < 0 || v_last_i < 0 || u_last_i-border < 0 || v_last_i-border < 0 || u_last_i+border >= src.cols || v_last_i+border >= src.rows)
+    if (u_last_i < 0 || v_last_i < 0 || u_last_i-border < 0 || v_last_i-border < 0 || u_last_i+border >= src.cols || v_last_i+border >= src.rows) {
+      H_ -= level_->hessians[counter];
       continue;
+    }
 
     // compute bilateral interpolation weights for the current image
     const float subpix_u_cur = u_cur-u_last_i;
@@ -326,57 +410,76 @@ double ImageAlign::ComputeResiduals(const cv::Mat &src, const cv::Mat &last_img,
     const float w_last_bl = (1.0-subpix_u_cur) * subpix_v_cur;
     const float w_last_br = subpix_u_cur * subpix_v_cur;
 
-    float* patch_cache_ptr = reinterpret_cast<float*>(patch_cache_.data) + patch_area*counter;
-    size_t pixel_counter = 0;  // is used to compute the index of the cached jacobian
-
-    for (int y=v_last_i-half_patch; y < v_last_i+half_patch; y++) {
-      const uint8_t* row_ptr = src.ptr<uint8_t>(y);
-      const uint8_t* row_next_ptr = src.ptr<uint8_t>(y+1);
-      for (int x=u_last_i-half_patch; x < u_last_i+half_patch; x++, pixel_counter++, patch_cache_ptr++) {
-        // compute residual
+    // Interpolate the patch row by row, fixed size loops are vectorized by the compiler
+    const float* patch_cache_ptr = reinterpret_cast<const float*>(level_->patches.data) + kPatchArea*counter;
+    float* res_ptr = res.data();
+    for (int y = 0; y < kPatchSize; y++, res_ptr += kPatchSize, patch_cache_ptr += kPatchSize) {
+      const uint8_t* row_ptr = src.ptr<uint8_t>(v_last_i-half_patch+y) + u_last_i-half_patch;
+      const uint8_t* row_next_ptr = src.ptr<uint8_t>(v_last_i-half_patch+y+1) + u_last_i-half_patch;
+      for (int x = 0; x < kPatchSize; x++) {
         const float intensity_cur = w_last_tl*row_ptr[x] + w_last_tr*row_ptr[x+1] + w_last_bl*row_next_ptr[x] + w_last_br*row_next_ptr[x+1];
-        const float res = intensity_cur - (*patch_cache_ptr);
-
-        float weight = 1.0;
-        chi2 += res*res*weight;
-        n_meas_++;
-
-        // Compute Jacobian, weighted Hessian and weighted "steepest descend images" (times error)
-        const Eigen::Matrix<double, 6, 1> J = jacobian_cache_.col(counter*patch_area + pixel_counter);
-        H_.noalias() += J*J.transpose()*weight;
-        Jres_.noalias() -= J*res*weight;
+        res_ptr[x] = intensity_cur - patch_cache_ptr[x];
       }
     }
+
+    chi2 += res.squaredNorm();
+    n_meas_ += kPatchArea;
+
+    // Weighted "steepest descend images" (times error), Hessian is already computed
+    const Eigen::Map<const PatchJacobian> J(level_->jacobians.data() + 6*kPatchArea*counter);
+    Jres_.noalias() -= (J*res).cast<double>();
   }
 
   return chi2/n_meas_;
 }
 
-void ImageAlign::PrecomputePatches(const cv::Mat &src, const Eigen::Matrix4d &pose, float scale) {
+std::shared_ptr<const AlignReference::Level> ImageAlign::PrecomputePatches(const cv::Mat &src, const Eigen::Matrix4d &pose,
+                                                                       float scale, const AlignReference::Level *previous) {
   Eigen::Vector2d p2d;
-  int half_patch, patch_area, border;
+  const int half_patch = kPatchSize/2;
+  const int patch_area = kPatchArea;
+  const int border = half_patch+1;
+  const int size = points_.size();
+
+  // Points visible in upper levels are kept as visible
+  std::shared_ptr<AlignReference::Level> level = std::make_shared<AlignReference::Level>();
+  if (previous) {
+    level->patches = previous->patches.clone();
+    level->visible = previous->visible;
+  } else {
+    level->patches = cv::Mat(size, patch_area, CV_32F);
+    level->visible.resize(size, false);
+  }
+  level->jacobians.setZero(Eigen::NoChange, size*patch_area);
+  level->hessians.resize(size);
+  level->hessian.setZero();
 
-  half_patch = patch_size_/2;
-  patch_area = patch_size_*patch_size_;
-  border = half_patch+1;
+  cv::Mat &patch_cache = level->patches;
+  Eigen::Matrix<float, 6, Eigen::Dynamic, Eigen::ColMajor> &jacobian_cache = level->jacobians;
 
   Eigen::Matrix3d R = pose.block<3, 3>(0, 0);
   Eigen::Vector3d T = pose.block<3, 1>(0, 3);
 
   size_t counter = 0;
   Eigen::Matrix<double, 2, 6> frame_jac;
-  vector<bool>::iterator vit = visible_pts_.begin();
+  vector<bool>::iterator vit = level->visible.begin();
 
   // Check each point detected in last image
   for (auto it=points_.begin(); it != points_.end(); it++, counter++, vit++) {
     Eigen::Vector3d p = *it;
+    level->hessians[counter].setZero();
 
     // Project in last frame and check if it fits within image
     if(!Project(R, T, p, p2d))
       continue;
 
-    const float u_ref = p2d(0)*scale;
-    const float v_ref = p2d(1)*scale;
+    float u_ref = p2d(0)*scale;
+    float v_ref = p2d(1)*scale;
+
+    // Sample raw image at the distorted position, D maps undistorted to distorted pixels
+    Eigen::Matrix2f D = Eigen::Matrix2f::Identity();
+    if (distortion_ && !distortion_->Distort(cur_level_, u_ref, v_ref, &u_ref, &v_ref, &D))
+      continue;
     const int u_first_i = floorf(u_ref);
     const int v_first_i = floorf(v_ref);
     if (u_first_i-border < 0 || v_first_i-border < 0 || u_first_i+border >= src.cols || v_first_i+border >= src.rows)
@@ -395,7 +498,7 @@ void ImageAlign::PrecomputePatches(const cv::Mat &src, const Eigen::Matrix4d &po
     const float w_first_bl = (1.0-subpix_u_ref) * subpix_v_ref;
     const float w_first_br = subpix_u_ref * subpix_v_ref;
     size_t pixel_counter = 0;
-    float* cache_ptr = reinterpret_cast<float*>(patch_cache_.data) + patch_area*counter;
+    float* cache_ptr = reinterpret_cast<float*>(patch_cache.data) + patch_area*counter;
 
     for (int y=v_first_i-half_patch; y < v_first_i+half_patch; y++) {
       const uint8_t* row_ptr = src.ptr<uint8_t>(y);
@@ -413,11 +516,144 @@ void ImageAlign::PrecomputePatches(const cv::Mat &src, const Eigen::Matrix4d &po
         float dy = 0.5f * ((w_first_tl*row_next_ptr[x] + w_first_tr*row_next_ptr[x+1] + w_first_bl*row_next2_ptr[x] + w_first_br*row_next2_ptr[x+1])
                           -(w_first_tl*row_prev_ptr[x] + w_first_tr*row_prev_ptr[x+1] + w_first_bl*row_ptr[x] + w_first_br*row_ptr[x+1]));
 
+        // Gradient with respect to the undistorted position
+        if (distortion_) {
+          const float gx = dx*D(0, 0) + dy*D(1, 0);
+          const float gy = dx*D(0, 1) + dy*D(1, 1);
+          dx = gx;
+          dy = gy;
+        }
+
         // cache the jacobian
-        jacobian_cache_.col(counter*patch_area + pixel_counter) = (dx*frame_jac.row(0) + dy*frame_jac.row(1))*(cam_fx_*scale);
+        jacobian_cache.col(counter*patch_area + pixel_counter) = ((dx*frame_jac.row(0) + dy*frame_jac.row(1))*(cam_fx_*scale)).cast<float>();
       }
     }
+
+    // Hessian of the patch, used in every iteration of this level
+    const Eigen::Matrix<double, 6, kPatchArea> J = jacobian_cache.block<6, kPatchArea>(0, counter*patch_area).cast<double>();
+    level->hessians[counter].noalias() = J*J.transpose();
+    level->hessian += level->hessians[counter];
   }
+
+  return level;
+}
+
+void ImageAlign::LoadReference(KeyFrame *KF, int max_points) {
+  reference_kf_ = KF;
+  max_points_ = max_points;
+  new_levels_ = false;
+  std::shared_ptr<const AlignReference> ref = KF->GetAlignReference(&reference_version_);
+
+  // Reuse cached reference if its points did not move
+  if (ref && ref->max_points == max_points) {
+    bool valid = true;
+    for (size_t i = 0; i < ref->mappoints.size() && valid; i++)
+      valid = ref->mappoints[i]->GetWorldPos() == ref->points[i];
+
+    if (valid) {
+      mappoints_ = ref->mappoints;
+      points_ = ref->points;
+      levels_ = ref->levels;
+      return;
+    }
+  }
+
+  SelectPoints(KF->mvKeys, KF->GetMapPointMatches(), NULL, KF->mvImagePyramid[min_level_],
+               1.0/KF->mvScaleFactors[min_level_], max_points, false);
+
+  levels_.assign(max_level_+1, std::shared_ptr<const AlignReference::Level>());
+}
+
+void ImageAlign::SelectPoints(const std::vector<cv::KeyPoint> &keys, const std::vector<MapPoint*> &mappoints,
+                              const std::vector<uint8_t> *outliers, const cv::Mat &image, float scale, int max_points,
+                              bool recent) {
+  struct Candidate {
+    int cell;
+    float score;
+    int idx;
+  };
+
+  if (max_points <= 0 || image.empty())
+    return;
+
+  // Grid with about one cell per point
+  const float width = image.cols/scale;
+  const float height = image.rows/scale;
+  const float cell_size = std::max(1.0f, std::sqrt(width*height/max_points));
+  const int cols = std::ceil(width/cell_size);
+  const int rows = std::ceil(height/cell_size);
+
+  // Points seen long ago by tracking are less reliable. Keyframe references are built from
+  // other threads too and shared, so they do not use it
+  long unsigned int last_seen = 0;
+  for (size_t i = 0; i < mappoints.size() && recent; i++) {
+    if (mappoints[i])
+      last_seen = std::max(last_seen, mappoints[i]->mnLastFrameSeen);
+  }
+
+  vector<Candidate> candidates;
+  candidates.reserve(mappoints.size());
+  for (size_t i = 0; i < mappoints.size(); i++) {
+    MapPoint* pMP = mappoints[i];
+    if (!pMP || (outliers && (*outliers)[i]) || pMP->isBad())
+      continue;
+
+    // Gradient magnitude at keypoint position in the finest aligned level
+    const int u = std::min(std::max(static_cast<int>(keys[i].pt.x*scale), 1), image.cols-2);
+    const int v = std::min(std::max(static_cast<int>(keys[i].pt.y*scale), 1), image.rows-2);
+    const float dx = image.at<uint8_t>(v, u+1) - image.at<uint8_t>(v, u-1);
+    const float dy = image.at<uint8_t>(v+1, u) - image.at<uint8_t>(v-1, u);
+
+    Candidate c;
+    const int col = std::min(std::max(static_cast<int>(keys[i].pt.x/cell_size), 0), cols-1);
+    const int row = std::min(std::max(static_cast<int>(keys[i].pt.y/cell_size), 0), rows-1);
+    c.cell = row*cols + col;
+    c.score = std::sqrt(dx*dx + dy*dy) * pMP->GetFoundRatio();
+    if (recent && pMP->mnLastFrameSeen + 30 < last_seen)
+      c.score *= 0.5f;
+    c.idx = i;
+    candidates.push_back(c);
+  }
+
+  // Sort by cell and score, ties by index
+  std::sort(candidates.begin(), candidates.end(), [](const Candidate &a, const Candidate &b) {
+    if (a.cell != b.cell)
+      return a.cell < b.cell;
+    if (a.score != b.score)
+      return a.score > b.score;
+    return a.idx < b.idx;
+  });
+
+  // Take the best point of each cell, then the second best, etc.
+  vector<int> rank(candidates.size());
+  for (size_t i = 0; i < candidates.size(); i++)
+    rank[i] = (i > 0 && candidates[i].cell == candidates[i-1].cell) ? rank[i-1]+1 : 0;
+
+  vector<int> order(candidates.size());
+  for (size_t i = 0; i < order.size(); i++)
+    order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [&rank](int a, int b) {
+    return rank[a] < rank[b];
+  });
+
+  for (size_t i = 0; i < order.size() && static_cast<int>(points_.size()) < max_points; i++) {
+    MapPoint* pMP = mappoints[candidates[order[i]].idx];
+    mappoints_.push_back(pMP);
+    points_.push_back(pMP->GetWorldPos());
+  }
+}
+
+void ImageAlign::StoreReference() {
+  if (!reference_kf_ || !new_levels_)
+    return;
+
+  std::shared_ptr<AlignReference> ref = std::make_shared<AlignReference>();
+  ref->max_points = max_points_;
+  ref->mappoints = mappoints_;
+  ref->points = points_;
+  ref->levels = levels_;
+  reference_kf_->SetAlignReference(ref, reference_version_);
+  new_levels_ = false;
 }
 
 bool ImageAlign::Project(const Eigen::Matrix3d &R, const Eigen::Vector3d &T,
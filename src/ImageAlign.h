@@ -22,13 +22,39 @@
 
 #include <iostream>
 #include <vector>
+#include <memory>
 #include <Eigen/Dense>
+#include <Eigen/StdVector>
 #include "Frame.h"
 
 namespace SD_SLAM {
 
+// Reference patches and Jacobians of the points seen in a keyframe. They only depend on
+// its pose and its points, so they are cached in the keyframe and shared between alignments.
+struct AlignReference {
+  typedef Eigen::Matrix<double, 6, 6> Matrix6d;
+
+  struct Level {
+    cv::Mat patches;                      // Reference patches
+    std::vector<bool> visible;            // Visible points
+    Eigen::Matrix<float, 6, Eigen::Dynamic, Eigen::ColMajor> jacobians;
+    std::vector<Matrix6d, Eigen::aligned_allocator<Matrix6d> > hessians;  // Hessian of each patch
+    Matrix6d hessian;                     // Sum of patch Hessians
+
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+  };
+
+  int max_points;
+  std::vector<MapPoint*> mappoints;
+  std::vector<Eigen::Vector3d> points;  // Positions when the reference was computed
+  std::vector<std::shared_ptr<const Level> > levels;  // NULL for levels not computed yet
+};
+
 class ImageAlign {
  public:
+  static const int kMinLevel = 2;   // Min search level
+  static const int kMaxLevel = 4;   // Max search level
+
   ImageAlign();
   ~ImageAlign();
 
@@ -41,18 +67,59 @@ class ImageAlign {
   // Compute pose between two keyframes. Used to detect loops (LoopClosing)
   bool ComputePose(KeyFrame *CurrentKF, KeyFrame *LastKF);
 
+  // Same as fast ComputePose, starting from a frame pose given by ComputeCoarsePose
+  // with the same keyframe. The coarsest level is not aligned again
+  bool ComputeFinePose(Frame &CurrentFrame, KeyFrame *LastKF);
+
+  // Align only the coarsest level of a frame and a keyframe, starting from the keyframe pose.
+  // The frame is not modified, the resulting frame pose is returned in pose
+  bool ComputeCoarsePose(const Frame &CurrentFrame, KeyFrame *LastKF, Eigen::Matrix4d *pose);
+
+  // Align a frame with several keyframes in parallel at the coarsest level. Keyframes with
+  // high error are rejected, the rest are returned sorted by error with their frame pose
+  static std::vector<std::pair<KeyFrame*, double> > RankKeyFrames(const Frame &CurrentFrame,
+                                                                  const std::vector<KeyFrame*> &vpKFs, int threads,
+                                                                  std::vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > *poses);
+
   inline double GetError() { return error_; }
 
+  // Time (ms) and iterations spent in a pyramid level by the last alignment
+  inline double GetLevelTime(int level) const { return level_time_[level]; }
+  inline int GetLevelIterations(int level) const { return level_its_[level]; }
+
  private:
   // Optimize using Gauss Newton strategy
-  void Optimize(const cv::Mat &src, const cv::Mat &last_img, const Eigen::Matrix4d &last_pose, Eigen::Matrix4d &se3, float scale);
+  void Optimize(const cv::Mat &src, const cv::Mat &last_img, const Eigen::Matrix4d &last_pose, Eigen::Matrix4d &se3,
+                float scale, int level);
+
+  // Log time spent in each level
+  void LogLevelTimes();
 
   // Compute residual and jacobians
-  double ComputeResiduals(const cv::Mat &src, const cv::Mat &last_img, const Eigen::Matrix4d &last_pose,
-                          const Eigen::Matrix4d &se3, float scale, bool patches);
+  double ComputeResiduals(const cv::Mat &src, const Eigen::Matrix4d &last_pose,
+                          const Eigen::Matrix4d &se3, float scale);
+
+  // Compute patches within a pyramid level, starting from the previous level
+  std::shared_ptr<const AlignReference::Level> PrecomputePatches(const cv::Mat &src, const Eigen::Matrix4d &pose,
+                                                                 float scale, const AlignReference::Level *previous);
 
-  // Compute patches within a pyramid level
-  void PrecomputePatches(const cv::Mat &src, const Eigen::Matrix4d &pose, float scale);
+  // Select points of a keyframe, reusing its cached reference if still valid
+  void LoadReference(KeyFrame *KF, int max_points);
+
+  // Select up to max_points points spread over a grid. In each cell points are sorted by
+  // gradient magnitude in image (at scale), tracking ratio and, if recent is set, recent
+  // observation by tracking. That is only read from the tracking thread, which writes it.
+  // Selection only depends on the input, not on memory addresses.
+  void SelectPoints(const std::vector<cv::KeyPoint> &keys, const std::vector<MapPoint*> &mappoints,
+                    const std::vector<uint8_t> *outliers, const cv::Mat &image, float scale, int max_points,
+                    bool recent);
+
+  // Save reference in the keyframe if new levels were computed
+  void StoreReference();
+
+  // Align a frame with a keyframe from level down to the finest one, starting from the
+  // current frame pose. With fast, stop when the error is high
+  bool AlignLevels(Frame &CurrentFrame, KeyFrame *LastKF, bool fast, int level);
 
   // Project point in image
   bool Project(const Eigen::Matrix3d &R, const Eigen::Vector3d &T,
@@ -69,27 +136,48 @@ class ImageAlign {
   Eigen::Quaterniond RotationExp(const Eigen::Vector3d &omega, double *theta);
   Eigen::Matrix3d RotationHat(const Eigen::Vector3d &v);
 
-  int patch_size_;    // Patch size
+  static const int kPatchSize = 4;                  // Patch size
+  static const int kPatchArea = kPatchSize*kPatchSize;
+
+  typedef Eigen::Matrix<float, 6, kPatchArea> PatchJacobian;
+  typedef Eigen::Matrix<float, kPatchArea, 1> PatchVector;
+
   int min_level_;     // Min search level
   int max_level_;     // Max search level
   int max_its_;       // Max align iterations
+  int cur_level_;     // Level being optimized
+
+  // Distortion tables if points are projected onto raw images, NULL otherwise
+  const CameraDistortion *distortion_;
 
   double chi2_;
   size_t  n_meas_;    // Number of measurements
   bool stop_;         // Stop flag
   double error_;      // Last optimization error
 
+  std::vector<double> level_time_;  // Time per level in ms
+  std::vector<int> level_its_;      // Iterations per level
+
   double cam_fx_;
   double cam_fy_;
   double cam_cx_;
   double cam_cy_;
 
-  cv::Mat patch_cache_;                 // Cache for patches
-  std::vector<bool> visible_pts_;       // Visible points
+  std::vector<MapPoint*> mappoints_;    // Points selected in a keyframe
   std::vector<Eigen::Vector3d> points_; // Valid points
   Eigen::Matrix<double, 6, 6>  H_;      // Hessian approximation
   Eigen::Matrix<double, 6, 1>  Jres_;   // Store Jacobian residual
-  Eigen::Matrix<double, 6, Eigen::Dynamic, Eigen::ColMajor> jacobian_cache_;
+
+  // Patches, Jacobians and Hessians of each level. Jacobians are fixed within a level
+  // (inverse compositional), so is the Hessian.
+  std::vector<std::shared_ptr<const AlignReference::Level> > levels_;
+  const AlignReference::Level *level_;  // Current level
+
+  // Keyframe whose reference is being used
+  KeyFrame *reference_kf_;
+  unsigned long reference_version_;
+  int max_points_;
+  bool new_levels_;
 
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
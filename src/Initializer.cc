@@ -37,7 +37,7 @@ namespace SD_SLAM {
 Initializer::Initializer(const Frame &ReferenceFrame, float sigma, int iterations) {
   mK = ReferenceFrame.mK;
 
-  mvKeys1 = ReferenceFrame.mvKeysUn;
+  mvKeys1 = ReferenceFrame.mvKeysUn.ToKeyPoints();
 
   mSigma = sigma;
   mSigma2 = sigma*sigma;
@@ -48,7 +48,7 @@ bool Initializer::Initialize(const Frame &CurrentFrame, const vector<int> &vMatc
                 Eigen::Vector3d &t21, vector<cv::Point3f> &vP3D, vector<bool> &vbTriangulated) {
   // Fill structures with current keypoints and matches with reference frame
   // Reference Frame: 1, Current Frame: 2
-  mvKeys2 = CurrentFrame.mvKeysUn;
+  mvKeys2 = CurrentFrame.mvKeysUn.ToKeyPoints();
 
   mvMatches12.clear();
   mvMatches12.reserve(mvKeys2.size());
@@ -23,12 +23,12 @@
  */
 
 #include "KeyFrame.h"
+#include <algorithm>
+#include <functional>
 #include "ORBmatcher.h"
 
 using std::vector;
 using std::set;
-using std::list;
-using std::map;
 using std::mutex;
 using std::unique_lock;
 
@@ -48,7 +48,7 @@ KeyFrame::KeyFrame(Frame &F, Map *pMap):
   mfLogScaleFactor(F.mfLogScaleFactor), mvScaleFactors(F.mvScaleFactors), mvLevelSigma2(F.mvLevelSigma2),
   mvInvLevelSigma2(F.mvInvLevelSigma2), mnMinX(F.mnMinX), mnMinY(F.mnMinY), mnMaxX(F.mnMaxX),
   mnMaxY(F.mnMaxY), mK(F.mK), mvpMapPoints(F.mvpMapPoints),
-  mbFirstConnection(true), mpParent(NULL), mbNotErase(false),
+  mbDescriptorIndexBuilt(false), mnAlignVersion(0), mbFirstConnection(true), mpParent(NULL), mbNotErase(false),
   mbToBeErased(false), mbBad(false), mHalfBaseline(F.mb/2), mpMap(pMap) {
   mnId=nNextId++;
 
@@ -67,6 +67,15 @@ KeyFrame::KeyFrame(Frame &F, Map *pMap):
   for (int i = 0; i < size; i++)
     mvImagePyramid[i] = F.mvImagePyramid[i].clone();
 
+  // Rectified levels are copied, the rest share the new pyramid
+  mvAlignPyramid.resize(F.mvAlignPyramid.size());
+  for (size_t i = 0; i < mvAlignPyramid.size(); i++) {
+    if (F.mvAlignPyramid[i].data == F.mvImagePyramid[i].data)
+      mvAlignPyramid[i] = mvImagePyramid[i];
+    else
+      mvAlignPyramid[i] = F.mvAlignPyramid[i].clone();
+  }
+
   mDepthImage = F.mDepthImage.clone();
 }
 
@@ -76,84 +85,129 @@ void KeyFrame::SetID(int n) {
 }
 
 void KeyFrame::SetPose(const Eigen::Matrix4d &Tcw_) {
+  InvalidateAlignReference();
+
   unique_lock<mutex> lock(mMutexPose);
 
   Eigen::Matrix4d m = Tcw_; // Somehow it fixes problems with Eigen
-  Tcw = m;
 
-  Eigen::Matrix3d Rcw = Tcw.block<3, 3>(0, 0);
+  Eigen::Matrix3d Rcw = m.block<3, 3>(0, 0);
   Eigen::Matrix3d Rwc = Rcw.transpose();
-  Eigen::Vector3d tcw = Tcw.block<3, 1>(0, 3);
-  Ow = -Rwc*tcw;
+  Eigen::Vector3d tcw = m.block<3, 1>(0, 3);
+  Eigen::Vector3d Ow_ = -Rwc*tcw;
+
+  Eigen::Matrix4d Twc_ = Eigen::Matrix4d::Identity();
+  Twc_.block<3, 3>(0, 0) = Rwc;
+  Twc_.block<3, 1>(0, 3) = Ow_;
 
-  Twc.setIdentity();
-  Twc.block<3, 3>(0, 0) = Rwc;
-  Twc.block<3, 1>(0, 3) = Ow;
+  {
+    // Publish new pose to lock-free readers
+    SeqLockWriter writer(mSeqPose);
+    Tcw.Store(m);
+    Twc.Store(Twc_);
+    Ow.Store(Ow_);
+  }
+
+  mpMap->UpdateKeyFrame(this, Ow_);
 }
 
 Eigen::Matrix4d KeyFrame::GetPose() {
-  unique_lock<mutex> lock(mMutexPose);
-  return Tcw;
+  return mSeqPose.Read(Tcw);
 }
 
 Eigen::Matrix4d KeyFrame::GetPoseInverse() {
-  unique_lock<mutex> lock(mMutexPose);
-  return Twc;
+  return mSeqPose.Read(Twc);
 }
 
 Eigen::Vector3d KeyFrame::GetCameraCenter() {
-  unique_lock<mutex> lock(mMutexPose);
-  return Ow;
+  return mSeqPose.Read(Ow);
 }
 
 Eigen::Matrix3d KeyFrame::GetRotation() {
-  unique_lock<mutex> lock(mMutexPose);
-  return Tcw.block<3, 3>(0, 0);
+  return mSeqPose.Read(Tcw).block<3, 3>(0, 0);
 }
 
 Eigen::Vector3d KeyFrame::GetTranslation() {
-  unique_lock<mutex> lock(mMutexPose);
-  return Tcw.block<3, 1>(0, 3);
+  return mSeqPose.Read(Tcw).block<3, 1>(0, 3);
+}
+
+// Flat connection arrays are kept sorted by keyframe
+static bool ConnectionLess(const std::pair<KeyFrame*, int> &a, KeyFrame* pKF) {
+  return a.first < pKF;
 }
 
 void KeyFrame::AddConnection(KeyFrame *pKF, const int &weight) {
-  {
-    unique_lock<mutex> lock(mMutexConnections);
-    if (!mConnectedKeyFrameWeights.count(pKF))
-      mConnectedKeyFrameWeights[pKF]=weight;
-    else if (mConnectedKeyFrameWeights[pKF]!=weight)
-      mConnectedKeyFrameWeights[pKF]=weight;
-    else
+  unique_lock<mutex> lock(mMutexConnections);
+
+  // Ordered list can only be patched if it holds every connection
+  bool bComplete = mvpOrderedConnectedKeyFrames.size() == mConnectedKeyFrameWeights.size();
+
+  vector<std::pair<KeyFrame*, int> >::iterator it = lower_bound(mConnectedKeyFrameWeights.begin(),
+    mConnectedKeyFrameWeights.end(), pKF, ConnectionLess);
+  if (it != mConnectedKeyFrameWeights.end() && it->first == pKF) {
+    if (it->second == weight)
       return;
+    if (bComplete)
+      EraseOrderedConnection(pKF, it->second);
+    it->second = weight;
+  } else {
+    mConnectedKeyFrameWeights.insert(it, std::make_pair(pKF, weight));
   }
 
-  UpdateBestCovisibles();
+  if (bComplete)
+    InsertOrderedConnection(pKF, weight);
+  else
+    SortConnections();
 }
 
 void KeyFrame::UpdateBestCovisibles() {
   unique_lock<mutex> lock(mMutexConnections);
+  SortConnections();
+}
+
+void KeyFrame::SortConnections() {
   vector<std::pair<int,KeyFrame*> > vPairs;
   vPairs.reserve(mConnectedKeyFrameWeights.size());
-  for (map<KeyFrame*, int>::iterator mit = mConnectedKeyFrameWeights.begin(), mend = mConnectedKeyFrameWeights.end(); mit != mend; mit++)
-     vPairs.push_back(std::make_pair(mit->second, mit->first));
+  for (size_t i = 0, iend = mConnectedKeyFrameWeights.size(); i < iend; i++)
+     vPairs.push_back(std::make_pair(mConnectedKeyFrameWeights[i].second, mConnectedKeyFrameWeights[i].first));
+
+  std::sort(vPairs.begin(), vPairs.end(), std::greater<std::pair<int,KeyFrame*> >());
 
-  std::sort(vPairs.begin(), vPairs.end());
-  list<KeyFrame*> lKFs;
-  list<int> lWs;
+  mvpOrderedConnectedKeyFrames.resize(vPairs.size());
+  mvOrderedWeights.resize(vPairs.size());
   for (size_t i = 0, iend=vPairs.size(); i < iend; i++) {
-    lKFs.push_front(vPairs[i].second);
-    lWs.push_front(vPairs[i].first);
+    mvpOrderedConnectedKeyFrames[i] = vPairs[i].second;
+    mvOrderedWeights[i] = vPairs[i].first;
   }
+}
+
+void KeyFrame::InsertOrderedConnection(KeyFrame *pKF, int weight) {
+  // Same order as SortConnections: decreasing weight, then decreasing pointer
+  vector<int>::iterator it = lower_bound(mvOrderedWeights.begin(), mvOrderedWeights.end(), weight, KeyFrame::weightComp);
+  size_t idx = it-mvOrderedWeights.begin();
+  while (idx < mvOrderedWeights.size() && mvOrderedWeights[idx] == weight && mvpOrderedConnectedKeyFrames[idx] > pKF)
+    idx++;
+
+  mvpOrderedConnectedKeyFrames.insert(mvpOrderedConnectedKeyFrames.begin()+idx, pKF);
+  mvOrderedWeights.insert(mvOrderedWeights.begin()+idx, weight);
+}
 
-  mvpOrderedConnectedKeyFrames = vector<KeyFrame*>(lKFs.begin(),lKFs.end());
-  mvOrderedWeights = vector<int>(lWs.begin(), lWs.end());
+void KeyFrame::EraseOrderedConnection(KeyFrame *pKF, int weight) {
+  vector<int>::iterator it = lower_bound(mvOrderedWeights.begin(), mvOrderedWeights.end(), weight, KeyFrame::weightComp);
+  for (size_t idx = it-mvOrderedWeights.begin(); idx < mvOrderedWeights.size() && mvOrderedWeights[idx] == weight; idx++) {
+    if (mvpOrderedConnectedKeyFrames[idx] == pKF) {
+      mvpOrderedConnectedKeyFrames.erase(mvpOrderedConnectedKeyFrames.begin()+idx);
+      mvOrderedWeights.erase(mvOrderedWeights.begin()+idx);
+      return;
+    }
+  }
 }
 
 set<KeyFrame*> KeyFrame::GetConnectedKeyFrames() {
   unique_lock<mutex> lock(mMutexConnections);
   set<KeyFrame*> s;
-  for (map<KeyFrame*, int>::iterator mit = mConnectedKeyFrameWeights.begin();mit != mConnectedKeyFrameWeights.end();mit++)
-    s.insert(mit->first);
+  for (size_t i = 0, iend = mConnectedKeyFrameWeights.size(); i < iend; i++)
+    s.insert(s.end(), mConnectedKeyFrameWeights[i].first);
   return s;
 }
 
@@ -187,13 +241,29 @@ vector<KeyFrame*> KeyFrame::GetCovisiblesByWeight(const int &w) {
 
 int KeyFrame::GetWeight(KeyFrame *pKF) {
   unique_lock<mutex> lock(mMutexConnections);
-  if (mConnectedKeyFrameWeights.count(pKF))
-    return mConnectedKeyFrameWeights[pKF];
+  vector<std::pair<KeyFrame*, int> >::iterator it = lower_bound(mConnectedKeyFrameWeights.begin(),
+    mConnectedKeyFrameWeights.end(), pKF, ConnectionLess);
+  if (it != mConnectedKeyFrameWeights.end() && it->first == pKF)
+    return it->second;
   else
     return 0;
 }
 
+void KeyFrame::ChangeCovisibility(KeyFrame *pKF, int n) {
+  unique_lock<mutex> lock(mMutexCounter);
+  vector<std::pair<KeyFrame*, int> >::iterator it = lower_bound(mvCovisibilityCounter.begin(),
+    mvCovisibilityCounter.end(), pKF, ConnectionLess);
+  if (it != mvCovisibilityCounter.end() && it->first == pKF) {
+    it->second += n;
+    if (it->second <= 0)
+      mvCovisibilityCounter.erase(it);
+  } else if (n > 0) {
+    mvCovisibilityCounter.insert(it, std::make_pair(pKF, n));
+  }
+}
+
 void KeyFrame::AddMapPoint(MapPoint *pMP, const size_t &idx) {
+  InvalidateAlignReference();
   unique_lock<mutex> lock(mMutexFeatures);
   mvpMapPoints[idx]=pMP;
 }
@@ -220,11 +290,13 @@ int KeyFrame::AddMapPoint(MapPoint* pMP, const Eigen::Vector2d &pos) {
 }
 
 void KeyFrame::EraseMapPointMatch(const size_t &idx) {
+  InvalidateAlignReference();
   unique_lock<mutex> lock(mMutexFeatures);
   mvpMapPoints[idx] = static_cast<MapPoint*>(NULL);
 }
 
 void KeyFrame::EraseMapPointMatch(MapPoint* pMP) {
+  InvalidateAlignReference();
   int idx = pMP->GetIndexInKeyFrame(this);
   if (idx >= 0)
     mvpMapPoints[idx] = static_cast<MapPoint*>(NULL);
@@ -232,6 +304,7 @@ void KeyFrame::EraseMapPointMatch(MapPoint* pMP) {
 
 
 void KeyFrame::ReplaceMapPointMatch(const size_t &idx, MapPoint* pMP) {
+  InvalidateAlignReference();
   mvpMapPoints[idx]=pMP;
 }
 
@@ -280,37 +353,16 @@ MapPoint* KeyFrame::GetMapPoint(const size_t &idx) {
 }
 
 void KeyFrame::UpdateConnections(bool checkID) {
-  map<KeyFrame*, int> KFcounter;
-
-  vector<MapPoint*> vpMP;
-
+  // Shared MapPoints are counted incrementally as observations change
+  vector<std::pair<KeyFrame*, int> > KFcounter;
   {
-    unique_lock<mutex> lockMPs(mMutexFeatures);
-    vpMP = mvpMapPoints;
-  }
-
-  //For all map points in keyframe check in which other keyframes are they seen
-  //Increase counter for those keyframes
-  for (vector<MapPoint*>::iterator vit=vpMP.begin(), vend=vpMP.end(); vit!=vend; vit++) {
-    MapPoint* pMP = *vit;
-
-    if (!pMP)
-      continue;
-
-    if (pMP->isBad())
-      continue;
-
-    map<KeyFrame*, size_t> observations = pMP->GetObservations();
-
-    for (map<KeyFrame*, size_t>::iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
-      if (mit->first->mnId == mnId)
-        continue;
-
+    unique_lock<mutex> lockCounter(mMutexCounter);
+    KFcounter.reserve(mvCovisibilityCounter.size());
+    for (size_t i = 0, iend = mvCovisibilityCounter.size(); i < iend; i++) {
       // Use only KFs previous to current KF
-      if (checkID && mit->first->mnId > mnId)
+      if (checkID && mvCovisibilityCounter[i].first->mnId > mnId)
         continue;
-
-      KFcounter[mit->first]++;
+      KFcounter.push_back(mvCovisibilityCounter[i]);
     }
   }
 
@@ -326,7 +378,7 @@ void KeyFrame::UpdateConnections(bool checkID) {
 
   vector<std::pair<int,KeyFrame*> > vPairs;
   vPairs.reserve(KFcounter.size());
-  for (map<KeyFrame*, int>::iterator mit=KFcounter.begin(), mend=KFcounter.end(); mit != mend; mit++) {
+  for (vector<std::pair<KeyFrame*, int> >::iterator mit=KFcounter.begin(), mend=KFcounter.end(); mit != mend; mit++) {
     if (mit->second>nmax) {
       nmax = mit->second;
       pKFmax = mit->first;
@@ -342,19 +394,17 @@ void KeyFrame::UpdateConnections(bool checkID) {
     pKFmax->AddConnection(this,nmax);
   }
 
-  std::sort(vPairs.begin(), vPairs.end());
-  list<KeyFrame*> lKFs;
-  list<int> lWs;
-  for (size_t i = 0; i < vPairs.size(); i++) {
-    lKFs.push_front(vPairs[i].second);
-    lWs.push_front(vPairs[i].first);
-  }
+  std::sort(vPairs.begin(), vPairs.end(), std::greater<std::pair<int,KeyFrame*> >());
 
   {
     unique_lock<mutex> lockCon(mMutexConnections);
-    mConnectedKeyFrameWeights = KFcounter;
-    mvpOrderedConnectedKeyFrames = vector<KeyFrame*>(lKFs.begin(),lKFs.end());
-    mvOrderedWeights = vector<int>(lWs.begin(), lWs.end());
+    mConnectedKeyFrameWeights.swap(KFcounter);
+    mvpOrderedConnectedKeyFrames.resize(vPairs.size());
+    mvOrderedWeights.resize(vPairs.size());
+    for (size_t i = 0; i < vPairs.size(); i++) {
+      mvpOrderedConnectedKeyFrames[i] = vPairs[i].second;
+      mvOrderedWeights[i] = vPairs[i].first;
+    }
 
     if (mbFirstConnection && mnId != 0) {
       mpParent = mvpOrderedConnectedKeyFrames.front();
@@ -438,7 +488,7 @@ void KeyFrame::SetBadFlag() {
     }
   }
 
-  for (map<KeyFrame*, int>::iterator mit = mConnectedKeyFrameWeights.begin(), mend = mConnectedKeyFrameWeights.end(); mit != mend; mit++)
+  for (vector<std::pair<KeyFrame*, int> >::iterator mit = mConnectedKeyFrameWeights.begin(), mend = mConnectedKeyFrameWeights.end(); mit != mend; mit++)
     mit->first->EraseConnection(this);
 
   for (size_t i = 0; i<mvpMapPoints.size(); i++)
@@ -513,17 +563,48 @@ bool KeyFrame::isBad() {
 }
 
 void KeyFrame::EraseConnection(KeyFrame* pKF) {
-  bool bUpdate = false;
-  {
-    unique_lock<mutex> lock(mMutexConnections);
-    if (mConnectedKeyFrameWeights.count(pKF)) {
-      mConnectedKeyFrameWeights.erase(pKF);
-      bUpdate=true;
-    }
+  unique_lock<mutex> lock(mMutexConnections);
+  vector<std::pair<KeyFrame*, int> >::iterator it = lower_bound(mConnectedKeyFrameWeights.begin(),
+    mConnectedKeyFrameWeights.end(), pKF, ConnectionLess);
+  if (it == mConnectedKeyFrameWeights.end() || it->first != pKF)
+    return;
+
+  bool bComplete = mvpOrderedConnectedKeyFrames.size() == mConnectedKeyFrameWeights.size();
+  int weight = it->second;
+  mConnectedKeyFrameWeights.erase(it);
+
+  if (bComplete)
+    EraseOrderedConnection(pKF, weight);
+  else
+    SortConnections();
+}
+
+const DescriptorIndex &KeyFrame::GetDescriptorIndex() {
+  unique_lock<mutex> lock(mMutexDescriptorIndex);
+  if (!mbDescriptorIndexBuilt) {
+    if (!mDescriptors.empty())
+      mDescriptorIndex.Build(mDescriptors.ptr<uint8_t>(0), mDescriptors.rows, mDescriptors.step);
+    mbDescriptorIndexBuilt = true;
   }
+  return mDescriptorIndex;
+}
+
+std::shared_ptr<const AlignReference> KeyFrame::GetAlignReference(unsigned long *version) {
+  unique_lock<mutex> lock(mMutexAlign);
+  *version = mnAlignVersion;
+  return mpAlignReference;
+}
+
+void KeyFrame::SetAlignReference(const std::shared_ptr<const AlignReference> &ref, unsigned long version) {
+  unique_lock<mutex> lock(mMutexAlign);
+  if (version == mnAlignVersion)
+    mpAlignReference = ref;
+}
 
-  if (bUpdate)
-    UpdateBestCovisibles();
+void KeyFrame::InvalidateAlignReference() {
+  unique_lock<mutex> lock(mMutexAlign);
+  mnAlignVersion++;
+  mpAlignReference.reset();
 }
 
 vector<size_t> KeyFrame::GetFeaturesInArea(const float &x, const float &y, const float &r) const
@@ -549,11 +630,10 @@ vector<size_t> KeyFrame::GetFeaturesInArea(const float &x, const float &y, const
 
   for (int ix = nMinCellX; ix<=nMaxCellX; ix++) {
     for (int iy = nMinCellY; iy<=nMaxCellY; iy++) {
-      const vector<size_t> vCell = mGrid[ix][iy];
+      const vector<size_t> &vCell = mGrid[ix][iy];
       for (size_t j = 0, jend=vCell.size(); j < jend; j++) {
-        const cv::KeyPoint &kpUn = mvKeysUn[vCell[j]];
-        const float distx = kpUn.pt.x-x;
-        const float disty = kpUn.pt.y-y;
+        const float distx = mvKeysUn.x[vCell[j]]-x;
+        const float disty = mvKeysUn.y[vCell[j]]-y;
 
         if (fabs(distx)<r && fabs(disty)<r)
           vIndices.push_back(vCell[j]);
@@ -578,8 +658,8 @@ Eigen::Vector3d KeyFrame::UnprojectStereo(int i) {
     const float y = (v-cy)*z*invfy;
     Eigen::Vector3d x3Dc(x, y, z);
 
-    unique_lock<mutex> lock(mMutexPose);
-    return Twc.block<3, 3>(0, 0)*x3Dc+Twc.block<3, 1>(0, 3);
+    const Eigen::Matrix4d Twc_ = GetPoseInverse();
+    return Twc_.block<3, 3>(0, 0)*x3Dc+Twc_.block<3, 1>(0, 3);
   } else
     return Eigen::Vector3d::Zero();
 }
@@ -591,7 +671,7 @@ float KeyFrame::ComputeSceneMedianDepth(const int q) {
     unique_lock<mutex> lock(mMutexFeatures);
     unique_lock<mutex> lock2(mMutexPose);
     vpMapPoints = mvpMapPoints;
-    Tcw_ = Tcw;
+    Tcw_ = Tcw.Load();
   }
 
   vector<float> vDepths;
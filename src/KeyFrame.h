@@ -26,16 +26,21 @@
 #define SD_SLAM_KEYFRAME_H
 
 #include <map>
+#include <memory>
 #include <mutex>
 #include "MapPoint.h"
 #include "ORBextractor.h"
 #include "Frame.h"
+#include "extra/seqlock.h"
+#include "extra/keypoints.h"
+#include "extra/descriptor_index.h"
 
 namespace SD_SLAM {
 
 class Map;
 class MapPoint;
 class Frame;
+struct AlignReference;
 
 class KeyFrame {
  public:
@@ -63,6 +68,9 @@ class KeyFrame {
   std::vector<KeyFrame*> GetCovisiblesByWeight(const int &w);
   int GetWeight(KeyFrame* pKF);
 
+  // Update number of MapPoints shared with pKF, called from MapPoint observation changes
+  void ChangeCovisibility(KeyFrame* pKF, int n);
+
   // Spanning tree functions
   void AddChild(KeyFrame* pKF);
   void EraseChild(KeyFrame* pKF);
@@ -88,6 +96,14 @@ class KeyFrame {
 
   // KeyPoint functions
   std::vector<size_t> GetFeaturesInArea(const float &x, const float  &y, const float  &r) const;
+
+  // Hash index of the descriptors, built the first time it is requested
+  const DescriptorIndex &GetDescriptorIndex();
+
+  // Patches and Jacobians cached by ImageAlign, dropped when the pose or the points change.
+  // A reference is only stored if nothing changed since version was read.
+  std::shared_ptr<const AlignReference> GetAlignReference(unsigned long *version);
+  void SetAlignReference(const std::shared_ptr<const AlignReference> &ref, unsigned long version);
   Eigen::Vector3d UnprojectStereo(int i);
 
   // Image
@@ -152,7 +168,7 @@ class KeyFrame {
 
   // KeyPoints, stereo coordinate and descriptors (all associated by an index)
   const std::vector<cv::KeyPoint> mvKeys;
-  const std::vector<cv::KeyPoint> mvKeysUn;
+  const KeyPointArray mvKeysUn;
   const std::vector<float> mvuRight; // negative value for monocular points
   const std::vector<float> mvDepth; // negative value for monocular points
   const cv::Mat mDescriptors;
@@ -174,14 +190,23 @@ class KeyFrame {
 
   // Image pyramid
   std::vector<cv::Mat> mvImagePyramid;
+  std::vector<cv::Mat> mvAlignPyramid;
   cv::Mat mDepthImage;
 
   // The following variables need to be accessed trough a mutex to be thread safe.
  protected:
+  // Drop ImageAlign reference after a pose or points change
+  void InvalidateAlignReference();
+
+  // Rebuild or patch ordered connections (mMutexConnections must be locked)
+  void SortConnections();
+  void InsertOrderedConnection(KeyFrame* pKF, int weight);
+  void EraseOrderedConnection(KeyFrame* pKF, int weight);
+
   // SE3 Pose and camera center
-  Eigen::Matrix4d Tcw;
-  Eigen::Matrix4d Twc;
-  Eigen::Vector3d Ow;
+  SeqLockValue<Eigen::Matrix4d> Tcw;
+  SeqLockValue<Eigen::Matrix4d> Twc;
+  SeqLockValue<Eigen::Vector3d> Ow;
 
   // MapPoints associated to keypoints
   std::vector<MapPoint*> mvpMapPoints;
@@ -189,10 +214,22 @@ class KeyFrame {
   // Grid over the image to speed up feature matching
   std::vector< std::vector <std::vector<size_t> > > mGrid;
 
-  std::map<KeyFrame*, int> mConnectedKeyFrameWeights;
+  // Descriptor index to speed up keyframe to keyframe matching
+  DescriptorIndex mDescriptorIndex;
+  bool mbDescriptorIndexBuilt;
+
+  // ImageAlign reference data
+  std::shared_ptr<const AlignReference> mpAlignReference;
+  unsigned long mnAlignVersion;
+
+  // Connections sorted by keyframe, ordered vectors sorted by decreasing weight
+  std::vector<std::pair<KeyFrame*, int> > mConnectedKeyFrameWeights;
   std::vector<KeyFrame*> mvpOrderedConnectedKeyFrames;
   std::vector<int> mvOrderedWeights;
 
+  // Number of MapPoints shared with each keyframe, sorted by keyframe
+  std::vector<std::pair<KeyFrame*, int> > mvCovisibilityCounter;
+
   // Spanning Tree and Loop Edges
   bool mbFirstConnection;
   KeyFrame* mpParent;
@@ -208,9 +245,14 @@ class KeyFrame {
 
   Map* mpMap;
 
+  // Writers of the pose take mMutexPose, readers only go through mSeqPose
   std::mutex mMutexPose;
+  SeqLock mSeqPose;
   std::mutex mMutexConnections;
+  std::mutex mMutexCounter;
   std::mutex mMutexFeatures;
+  std::mutex mMutexDescriptorIndex;
+  std::mutex mMutexAlign;
 
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
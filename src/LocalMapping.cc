@@ -45,6 +45,11 @@ LocalMapping::LocalMapping(Map *pMap, const float bMonocular):
 
   mpLoopCloser = nullptr;
   mpTracker = nullptr;
+  mpLocalBAProblem = new LocalBAProblem();
+}
+
+LocalMapping::~LocalMapping() {
+  delete mpLocalBAProblem;
 }
 
 void LocalMapping::SetLoopCloser(LoopClosing* pLoopCloser) {
@@ -83,7 +88,7 @@ void LocalMapping::Run() {
       if (!CheckNewKeyFrames() && !stopRequested()) {
         // Local BA
         if (mpMap->KeyFramesInMap()>2)
-          Optimizer::LocalBundleAdjustment(mpCurrentKeyFrame, &mbAbortBA, mpMap);
+          Optimizer::LocalBundleAdjustment(mpCurrentKeyFrame, &mbAbortBA, mpMap, mpLocalBAProblem);
 
         // Check redundant local Keyframes
         KeyFrameCulling();
@@ -96,6 +101,9 @@ void LocalMapping::Run() {
       while (isStopped() && !CheckFinish()) {
         usleep(3000);
       }
+
+      // Map changed while stopped (loop correction, global BA)
+      mpLocalBAProblem->Clear();
       if (CheckFinish())
         break;
     }
@@ -156,6 +164,8 @@ void LocalMapping::ProcessNewKeyFrame() {
 
   // Insert Keyframe in Map
   mpMap->AddKeyFrame(mpCurrentKeyFrame);
+
+  mpLocalBAProblem->KeyFrameChanged(mpCurrentKeyFrame);
 }
 
 void LocalMapping::MapPointCulling() {
@@ -175,9 +185,11 @@ void LocalMapping::MapPointCulling() {
     if (pMP->isBad()) {
       lit = mlpRecentAddedMapPoints.erase(lit);
     } else if (pMP->GetFoundRatio() < 0.25f ) {
+      mpLocalBAProblem->MapPointChanged(pMP);
       pMP->SetBadFlag();
       lit = mlpRecentAddedMapPoints.erase(lit);
     } else if (((int)nCurrentKFid-(int)pMP->mnFirstKFid)>=2 && pMP->Observations()<=cnThObs) {
+      mpLocalBAProblem->MapPointChanged(pMP);
       pMP->SetBadFlag();
       lit = mlpRecentAddedMapPoints.erase(lit);
     } else if (((int)nCurrentKFid-(int)pMP->mnFirstKFid)>=3)
@@ -265,17 +277,21 @@ void LocalMapping::CreateNewMapPoints() {
       const int &idx1 = vMatchedIndices[ikp].first;
       const int &idx2 = vMatchedIndices[ikp].second;
 
-      const cv::KeyPoint &kp1 = mpCurrentKeyFrame->mvKeysUn[idx1];
+      const float kp1_x = mpCurrentKeyFrame->mvKeysUn.x[idx1];
+      const float kp1_y = mpCurrentKeyFrame->mvKeysUn.y[idx1];
+      const int kp1_octave = mpCurrentKeyFrame->mvKeysUn.octave[idx1];
       const float kp1_ur = mpCurrentKeyFrame->mvuRight[idx1];
       bool bStereo1 = kp1_ur >= 0;
 
-      const cv::KeyPoint &kp2 = pKF2->mvKeysUn[idx2];
+      const float kp2_x = pKF2->mvKeysUn.x[idx2];
+      const float kp2_y = pKF2->mvKeysUn.y[idx2];
+      const int kp2_octave = pKF2->mvKeysUn.octave[idx2];
       const float kp2_ur = pKF2->mvuRight[idx2];
       bool bStereo2 = kp2_ur >= 0;
 
       // Check parallax between rays
-      Eigen::Vector3d xn1((kp1.pt.x-cx1)*invfx1, (kp1.pt.y-cy1)*invfy1, 1.0);
-      Eigen::Vector3d xn2((kp2.pt.x-cx2)*invfx2, (kp2.pt.y-cy2)*invfy2, 1.0);
+      Eigen::Vector3d xn1((kp1_x-cx1)*invfx1, (kp1_y-cy1)*invfy1, 1.0);
+      Eigen::Vector3d xn2((kp2_x-cx2)*invfx2, (kp2_y-cy2)*invfy2, 1.0);
 
       Eigen::Vector3d ray1 = Rwc1*xn1;
       Eigen::Vector3d ray2 = Rwc2*xn2;
@@ -334,7 +350,7 @@ void LocalMapping::CreateNewMapPoints() {
         continue;
 
       //Check reprojection error in first keyframe
-      const float &sigmaSquare1 = mpCurrentKeyFrame->mvLevelSigma2[kp1.octave];
+      const float &sigmaSquare1 = mpCurrentKeyFrame->mvLevelSigma2[kp1_octave];
       const float x1 = Rcw1.row(0).dot(x3Dt)+tcw1(0);
       const float y1 = Rcw1.row(1).dot(x3Dt)+tcw1(1);
       const float invz1 = 1.0/z1;
@@ -342,39 +358,39 @@ void LocalMapping::CreateNewMapPoints() {
       if (!bStereo1) {
         float u1 = fx1*x1*invz1+cx1;
         float v1 = fy1*y1*invz1+cy1;
-        float errX1 = u1 - kp1.pt.x;
-        float errY1 = v1 - kp1.pt.y;
+        float errX1 = u1 - kp1_x;
+        float errY1 = v1 - kp1_y;
         if ((errX1*errX1+errY1*errY1)>5.991*sigmaSquare1)
           continue;
       } else {
         float u1 = fx1*x1*invz1+cx1;
         float u1_r = u1 - mpCurrentKeyFrame->mbf*invz1;
         float v1 = fy1*y1*invz1+cy1;
-        float errX1 = u1 - kp1.pt.x;
-        float errY1 = v1 - kp1.pt.y;
+        float errX1 = u1 - kp1_x;
+        float errY1 = v1 - kp1_y;
         float errX1_r = u1_r - kp1_ur;
         if ((errX1*errX1+errY1*errY1+errX1_r*errX1_r)>7.8*sigmaSquare1)
           continue;
       }
 
       //Check reprojection error in second keyframe
-      const float sigmaSquare2 = pKF2->mvLevelSigma2[kp2.octave];
+      const float sigmaSquare2 = pKF2->mvLevelSigma2[kp2_octave];
       const float x2 = Rcw2.row(0).dot(x3Dt)+tcw2(0);
       const float y2 = Rcw2.row(1).dot(x3Dt)+tcw2(1);
       const float invz2 = 1.0/z2;
       if (!bStereo2) {
         float u2 = fx2*x2*invz2+cx2;
         float v2 = fy2*y2*invz2+cy2;
-        float errX2 = u2 - kp2.pt.x;
-        float errY2 = v2 - kp2.pt.y;
+        float errX2 = u2 - kp2_x;
+        float errY2 = v2 - kp2_y;
         if ((errX2*errX2+errY2*errY2)>5.991*sigmaSquare2)
           continue;
       } else {
         float u2 = fx2*x2*invz2+cx2;
         float u2_r = u2 - mpCurrentKeyFrame->mbf*invz2;
         float v2 = fy2*y2*invz2+cy2;
-        float errX2 = u2 - kp2.pt.x;
-        float errY2 = v2 - kp2.pt.y;
+        float errX2 = u2 - kp2_x;
+        float errY2 = v2 - kp2_y;
         float errX2_r = u2_r - kp2_ur;
         if ((errX2*errX2+errY2*errY2+errX2_r*errX2_r)>7.8*sigmaSquare2)
           continue;
@@ -391,7 +407,7 @@ void LocalMapping::CreateNewMapPoints() {
         continue;
 
       const float ratioDist = dist2/dist1;
-      const float ratioOctave = mpCurrentKeyFrame->mvScaleFactors[kp1.octave]/pKF2->mvScaleFactors[kp2.octave];
+      const float ratioOctave = mpCurrentKeyFrame->mvScaleFactors[kp1_octave]/pKF2->mvScaleFactors[kp2_octave];
 
       /*if (fabs(ratioDist-ratioOctave)>ratioFactor)
         continue;*/
@@ -413,6 +429,7 @@ void LocalMapping::CreateNewMapPoints() {
 
       mpMap->AddMapPoint(pMP);
       mlpRecentAddedMapPoints.push_back(pMP);
+      mpLocalBAProblem->MapPointChanged(pMP);
 
       nnew++;
     }
@@ -446,11 +463,12 @@ void LocalMapping::SearchInNeighbors() {
 
   // Search matches by projection from current KF in target KFs
   ORBmatcher matcher;
+  vector<MapPoint*> vpChanged;
   vector<MapPoint*> vpMapPointMatches = mpCurrentKeyFrame->GetMapPointMatches();
   for (vector<KeyFrame*>::iterator vit=vpTargetKFs.begin(), vend=vpTargetKFs.end(); vit!=vend; vit++) {
     KeyFrame* pKFi = *vit;
 
-    matcher.Fuse(pKFi, vpMapPointMatches);
+    matcher.Fuse(pKFi, vpMapPointMatches, 3.0, &vpChanged);
   }
 
   // Search matches by projection from target KFs in current KF
@@ -473,7 +491,11 @@ void LocalMapping::SearchInNeighbors() {
     }
   }
 
-  matcher.Fuse(mpCurrentKeyFrame, vpFuseCandidates);
+  matcher.Fuse(mpCurrentKeyFrame, vpFuseCandidates, 3.0, &vpChanged);
+
+  // Report fused points to local BA
+  for (size_t i = 0; i < vpChanged.size(); i++)
+    mpLocalBAProblem->MapPointChanged(vpChanged[i]);
 
   // Update points
   vpMapPointMatches = mpCurrentKeyFrame->GetMapPointMatches();
@@ -605,14 +627,14 @@ void LocalMapping::KeyFrameCulling() {
 
           nMPs++;
           if (pMP->Observations()>thObs) {
-            const int &scaleLevel = pKF->mvKeysUn[i].octave;
+            const int &scaleLevel = pKF->mvKeysUn.octave[i];
             const map<KeyFrame*, size_t> observations = pMP->GetObservations();
             int nObs = 0;
             for (map<KeyFrame*, size_t>::const_iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
               KeyFrame* pKFi = mit->first;
               if (pKFi == pKF)
                 continue;
-              const int &scaleLeveli = pKFi->mvKeysUn[mit->second].octave;
+              const int &scaleLeveli = pKFi->mvKeysUn.octave[mit->second];
 
               if (scaleLeveli <= scaleLevel+1) {
                 nObs++;
@@ -628,8 +650,10 @@ void LocalMapping::KeyFrameCulling() {
       }
     }
 
-    if (nRedundantObservations > 0.9*nMPs)
+    if (nRedundantObservations > 0.9*nMPs) {
+      mpLocalBAProblem->KeyFrameChanged(pKF);
       pKF->SetBadFlag();
+    }
   }
 }
 
@@ -660,6 +684,7 @@ void LocalMapping::ResetIfRequested() {
   if (mbResetRequested) {
     mlNewKeyFrames.clear();
     mlpRecentAddedMapPoints.clear();
+    mpLocalBAProblem->Clear();
     mbResetRequested=false;
   }
 }
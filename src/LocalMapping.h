@@ -36,10 +36,12 @@ namespace SD_SLAM {
 class Tracking;
 class LoopClosing;
 class Map;
+struct LocalBAProblem;
 
 class LocalMapping {
  public:
   LocalMapping(Map* pMap, const float bMonocular);
+  ~LocalMapping();
 
   void SetLoopCloser(LoopClosing* pLoopCloser);
 
@@ -112,6 +114,9 @@ class LocalMapping {
 
   bool mbAbortBA;
 
+  // Local BA problem reused between keyframes
+  LocalBAProblem* mpLocalBAProblem;
+
   bool mbStopped;
   bool mbStopRequested;
   bool mbNotStop;
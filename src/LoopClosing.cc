@@ -24,13 +24,18 @@
 
 #include "LoopClosing.h"
 #include <thread>
+#include <atomic>
+#include <algorithm>
 #include <unistd.h>
 #include "Sim3Solver.h"
 #include "Converter.h"
 #include "Optimizer.h"
 #include "ORBmatcher.h"
 #include "ImageAlign.h"
+#include "Config.h"
 #include "extra/log.h"
+#include "extra/timer.h"
+#include "extra/parallel_for.h"
 
 using std::mutex;
 using std::unique_lock;
@@ -92,6 +97,11 @@ void LoopClosing::InsertKeyFrame(KeyFrame *pKF) {
     mlpLoopKeyFrameQueue.push_back(pKF);
 }
 
+void LoopClosing::SetPosePrior(KeyFrame *pKF, const Eigen::Matrix4d &pose) {
+  unique_lock<mutex> lock(mMutexPrior);
+  mPosePriors[pKF->mnId] = pose;
+}
+
 bool LoopClosing::CheckNewKeyFrames() {
   unique_lock<mutex> lock(mMutexLoopQueue);
   return(!mlpLoopKeyFrameQueue.empty());
@@ -106,6 +116,19 @@ bool LoopClosing::DetectLoop() {
     mpCurrentKF->SetNotErase();
   }
 
+  // Pose prior of this keyframe, older ones belong to keyframes already processed
+  bool bPrior = false;
+  Eigen::Matrix4d prior;
+  {
+    unique_lock<mutex> lock(mMutexPrior);
+    auto it = mPosePriors.find(mpCurrentKF->mnId);
+    if (it != mPosePriors.end()) {
+      prior = it->second;
+      bPrior = true;
+    }
+    mPosePriors.erase(mPosePriors.begin(), mPosePriors.upper_bound(mpCurrentKF->mnId));
+  }
+
   //If the map contains less than 10 KF or less than 10 KF have passed from last loop detection
   if (mpCurrentKF->mnId<mLastLoopKFid+10) {
     mpCurrentKF->SetErase();
@@ -114,9 +137,31 @@ bool LoopClosing::DetectLoop() {
 
   map<KeyFrame*, double> candidateKFs;
   set<KeyFrame*> connectedKeyFrames = mpCurrentKF->GetConnectedKeyFrames();
-  vector<KeyFrame*> kfs = mpMap->GetAllKeyFrames();
   double error, best_error = 1e10;
 
+  // Discard keyframes far away from the pose prior. The radius has to cover the drift
+  // the loop has to correct when the prior is the motion model prediction
+  vector<KeyFrame*> kfs;
+  if (bPrior && Config::PriorRadius() > 0.0)
+    kfs = mpMap->GetKeyFramesNearPose(prior, Config::PriorRadius(), Config::PriorMaxAngle()*M_PI/180.0);
+  else
+    kfs = mpMap->GetAllKeyFrames();
+
+  // With several threads all keyframes are aligned in parallel first. Candidates are then
+  // selected by the same sequential pass, so they do not depend on the number of threads
+  const int nThreads = Config::PlaceRecognitionThreads();
+  vector<double> errors(kfs.size(), -1.0);
+  if (nThreads > 1) {
+    ParallelFor(0, kfs.size(), nThreads, [&](int i) {
+      if (kfs[i]->mnId == mpCurrentKF->mnId || connectedKeyFrames.count(kfs[i]))
+        return;
+
+      ImageAlign image_align;
+      if (image_align.ComputePose(mpCurrentKF, kfs[i]))
+        errors[i] = image_align.GetError();
+    });
+  }
+
   // Search candidates to be a loop
   for (size_t i = 0; i<kfs.size(); i++) {
     KeyFrame* kf = kfs[i];
@@ -129,13 +174,18 @@ bool LoopClosing::DetectLoop() {
       continue;
 
     // Try to align keyframes
-    ImageAlign image_align;
-    if (!image_align.ComputePose(mpCurrentKF, kf)) {
+    if (nThreads <= 1) {
+      ImageAlign image_align;
+      if (image_align.ComputePose(mpCurrentKF, kf))
+        errors[i] = image_align.GetError();
+    }
+
+    if (errors[i] < 0.0) {
       i++; // Skip some keyframes
       continue;
     }
 
-    error = image_align.GetError();
+    error = errors[i];
     candidateKFs.insert(std::make_pair(kf, error));
 
     if (error < best_error)
@@ -225,52 +275,58 @@ bool LoopClosing::ComputeSim3() {
   // For each consistent loop candidate we try to compute a Sim3
   const int nInitialCandidates = mvpEnoughConsistentCandidates.size();
 
-  // We compute first ORB matches for each candidate
-  // If enough matches are found, we setup a Sim3Solver
+  // avoid that local mapping erase them while they are being processed in this thread
+  for (int i = 0; i<nInitialCandidates; i++)
+    mvpEnoughConsistentCandidates[i]->SetNotErase();
+
+  Timer total(true);
+
+  const int nThreads = std::max(1, Config::PlaceRecognitionThreads());
   ORBmatcher matcher(0.75, true);
 
-  vector<Sim3Solver*> vpSim3Solvers;
-  vpSim3Solvers.resize(nInitialCandidates);
+  // We compute first ORB matches for each candidate
+  // If enough matches are found, we setup a Sim3Solver
+  vector<Sim3Solver*> vpSim3Solvers(nInitialCandidates, static_cast<Sim3Solver*>(NULL));
+  vector<vector<MapPoint*> > vvpMapPointMatches(nInitialCandidates);
 
-  vector<vector<MapPoint*> > vvpMapPointMatches;
-  vvpMapPointMatches.resize(nInitialCandidates);
+  ParallelFor(0, nInitialCandidates, nThreads, [&](int i) {
+    KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
+    if (pKF->isBad())
+      return;
 
-  vector<bool> vbDiscarded;
-  vbDiscarded.resize(nInitialCandidates);
+    ORBmatcher tmatcher(0.75, true);
+    int nmatches = tmatcher.SearchByPoints(mpCurrentKF, pKF, vvpMapPointMatches[i]);
+    if (nmatches<20)
+      return;
 
-  bool bMatch = false;
-  int nCandidates = 0;
+    Sim3Solver* pSolver = new Sim3Solver(mpCurrentKF, pKF, vvpMapPointMatches[i], mbFixScale);
+    pSolver->SetRansacParameters(0.99, 20, 300);
+    vpSim3Solvers[i] = pSolver;
+  });
 
+  vector<int> vCandidates;
   for (int i = 0; i<nInitialCandidates; i++) {
-    KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
+    if (vpSim3Solvers[i])
+      vCandidates.push_back(i);
+  }
 
-    // avoid that local mapping erase it while it is being processed in this thread
-    pKF->SetNotErase();
+  // Perform alternatively RANSAC iterations for each candidate until one is succesful or all fail.
+  // Candidates of a round run in parallel and the first successful one in candidate order is
+  // accepted, as in the sequential round-robin, so the result is the same for any number of threads
+  vector<g2o::Sim3, Eigen::aligned_allocator<g2o::Sim3> > vgScm(nInitialCandidates);
+  vector<vector<MapPoint*> > vvpInlierMatches(nInitialCandidates);
+  vector<char> vbDiscarded(nInitialCandidates, 0);
+  bool bMatch = false;
 
-    if (pKF->isBad()) {
-      vbDiscarded[i] = true;
-      continue;
-    }
+  while (!vCandidates.empty() && !bMatch) {
+    std::atomic<int> nAccepted(nInitialCandidates);
 
-    int nmatches = matcher.SearchByPoints(mpCurrentKF, pKF, vvpMapPointMatches[i]);
-    if (nmatches<20) {
-      vbDiscarded[i] = true;
-      continue;
-    } else {
-      Sim3Solver* pSolver = new Sim3Solver(mpCurrentKF,pKF, vvpMapPointMatches[i], mbFixScale);
-      pSolver->SetRansacParameters(0.99, 20, 300);
-      vpSim3Solvers[i] = pSolver;
-    }
-
-    nCandidates++;
-  }
+    ParallelFor(0, vCandidates.size(), nThreads, [&](int k) {
+      const int i = vCandidates[k];
 
-  // Perform alternatively RANSAC iterations for each candidate
-  // until one is succesful or all fail
-  while (nCandidates > 0 && !bMatch) {
-    for (int i = 0; i<nInitialCandidates; i++) {
-      if (vbDiscarded[i])
-        continue;
+      // A previous candidate in this round is already accepted
+      if (i > nAccepted)
+        return;
 
       KeyFrame* pKF = mvpEnoughConsistentCandidates[i];
 
@@ -283,10 +339,8 @@ bool LoopClosing::ComputeSim3() {
       Eigen::Matrix4d Scm  = pSolver->iterate(5,bNoMore, vbInliers,nInliers);
 
       // If Ransac reachs max. iterations discard keyframe
-      if (bNoMore) {
-        vbDiscarded[i]=true;
-        nCandidates--;
-      }
+      if (bNoMore)
+        vbDiscarded[i] = 1;
 
       // If RANSAC returns a Sim3, perform a guided matching and optimize with all correspondences
       if (!Scm.isZero()) {
@@ -296,29 +350,49 @@ bool LoopClosing::ComputeSim3() {
              vpMapPointMatches[j]=vvpMapPointMatches[i][j];
         }
 
+        ORBmatcher tmatcher(0.75, true);
         Eigen::Matrix3d R = pSolver->GetEstimatedRotation();
         Eigen::Vector3d t = pSolver->GetEstimatedTranslation();
         const float s = pSolver->GetEstimatedScale();
-        matcher.SearchBySim3(mpCurrentKF, pKF, vpMapPointMatches, s, R, t, 7.5);
+        tmatcher.SearchBySim3(mpCurrentKF, pKF, vpMapPointMatches, s, R, t, 7.5);
 
         g2o::Sim3 gScm(R, t, s);
         const int nInliers = Optimizer::OptimizeSim3(mpCurrentKF, pKF, vpMapPointMatches, gScm, 10, mbFixScale);
 
-        // If optimization is succesful stop ransacs and continue
+        // If optimization is succesful keep the lowest candidate index
         if (nInliers>=20) {
-          bMatch = true;
-          mpMatchedKF = pKF;
-          g2o::Sim3 gSmw(pKF->GetRotation(), pKF->GetTranslation(), 1.0);
-          mg2oScw = gScm*gSmw;
-          mScw = Converter::toMatrix4d(mg2oScw);
-
-          mvpCurrentMatchedPoints = vpMapPointMatches;
-          break;
+          vgScm[i] = gScm;
+          vvpInlierMatches[i] = vpMapPointMatches;
+          int nPrev = nAccepted;
+          while (i < nPrev && !nAccepted.compare_exchange_weak(nPrev, i)) {}
         }
       }
+    });
+
+    if (nAccepted < nInitialCandidates) {
+      bMatch = true;
+      mpMatchedKF = mvpEnoughConsistentCandidates[nAccepted];
+      g2o::Sim3 gSmw(mpMatchedKF->GetRotation(), mpMatchedKF->GetTranslation(), 1.0);
+      mg2oScw = vgScm[nAccepted]*gSmw;
+      mScw = Converter::toMatrix4d(mg2oScw);
+
+      mvpCurrentMatchedPoints = vvpInlierMatches[nAccepted];
+    } else {
+      vector<int> vRemaining;
+      for (size_t k = 0; k<vCandidates.size(); k++) {
+        if (!vbDiscarded[vCandidates[k]])
+          vRemaining.push_back(vCandidates[k]);
+      }
+      vCandidates.swap(vRemaining);
     }
   }
 
+  for (int i = 0; i<nInitialCandidates; i++)
+    delete vpSim3Solvers[i];
+
+  total.Stop();
+  LOGD("Sim3 computed for %d candidates in %.2fms", nInitialCandidates, total.GetMsTime());
+
   if (!bMatch) {
     for (int i = 0; i<nInitialCandidates; i++)
        mvpEnoughConsistentCandidates[i]->SetErase();
@@ -512,7 +586,7 @@ void LoopClosing::CorrectLoop() {
   }
 
   // Optimize graph
-  Optimizer::OptimizeEssentialGraph(mpMap, mpMatchedKF, mpCurrentKF, NonCorrectedSim3, CorrectedSim3, LoopConnections, mbFixScale);
+  Optimizer::OptimizeEssentialGraph(mpMap, mpMatchedKF, mpCurrentKF, NonCorrectedSim3, CorrectedSim3, LoopConnections, mbFixScale, &mPoseGraphSolver);
 
   mpMap->InformNewBigChange();
 
@@ -524,7 +598,7 @@ void LoopClosing::CorrectLoop() {
   mbRunningGBA = true;
   mbFinishedGBA = false;
   mbStopGBA = false;
-  mpThreadGBA = new std::thread(&LoopClosing::RunGlobalBundleAdjustment, this, mpCurrentKF->mnId);
+  mpThreadGBA = new std::thread(&LoopClosing::RunGlobalBundleAdjustment, this, mpCurrentKF, mpMatchedKF);
 
   // Loop closed. Release Local Mapping.
   mpLocalMapper->Release();
@@ -578,15 +652,26 @@ void LoopClosing::ResetIfRequested() {
   if (mbResetRequested) {
     mlpLoopKeyFrameQueue.clear();
     mLastLoopKFid = 0;
+    mPoseGraphSolver.Reset();
+    {
+      unique_lock<mutex> lock2(mMutexPrior);
+      mPosePriors.clear();
+    }
     mbResetRequested=false;
   }
 }
 
-void LoopClosing::RunGlobalBundleAdjustment(unsigned long nLoopKF) {
+void LoopClosing::RunGlobalBundleAdjustment(KeyFrame* pCurKF, KeyFrame* pLoopKF) {
   LOGD("Starting Global Bundle Adjustment");
 
+  const unsigned long nLoopKF = pCurKF->mnId;
   int idx =  mnFullBAIdx;
-  Optimizer::GlobalBundleAdjustemnt(mpMap, 10,&mbStopGBA,nLoopKF, false);
+
+  // The essential graph already distributed the correction, refine only around the loop if set
+  if (Config::LoopBAKeyFrames() > 0)
+    Optimizer::LoopBundleAdjustment(mpMap, pCurKF, pLoopKF, Config::LoopBAKeyFrames(), 10, &mbStopGBA, nLoopKF);
+  else
+    Optimizer::GlobalBundleAdjustemnt(mpMap, 10,&mbStopGBA,nLoopKF, false);
 
   // Update all MapPoints and KeyFrames
   // Local Mapping was active during BA, that means that there might be new keyframes
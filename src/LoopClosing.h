@@ -31,6 +31,7 @@
 #include "LocalMapping.h"
 #include "Map.h"
 #include "Tracking.h"
+#include "PoseGraphSolver.h"
 #include "extra/g2o/types/types_seven_dof_expmap.h"
 
 namespace SD_SLAM {
@@ -57,10 +58,14 @@ class LoopClosing {
 
   void InsertKeyFrame(KeyFrame *pKF);
 
+  // Pose hint of a keyframe (external or motion model prediction), restricts its loop
+  // search to the surroundings. Must be set before the keyframe is inserted
+  void SetPosePrior(KeyFrame *pKF, const Eigen::Matrix4d &pose);
+
   void RequestReset();
 
   // This function will run in a separate thread
-  void RunGlobalBundleAdjustment(unsigned long nLoopKF);
+  void RunGlobalBundleAdjustment(KeyFrame* pCurKF, KeyFrame* pLoopKF);
 
   bool isRunningGBA() {
     std::unique_lock<std::mutex> lock(mMutexGBA);
@@ -105,6 +110,11 @@ class LoopClosing {
 
   std::mutex mMutexLoopQueue;
 
+  // Pose priors by keyframe id
+  std::map<unsigned long, Eigen::Matrix4d, std::less<unsigned long>,
+    Eigen::aligned_allocator<std::pair<const unsigned long, Eigen::Matrix4d> > > mPosePriors;
+  std::mutex mMutexPrior;
+
   // Loop detector parameters
   float mnCovisibilityConsistencyTh;
 
@@ -131,6 +141,9 @@ class LoopClosing {
   // Fix scale in the stereo/RGB-D case
   bool mbFixScale;
 
+  // Essential graph solver, keeps the elimination order between loops
+  PoseGraphSolver mPoseGraphSolver;
+
   int mnFullBAIdx;
 
  public:
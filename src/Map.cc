@@ -23,6 +23,8 @@
  */
 
 #include "Map.h"
+#include <algorithm>
+#include "Config.h"
 
 using std::mutex;
 using std::unique_lock;
@@ -31,22 +33,38 @@ using std::set;
 
 namespace SD_SLAM {
 
-Map::Map():mnMaxKFid(0), mnBigChangeIdx(0) {
+Map::Map():mPointsGrid(Config::MapVoxelSize()), mKeyFramesGrid(Config::KeyFrameVoxelSize()),
+  mnMaxKFid(0), mnBigChangeIdx(0) {
 }
 
 void Map::AddKeyFrame(KeyFrame *pKF) {
-  unique_lock<mutex> lock(mMutexMap);
-  mspKeyFrames.insert(pKF);
-  if (pKF->mnId>mnMaxKFid)
-    mnMaxKFid=pKF->mnId;
+  {
+    unique_lock<mutex> lock(mMutexMap);
+    mspKeyFrames.insert(pKF);
+    if (pKF->mnId>mnMaxKFid)
+      mnMaxKFid=pKF->mnId;
+  }
+
+  unique_lock<mutex> lock(mMutexGrid);
+  mKeyFramesGrid.Insert(pKF, pKF->GetCameraCenter());
 }
 
 void Map::AddMapPoint(MapPoint *pMP) {
-  unique_lock<mutex> lock(mMutexMap);
-  mspMapPoints.insert(pMP);
+  {
+    unique_lock<mutex> lock(mMutexMap);
+    mspMapPoints.insert(pMP);
+  }
+
+  unique_lock<mutex> lock(mMutexGrid);
+  mPointsGrid.Insert(pMP, pMP->GetWorldPos());
 }
 
 void Map::EraseMapPoint(MapPoint *pMP) {
+  {
+    unique_lock<mutex> lock(mMutexGrid);
+    mPointsGrid.Erase(pMP);
+  }
+
   unique_lock<mutex> lock(mMutexMap);
   mspMapPoints.erase(pMP);
 
@@ -55,6 +73,11 @@ void Map::EraseMapPoint(MapPoint *pMP) {
 }
 
 void Map::EraseKeyFrame(KeyFrame *pKF) {
+  {
+    unique_lock<mutex> lock(mMutexGrid);
+    mKeyFramesGrid.Erase(pKF);
+  }
+
   unique_lock<mutex> lock(mMutexMap);
   mspKeyFrames.erase(pKF);
 
@@ -119,6 +142,129 @@ vector<MapPoint*> Map::GetReferenceMapPoints() {
   return mvpReferenceMapPoints;
 }
 
+void Map::UpdateMapPoint(MapPoint *pMP, const Eigen::Vector3d &pos) {
+  unique_lock<mutex> lock(mMutexGrid);
+  mPointsGrid.Update(pMP, pos);
+}
+
+void Map::UpdateKeyFrame(KeyFrame *pKF, const Eigen::Vector3d &center) {
+  unique_lock<mutex> lock(mMutexGrid);
+  mKeyFramesGrid.Update(pKF, center);
+}
+
+vector<KeyFrame*> Map::GetKeyFramesNearPose(const Eigen::Matrix4d &Tcw, double radius, double maxAngle) {
+  const Eigen::Matrix3d Rcw = Tcw.block<3, 3>(0, 0);
+  const Eigen::Vector3d Ow = -Rcw.transpose()*Tcw.block<3, 1>(0, 3);
+  const Eigen::Vector3d view = Rcw.row(2).transpose();
+  const double minCos = cos(maxAngle);
+
+  vector<KeyFrame*> vpCandidates;
+  {
+    unique_lock<mutex> lock(mMutexGrid);
+    vpCandidates = mKeyFramesGrid.GetInRadius(Ow, radius);
+  }
+
+  vector<std::pair<double, KeyFrame*> > vPairs;
+  vPairs.reserve(vpCandidates.size());
+  for (size_t i = 0; i < vpCandidates.size(); i++) {
+    KeyFrame* pKF = vpCandidates[i];
+    if (pKF->isBad())
+      continue;
+
+    const double dist = (pKF->GetCameraCenter()-Ow).norm();
+    if (dist > radius)
+      continue;
+
+    const Eigen::Vector3d viewKF = pKF->GetRotation().row(2).transpose();
+    if (view.dot(viewKF) < minCos)
+      continue;
+
+    vPairs.push_back(std::make_pair(dist, pKF));
+  }
+
+  std::sort(vPairs.begin(), vPairs.end());
+
+  vector<KeyFrame*> vpKFs(vPairs.size());
+  for (size_t i = 0; i < vPairs.size(); i++)
+    vpKFs[i] = vPairs[i].second;
+  return vpKFs;
+}
+
+vector<MapPoint*> Map::GetMapPointsInView(const Eigen::Matrix4d &Tcw, int nMax, double maxDepth) {
+  const Eigen::Matrix3d Rcw = Tcw.block<3, 3>(0, 0);
+  const Eigen::Vector3d tcw = Tcw.block<3, 1>(0, 3);
+  const Eigen::Matrix3d Rwc = Rcw.transpose();
+  const Eigen::Vector3d Ow = -Rwc*tcw;
+
+  // Image corners as rays at unit depth
+  const double xs[2] = {(Frame::mnMinX-Frame::cx)/Frame::fx, (Frame::mnMaxX-Frame::cx)/Frame::fx};
+  const double ys[2] = {(Frame::mnMinY-Frame::cy)/Frame::fy, (Frame::mnMaxY-Frame::cy)/Frame::fy};
+
+  vector<MapPoint*> vpMPs;
+  unique_lock<mutex> lock(mMutexGrid);
+  const double radius = 0.87*mPointsGrid.GetSize();  // Half voxel diagonal
+  const double step = 4.0*mPointsGrid.GetSize();
+
+  // Frustum is scanned in depth slabs, nearest first, only visiting voxels inside the
+  // bounding box of each slab. Every voxel belongs to the slab containing its center
+  const double maxCenterDepth = maxDepth+radius;
+  for (double near = -radius, far; near < maxCenterDepth; near = far) {
+    far = std::min(near+step, maxCenterDepth);
+
+    Eigen::Vector3d boxMin = Ow, boxMax = Ow;
+    const double depths[2] = {std::max(near, 0.0), far};
+    for (int d = 0; d < 2; d++) {
+      for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+          const Eigen::Vector3d corner = Rwc*Eigen::Vector3d(xs[i]*depths[d], ys[j]*depths[d], depths[d])+Ow;
+          boxMin = boxMin.cwiseMin(corner);
+          boxMax = boxMax.cwiseMax(corner);
+        }
+      }
+    }
+    boxMin.array() -= radius;
+    boxMax.array() += radius;
+
+    // Select voxels whose bounding sphere projects inside the image
+    vector<std::pair<double, const vector<MapPoint*>*> > vCells;
+    mPointsGrid.ForEachCellInBox(boxMin, boxMax, [&](const Eigen::Vector3d &center, const vector<MapPoint*> &points) {
+      Eigen::Vector3d Pc = Rcw*center+tcw;
+      if (Pc(2) < near || Pc(2) >= far)
+        return;
+
+      // Voxels containing the camera are always kept
+      if (Pc(2) > radius) {
+        const double invz = 1.0/Pc(2);
+        const double u = Frame::fx*Pc(0)*invz+Frame::cx;
+        const double v = Frame::fy*Pc(1)*invz+Frame::cy;
+        const double ru = Frame::fx*radius/(Pc(2)-radius);
+        const double rv = Frame::fy*radius/(Pc(2)-radius);
+
+        if (u+ru < Frame::mnMinX || u-ru > Frame::mnMaxX)
+          return;
+        if (v+rv < Frame::mnMinY || v-rv > Frame::mnMaxY)
+          return;
+      }
+
+      vCells.push_back(std::make_pair(Pc(2), &points));
+    });
+
+    // Nearest voxels first
+    std::sort(vCells.begin(), vCells.end());
+
+    for (size_t i = 0; i < vCells.size(); i++) {
+      const vector<MapPoint*> &points = *vCells[i].second;
+      for (size_t j = 0; j < points.size(); j++) {
+        if (nMax > 0 && static_cast<int>(vpMPs.size()) >= nMax)
+          return vpMPs;
+        vpMPs.push_back(points[j]);
+      }
+    }
+  }
+
+  return vpMPs;
+}
+
 long unsigned int Map::GetMaxKFid() {
   unique_lock<mutex> lock(mMutexMap);
   return mnMaxKFid;
@@ -133,6 +279,8 @@ void Map::clear() {
 
   mspMapPoints.clear();
   mspKeyFrames.clear();
+  mPointsGrid.Clear();
+  mKeyFramesGrid.Clear();
   mnMaxKFid = 0;
   mvpReferenceMapPoints.clear();
   mvpKeyFrameOrigins.clear();
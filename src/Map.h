@@ -29,6 +29,7 @@
 #include <mutex>
 #include "MapPoint.h"
 #include "KeyFrame.h"
+#include "extra/voxel_grid.h"
 
 namespace SD_SLAM {
 
@@ -57,6 +58,20 @@ class Map {
   std::vector<MapPoint*> GetAllMapPoints();
   std::vector<MapPoint*> GetReferenceMapPoints();
 
+  // Move MapPoint inside spatial index after a position change
+  void UpdateMapPoint(MapPoint* pMP, const Eigen::Vector3d &pos);
+
+  // Move KeyFrame inside spatial index after a pose change
+  void UpdateKeyFrame(KeyFrame* pKF, const Eigen::Vector3d &center);
+
+  // Get KeyFrames whose camera center is within radius of pose Tcw and whose
+  // viewing direction differs less than maxAngle (radians), nearest first
+  std::vector<KeyFrame*> GetKeyFramesNearPose(const Eigen::Matrix4d &Tcw, double radius, double maxAngle);
+
+  // Get up to nMax MapPoints (nearest voxels first) closer than maxDepth that may be visible
+  // from pose Tcw. Only voxels inside the frustum bounding box are visited
+  std::vector<MapPoint*> GetMapPointsInView(const Eigen::Matrix4d &Tcw, int nMax, double maxDepth);
+
   long unsigned int MapPointsInMap();
   long unsigned  KeyFramesInMap();
 
@@ -77,12 +92,19 @@ class Map {
 
   std::vector<MapPoint*> mvpReferenceMapPoints;
 
+  // Spatial index of MapPoints
+  VoxelGrid<MapPoint> mPointsGrid;
+
+  // Spatial index of KeyFrame camera centers
+  VoxelGrid<KeyFrame> mKeyFramesGrid;
+
   long unsigned int mnMaxKFid;
 
   // Index related to a big change in the map (loop closure, global BA)
   int mnBigChangeIdx;
 
   std::mutex mMutexMap;
+  std::mutex mMutexGrid;
 };
 
 }  // namespace SD_SLAM
@@ -40,8 +40,8 @@ MapPoint::MapPoint(const Eigen::Vector3d &Pos, KeyFrame *pRefKF, Map* pMap):
   mnLastFrameSeen(0), mnBALocalForKF(0), mnFuseCandidateForKF(0), mnLoopPointForKF(0), mnCorrectedByKF(0),
   mnCorrectedReference(0), mnBAGlobalForKF(0), mpRefKF(pRefKF), mnVisible(1), mnFound(1), mbBad(false),
   mpReplaced(static_cast<MapPoint*>(NULL)), mfMinDistance(0), mfMaxDistance(0), mpMap(pMap) {
-  mWorldPos = Pos;
-  mNormalVector.setZero();
+  mWorldPos.Store(Pos);
+  mNormalVector.Store(Eigen::Vector3d::Zero());
 
   // MapPoints can be created from Tracking and Local Mapping. This mutex avoid conflicts with id.
   unique_lock<mutex> lock(mpMap->mMutexPointCreation);
@@ -53,14 +53,13 @@ MapPoint::MapPoint(const Eigen::Vector3d &Pos, Map* pMap, Frame* pFrame, const i
   mnBALocalForKF(0), mnFuseCandidateForKF(0), mnLoopPointForKF(0), mnCorrectedByKF(0),
   mnCorrectedReference(0), mnBAGlobalForKF(0), mpRefKF(static_cast<KeyFrame*>(NULL)), mnVisible(1),
   mnFound(1), mbBad(false), mpReplaced(NULL), mpMap(pMap) {
-  mWorldPos = Pos;
+  mWorldPos.Store(Pos);
   Eigen::Vector3d Ow = pFrame->GetCameraCenter();
-  mNormalVector = mWorldPos - Ow;
-  mNormalVector = mNormalVector/mNormalVector.norm();
+  mNormalVector.Store((Pos - Ow).normalized());
 
   Eigen::Vector3d PC = Pos - Ow;
   const float dist = PC.norm();
-  const int level = pFrame->mvKeysUn[idxF].octave;
+  const int level = pFrame->mvKeysUn.octave[idxF];
   const float levelScaleFactor =  pFrame->mvScaleFactors[level];
   const int nLevels = pFrame->mnScaleLevels;
 
@@ -75,19 +74,22 @@ MapPoint::MapPoint(const Eigen::Vector3d &Pos, Map* pMap, Frame* pFrame, const i
 }
 
 void MapPoint::SetWorldPos(const Eigen::Vector3d &Pos) {
-  unique_lock<mutex> lock2(mGlobalMutex);
-  unique_lock<mutex> lock(mMutexPos);
-  mWorldPos = Pos;
+  {
+    unique_lock<mutex> lock2(mGlobalMutex);
+    unique_lock<mutex> lock(mMutexPos);
+    SeqLockWriter writer(mSeqPos);
+    mWorldPos.Store(Pos);
+  }
+
+  mpMap->UpdateMapPoint(this, Pos);
 }
 
 Eigen::Vector3d MapPoint::GetWorldPos() {
-  unique_lock<mutex> lock(mMutexPos);
-  return mWorldPos;
+  return mSeqPos.Read(mWorldPos);
 }
 
 Eigen::Vector3d MapPoint::GetNormal() {
-  unique_lock<mutex> lock(mMutexPos);
-  return mNormalVector;
+  return mSeqPos.Read(mNormalVector);
 }
 
 KeyFrame* MapPoint::GetReferenceKeyFrame() {
@@ -99,6 +101,13 @@ void MapPoint::AddObservation(KeyFrame* pKF, size_t idx) {
   unique_lock<mutex> lock(mMutexFeatures);
   if (mObservations.count(pKF))
     return;
+
+  // Keep covisibility counters of observing keyframes up to date
+  for (map<KeyFrame*, size_t>::iterator mit=mObservations.begin(), mend=mObservations.end(); mit != mend; mit++) {
+    mit->first->ChangeCovisibility(pKF, 1);
+    pKF->ChangeCovisibility(mit->first, 1);
+  }
+
   mObservations[pKF]=idx;
 
   if (pKF->mvuRight[idx] >= 0)
@@ -120,6 +129,11 @@ void MapPoint::EraseObservation(KeyFrame* pKF) {
 
       mObservations.erase(pKF);
 
+      for (map<KeyFrame*, size_t>::iterator mit=mObservations.begin(), mend=mObservations.end(); mit != mend; mit++) {
+        mit->first->ChangeCovisibility(pKF, -1);
+        pKF->ChangeCovisibility(mit->first, -1);
+      }
+
       if (mpRefKF==pKF)
         mpRefKF = mObservations.begin()->first;
 
@@ -151,6 +165,7 @@ void MapPoint::SetBadFlag() {
     mbBad=true;
     obs = mObservations;
     mObservations.clear();
+    EraseCovisibility(obs);
   }
   for (map<KeyFrame*, size_t>::iterator mit=obs.begin(), mend=obs.end(); mit != mend; mit++) {
     KeyFrame* pKF = mit->first;
@@ -177,6 +192,7 @@ void MapPoint::Replace(MapPoint* pMP) {
     unique_lock<mutex> lock2(mMutexPos);
     obs = mObservations;
     mObservations.clear();
+    EraseCovisibility(obs);
     mbBad=true;
     nvisible = mnVisible;
     nfound = mnFound;
@@ -201,6 +217,16 @@ void MapPoint::Replace(MapPoint* pMP) {
   mpMap->EraseMapPoint(this);
 }
 
+void MapPoint::EraseCovisibility(const map<KeyFrame*, size_t> &observations) {
+  for (map<KeyFrame*, size_t>::const_iterator mit1=observations.begin(), mend=observations.end(); mit1 != mend; mit1++) {
+    map<KeyFrame*, size_t>::const_iterator mit2 = mit1;
+    for (mit2++; mit2 != mend; mit2++) {
+      mit1->first->ChangeCovisibility(mit2->first, -1);
+      mit2->first->ChangeCovisibility(mit1->first, -1);
+    }
+  }
+}
+
 bool MapPoint::isBad() {
   unique_lock<mutex> lock(mMutexFeatures);
   unique_lock<mutex> lock2(mMutexPos);
@@ -312,7 +338,7 @@ void MapPoint::UpdateNormalAndDepth() {
       return;
     observations = mObservations;
     pRefKF = mpRefKF;
-    Pos = mWorldPos;
+    Pos = mWorldPos.Load();
   }
 
   if (observations.empty())
@@ -323,14 +349,14 @@ void MapPoint::UpdateNormalAndDepth() {
   for (map<KeyFrame*, size_t>::iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
     KeyFrame* pKF = mit->first;
     Eigen::Vector3d Owi = pKF->GetCameraCenter();
-    Eigen::Vector3d normali = mWorldPos - Owi;
+    Eigen::Vector3d normali = Pos - Owi;
     normal = normal + normali/normali.norm();
     n++;
   }
 
   Eigen::Vector3d PC = Pos - pRefKF->GetCameraCenter();
   const float dist = PC.norm();
-  const int level = pRefKF->mvKeysUn[observations[pRefKF]].octave;
+  const int level = pRefKF->mvKeysUn.octave[observations[pRefKF]];
   const float levelScaleFactor =  pRefKF->mvScaleFactors[level];
   const int nLevels = pRefKF->mnScaleLevels;
 
@@ -338,7 +364,8 @@ void MapPoint::UpdateNormalAndDepth() {
     unique_lock<mutex> lock3(mMutexPos);
     mfMaxDistance = dist*levelScaleFactor;
     mfMinDistance = mfMaxDistance/pRefKF->mvScaleFactors[nLevels-1];
-    mNormalVector = normal/n;
+    SeqLockWriter writer(mSeqPos);
+    mNormalVector.Store(normal/n);
   }
 }
 
@@ -352,6 +379,12 @@ float MapPoint::GetMaxDistanceInvariance() {
   return 1.2f*mfMaxDistance;
 }
 
+void MapPoint::GetScaleDistances(float *minDistance, float *maxDistance) {
+  unique_lock<mutex> lock(mMutexPos);
+  *minDistance = mfMinDistance;
+  *maxDistance = mfMaxDistance;
+}
+
 int MapPoint::PredictScale(const float &currentDist, KeyFrame* pKF) {
   float ratio;
   {
@@ -384,6 +417,37 @@ int MapPoint::PredictScale(const float &currentDist, Frame* pF) {
   return nScale;
 }
 
-
+void MapPointArray::Assign(const vector<MapPoint*> &vpMPs) {
+  const size_t n = vpMPs.size();
+  x.resize(n);
+  y.resize(n);
+  z.resize(n);
+  nx.resize(n);
+  ny.resize(n);
+  nz.resize(n);
+  min_distance.resize(n);
+  max_distance.resize(n);
+
+  u.resize(n);
+  v.resize(n);
+  ur.resize(n);
+  distance.resize(n);
+  view_cos.resize(n);
+  level.resize(n);
+  visible.resize(n);
+
+  for (size_t i = 0; i < n; i++) {
+    MapPoint *pMP = vpMPs[i];
+    const Eigen::Vector3d P = pMP->GetWorldPos();
+    const Eigen::Vector3d Pn = pMP->GetNormal();
+    x[i] = P(0);
+    y[i] = P(1);
+    z[i] = P(2);
+    nx[i] = Pn(0);
+    ny[i] = Pn(1);
+    nz[i] = Pn(2);
+    pMP->GetScaleDistances(&min_distance[i], &max_distance[i]);
+  }
+}
 
 }  // namespace SD_SLAM
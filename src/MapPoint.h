@@ -31,6 +31,7 @@
 #include "KeyFrame.h"
 #include "Frame.h"
 #include "Map.h"
+#include "extra/seqlock.h"
 
 namespace SD_SLAM {
 
@@ -79,6 +80,7 @@ class MapPoint {
 
   float GetMinDistanceInvariance();
   float GetMaxDistanceInvariance();
+  void GetScaleDistances(float *minDistance, float *maxDistance);
   int PredictScale(const float &currentDist, KeyFrame*pKF);
   int PredictScale(const float &currentDist, Frame* pF);
 
@@ -113,14 +115,17 @@ class MapPoint {
   static std::mutex mGlobalMutex;
 
  protected:
+   // Remove covisibility shared between all pairs of observing keyframes
+   void EraseCovisibility(const std::map<KeyFrame*, size_t> &observations);
+
    // Position in absolute coordinates
-   Eigen::Vector3d mWorldPos;
+   SeqLockValue<Eigen::Vector3d> mWorldPos;
 
    // Keyframes observing the point and associated index in keyframe
    std::map<KeyFrame*, size_t> mObservations;
 
    // Mean viewing direction
-   Eigen::Vector3d mNormalVector;
+   SeqLockValue<Eigen::Vector3d> mNormalVector;
 
    // Best descriptor to fast matching
    cv::Mat mDescriptor;
@@ -142,13 +147,35 @@ class MapPoint {
 
    Map* mpMap;
 
+   // Writers of position and normal take mMutexPos, readers only go through mSeqPos
    std::mutex mMutexPos;
+   SeqLock mSeqPos;
    std::mutex mMutexFeatures;
 
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
 
+// Struct-of-arrays copy of the map point fields used by the frustum kernel
+// (Frame::isInFrustum), gathered once per local map update.
+struct MapPointArray {
+  std::vector<float> x, y, z;         // World position
+  std::vector<float> nx, ny, nz;      // Mean viewing direction
+  std::vector<float> min_distance;    // Scale invariance distances
+  std::vector<float> max_distance;
+
+  // Output of the kernel
+  std::vector<float> u, v, ur;        // Projection
+  std::vector<float> distance;        // Distance to camera center
+  std::vector<float> view_cos;        // Viewing angle cosine
+  std::vector<int> level;             // Predicted scale level
+  std::vector<uint8_t> visible;       // Point passed every check
+
+  inline size_t size() const { return x.size(); }
+
+  void Assign(const std::vector<MapPoint*> &vpMPs);
+};
+
 }  // namespace SD_SLAM
 
 #endif  // SD_SLAM_MAPPOINT_H
@@ -677,6 +677,17 @@ void ORBextractor::operator()(InputArray _image, InputArray _mask, vector<KeyPoi
   }
 }
 
+void ORBextractor::BuildPyramid(InputArray _image, vector<cv::Mat> &imagePyramid) {
+  if (_image.empty())
+    return;
+
+  Mat image = _image.getMat();
+  assert(image.type() == CV_8UC1 );
+
+  imagePyramid.resize(nlevels);
+  ComputePyramid(image, imagePyramid);
+}
+
 void ORBextractor::ComputePyramid(cv::Mat image, vector<cv::Mat> &imagePyramid) {
   for (int level = 0; level < nlevels; ++level) {
     float scale = mvInvScaleFactor[level];
@@ -45,6 +45,9 @@ class ORBextractor {
   void operator()(cv::InputArray image, cv::InputArray mask, std::vector<cv::KeyPoint>& keypoints,
                   cv::OutputArray descriptors, std::vector<cv::Mat> &imagePyramid);
 
+  // Compute only the scale pyramid of an image, same as the one built with the features
+  void BuildPyramid(cv::InputArray image, std::vector<cv::Mat> &imagePyramid);
+
   int inline GetLevels() {
     return nlevels;
   }
@@ -24,10 +24,13 @@
 
 #include "ORBmatcher.h"
 #include <limits.h>
+#include <algorithm>
 #include <opencv2/core/core.hpp>
 #include <opencv2/features2d/features2d.hpp>
 #include <stdint-gcc.h>
+#include "Config.h"
 #include "extra/timer.h"
+#include "extra/parallel_for.h"
 
 using namespace std;
 
@@ -40,82 +43,153 @@ const int ORBmatcher::HISTO_LENGTH = 30;
 ORBmatcher::ORBmatcher(float nnratio, bool checkOri): mfNNratio(nnratio), mbCheckOrientation(checkOri) {
 }
 
-int ORBmatcher::SearchByProjection(Frame &F, const vector<MapPoint*> &vpMapPoints, const float th) {
+int ORBmatcher::SearchByProjection(Frame &F, const vector<MapPoint*> &vpMapPoints, const float th, int threads) {
   int nmatches = 0;
+  int dist;
 
-  const bool bFactor = th!=1.0;
-
-  for (size_t iMP = 0; iMP<vpMapPoints.size(); iMP++) {
-    MapPoint* pMP = vpMapPoints[iMP];
-    if (!pMP->mbTrackInView)
+  // Search every point against the current matches of the frame, which are not modified.
+  // With a single thread this is the same search, so results do not depend on threads
+  const int nMPs = vpMapPoints.size();
+  vector<int> vBestIdx(nMPs, -1);
+  vector<int> vBestDist(nMPs, 256);
+  ParallelFor(0, nMPs, threads, [&](int iMP) {
+    vBestIdx[iMP] = SearchPointByProjection(F, vpMapPoints[iMP], th, &vBestDist[iMP]);
+  });
+
+  // Each keypoint goes to the point with lowest distance, ties to the first one
+  vector<int> vOwner(F.N, -1);
+  vector<int> vLosers;
+  for (int iMP = 0; iMP < nMPs; iMP++) {
+    const int idx = vBestIdx[iMP];
+    if (idx < 0)
       continue;
 
-    if (pMP->isBad())
-      continue;
+    const int owner = vOwner[idx];
+    if (owner < 0) {
+      vOwner[idx] = iMP;
+    } else if (vBestDist[iMP] < vBestDist[owner]) {
+      vOwner[idx] = iMP;
+      vLosers.push_back(owner);
+    } else {
+      vLosers.push_back(iMP);
+    }
+  }
 
-    const int &nPredictedLevel = pMP->mnTrackScaleLevel;
+  for (int idx = 0; idx < F.N; idx++) {
+    if (vOwner[idx] >= 0) {
+      F.mvpMapPoints[idx]=vpMapPoints[vOwner[idx]];
+      nmatches++;
+    }
+  }
 
-    // The size of the window will depend on the viewing direction
-    float r = RadiusByViewingCos(pMP->mTrackViewCos);
+  // Points that lost their keypoint search again among the free ones, in order
+  std::sort(vLosers.begin(), vLosers.end());
+  for (size_t i = 0; i < vLosers.size(); i++) {
+    const int bestIdx = SearchPointByProjection(F, vpMapPoints[vLosers[i]], th, &dist);
+    if (bestIdx >= 0) {
+      F.mvpMapPoints[bestIdx]=vpMapPoints[vLosers[i]];
+      nmatches++;
+    }
+  }
 
-    if (bFactor)
-      r*=th;
+  return nmatches;
+}
 
-    const vector<size_t> vIndices =
-        F.GetFeaturesInArea(pMP->mTrackProjX,pMP->mTrackProjY, r*F.mvScaleFactors[nPredictedLevel],nPredictedLevel-1,nPredictedLevel);
+int ORBmatcher::SearchPointByProjection(Frame &F, MapPoint *pMP, const float th, int *pDist) {
+  const bool bFactor = th!=1.0;
 
-    if (vIndices.empty())
-      continue;
+  if (!pMP->mbTrackInView)
+    return -1;
 
-    const cv::Mat MPdescriptor = pMP->GetDescriptor();
+  if (pMP->isBad())
+    return -1;
 
-    int bestDist=256;
-    int bestLevel= -1;
-    int bestDist2=256;
-    int bestLevel2 = -1;
-    int bestIdx =-1 ;
+  const int &nPredictedLevel = pMP->mnTrackScaleLevel;
 
-    // Get best and second matches with near keypoints
-    for (vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++) {
-      const size_t idx = *vit;
+  // The size of the window will depend on the viewing direction
+  float r = RadiusByViewingCos(pMP->mTrackViewCos);
 
-      if (F.mvpMapPoints[idx])
-        if (F.mvpMapPoints[idx]->Observations() > 0)
-          continue;
+  if (bFactor)
+    r*=th;
 
-      if (F.mvuRight[idx] > 0) {
-        const float er = fabs(pMP->mTrackProjXR-F.mvuRight[idx]);
-        if (er>r*F.mvScaleFactors[nPredictedLevel])
-          continue;
-      }
+  const vector<size_t> vIndices =
+      F.GetFeaturesInArea(pMP->mTrackProjX,pMP->mTrackProjY, r*F.mvScaleFactors[nPredictedLevel],nPredictedLevel-1,nPredictedLevel);
 
-      const cv::Mat &d = F.mDescriptors.row(idx);
+  if (vIndices.empty())
+    return -1;
 
-      const int dist = DescriptorDistance(MPdescriptor,d);
+  const cv::Mat MPdescriptor = pMP->GetDescriptor();
 
-      if (dist<bestDist) {
-        bestDist2=bestDist;
-        bestDist=dist;
-        bestLevel2 = bestLevel;
-        bestLevel = F.mvKeysUn[idx].octave;
-        bestIdx=idx;
-      } else if (dist<bestDist2) {
-        bestLevel2 = F.mvKeysUn[idx].octave;
-        bestDist2=dist;
-      }
-    }
+  int bestDist=256;
+  int bestLevel= -1;
+  int bestDist2=256;
+  int bestLevel2 = -1;
+  int bestIdx =-1 ;
 
-    // Apply ratio to second match (only if best and second are in the same scale level)
-    if (bestDist<=TH_HIGH) {
-      if (bestLevel==bestLevel2 && bestDist>mfNNratio*bestDist2)
+  // Get best and second matches with near keypoints
+  for (vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++) {
+    const size_t idx = *vit;
+
+    if (F.mvpMapPoints[idx])
+      if (F.mvpMapPoints[idx]->Observations() > 0)
         continue;
 
-      F.mvpMapPoints[bestIdx]=pMP;
-      nmatches++;
+    if (F.mvuRight[idx] > 0) {
+      const float er = fabs(pMP->mTrackProjXR-F.mvuRight[idx]);
+      if (er>r*F.mvScaleFactors[nPredictedLevel])
+        continue;
+    }
+
+    const cv::Mat &d = F.mDescriptors.row(idx);
+
+    const int dist = DescriptorDistance(MPdescriptor,d);
+
+    if (dist<bestDist) {
+      bestDist2=bestDist;
+      bestDist=dist;
+      bestLevel2 = bestLevel;
+      bestLevel = F.mvKeysUn.octave[idx];
+      bestIdx=idx;
+    } else if (dist<bestDist2) {
+      bestLevel2 = F.mvKeysUn.octave[idx];
+      bestDist2=dist;
     }
   }
 
-  return nmatches;
+  // Apply ratio to second match (only if best and second are in the same scale level)
+  if (bestDist<=TH_HIGH) {
+    if (bestLevel==bestLevel2 && bestDist>mfNNratio*bestDist2)
+      return -1;
+
+    *pDist = bestDist;
+    return bestIdx;
+  }
+
+  return -1;
+}
+
+float ORBmatcher::ProjectionVariance(const Frame &F, const Eigen::Vector3d &x3Dc, const Eigen::Matrix<double, 6, 6> &cov) {
+  const double invz = 1.0/x3Dc(2);
+  const double x = x3Dc(0)*invz;
+  const double y = x3Dc(1)*invz;
+
+  // Projection jacobian for a left perturbation: d(u, v)/dXc * [I, -[Xc]x]
+  Eigen::Matrix<double, 2, 3> Jp;
+  Jp << F.fx*invz, 0.0, -F.fx*x*invz,
+        0.0, F.fy*invz, -F.fy*y*invz;
+  Eigen::Matrix3d skew;
+  skew << 0.0, -x3Dc(2), x3Dc(1),
+          x3Dc(2), 0.0, -x3Dc(0),
+          -x3Dc(1), x3Dc(0), 0.0;
+  Eigen::Matrix<double, 2, 6> J;
+  J.leftCols<3>() = Jp;
+  J.rightCols<3>() = -Jp*skew;
+
+  // Largest eigenvalue of the 2x2 covariance
+  const Eigen::Matrix2d S = J*cov*J.transpose();
+  const double half_trace = 0.5*(S(0, 0)+S(1, 1));
+  const double half_diff = 0.5*(S(0, 0)-S(1, 1));
+  return half_trace + std::sqrt(half_diff*half_diff + S(0, 1)*S(0, 1));
 }
 
 float ORBmatcher::RadiusByViewingCos(const float &viewCos) {
@@ -125,13 +199,20 @@ float ORBmatcher::RadiusByViewingCos(const float &viewCos) {
     return 4.0;
 }
 
-bool ORBmatcher::CheckDistEpipolarLine(const cv::KeyPoint &kp1, const cv::KeyPoint &kp2, const Eigen::Matrix3d &F12, const KeyFrame* pKF2) {
+Eigen::Vector3f ORBmatcher::EpipolarLine(float x1, float y1, const Eigen::Matrix3d &F12) {
   // Epipolar line in second image l = x1'F12 = [a b c]
-  const float a = kp1.pt.x*F12(0, 0)+kp1.pt.y*F12(1, 0)+F12(2, 0);
-  const float b = kp1.pt.x*F12(0, 1)+kp1.pt.y*F12(1, 1)+F12(2, 1);
-  const float c = kp1.pt.x*F12(0, 2)+kp1.pt.y*F12(1, 2)+F12(2, 2);
+  const float a = x1*F12(0, 0)+y1*F12(1, 0)+F12(2, 0);
+  const float b = x1*F12(0, 1)+y1*F12(1, 1)+F12(2, 1);
+  const float c = x1*F12(0, 2)+y1*F12(1, 2)+F12(2, 2);
+  return Eigen::Vector3f(a, b, c);
+}
+
+bool ORBmatcher::CheckDistEpipolarLine(const Eigen::Vector3f &l2, float x2, float y2, int octave2, const KeyFrame* pKF2) {
+  const float a = l2(0);
+  const float b = l2(1);
+  const float c = l2(2);
 
-  const float num = a*kp2.pt.x+b*kp2.pt.y+c;
+  const float num = a*x2+b*y2+c;
 
   const float den = a*a+b*b;
 
@@ -140,7 +221,7 @@ bool ORBmatcher::CheckDistEpipolarLine(const cv::KeyPoint &kp1, const cv::KeyPoi
 
   const float dsqr = num*num/den;
 
-  return dsqr<3.84*pKF2->mvLevelSigma2[kp2.octave];
+  return dsqr<3.84*pKF2->mvLevelSigma2[octave2];
 }
 
 int ORBmatcher::SearchByProjection(KeyFrame* pKF, const Eigen::Matrix4d &Scw, const vector<MapPoint*> &vpPoints, vector<MapPoint*> &vpMatched, int th) {
@@ -228,7 +309,7 @@ int ORBmatcher::SearchByProjection(KeyFrame* pKF, const Eigen::Matrix4d &Scw, co
       if (vpMatched[idx])
         continue;
 
-      const int &kpLevel= pKF->mvKeysUn[idx].octave;
+      const int kpLevel = pKF->mvKeysUn.octave[idx];
 
       if (kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
         continue;
@@ -266,8 +347,7 @@ int ORBmatcher::SearchForInitialization(Frame &F1, Frame &F2, vector<cv::Point2f
   vector<int> vnMatches21(F2.mvKeysUn.size(),-1);
 
   for (size_t i1 = 0, iend1=F1.mvKeysUn.size(); i1<iend1; i1++) {
-    cv::KeyPoint kp1 = F1.mvKeysUn[i1];
-    int level1 = kp1.octave;
+    int level1 = F1.mvKeysUn.octave[i1];
     if (level1 > 0)
       continue;
 
@@ -313,7 +393,7 @@ int ORBmatcher::SearchForInitialization(Frame &F1, Frame &F2, vector<cv::Point2f
         nmatches++;
 
         if (mbCheckOrientation) {
-          float rot = F1.mvKeysUn[i1].angle-F2.mvKeysUn[bestIdx2].angle;
+          float rot = F1.mvKeysUn.angle[i1]-F2.mvKeysUn.angle[bestIdx2];
           if (rot < 0.0)
             rot+=360.0f;
           int bin = round(rot*factor);
@@ -351,7 +431,7 @@ int ORBmatcher::SearchForInitialization(Frame &F1, Frame &F2, vector<cv::Point2f
   //Update prev matched
   for (size_t i1 = 0, iend1=vnMatches12.size(); i1<iend1; i1++)
     if (vnMatches12[i1] >= 0)
-      vbPrevMatched[i1]=F2.mvKeysUn[vnMatches12[i1]].pt;
+      vbPrevMatched[i1]=F2.mvKeysUn.pt(vnMatches12[i1]);
 
   return nmatches;
 }
@@ -389,7 +469,7 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, const Eig
       continue;
 
     const bool bStereo1 = pKF1->mvuRight[idx1] >= 0;
-    const cv::KeyPoint &kp1 = pKF1->mvKeysUn[idx1];
+    const Eigen::Vector3f l2 = EpipolarLine(pKF1->mvKeysUn.x[idx1], pKF1->mvKeysUn.y[idx1], F12);
     const cv::Mat &d1 = pKF1->mDescriptors.row(idx1);
 
     int bestDist = TH_LOW;
@@ -404,8 +484,10 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, const Eig
 
       const bool bStereo2 = pKF2->mvuRight[idx2] >= 0;
 
-      const cv::KeyPoint &kp2 = pKF2->mvKeysUn[idx2];
-      if (!CheckDistEpipolarLine(kp1, kp2, F12, pKF2))
+      const float x2 = pKF2->mvKeysUn.x[idx2];
+      const float y2 = pKF2->mvKeysUn.y[idx2];
+      const int octave2 = pKF2->mvKeysUn.octave[idx2];
+      if (!CheckDistEpipolarLine(l2, x2, y2, octave2, pKF2))
         continue;
 
       const cv::Mat &d2 = pKF2->mDescriptors.row(idx2);
@@ -416,9 +498,9 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, const Eig
         continue;
 
       if (!bStereo1 && !bStereo2) {
-        const float distex = ex-kp2.pt.x;
-        const float distey = ey-kp2.pt.y;
-        if (distex*distex+distey*distey<100*pKF2->mvScaleFactors[kp2.octave])
+        const float distex = ex-x2;
+        const float distey = ey-y2;
+        if (distex*distex+distey*distey<100*pKF2->mvScaleFactors[octave2])
           continue;
       }
 
@@ -427,12 +509,11 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, const Eig
     }
 
     if (bestIdx2 >= 0) {
-      const cv::KeyPoint &kp2 = pKF2->mvKeysUn[bestIdx2];
       vMatches12[idx1]=bestIdx2;
       nmatches++;
 
       if (mbCheckOrientation) {
-        float rot = kp1.angle-kp2.angle;
+        float rot = pKF1->mvKeysUn.angle[idx1]-pKF2->mvKeysUn.angle[bestIdx2];
         if (rot < 0.0)
           rot+=360.0f;
         int bin = round(rot*factor);
@@ -474,7 +555,7 @@ int ORBmatcher::SearchForTriangulation(KeyFrame *pKF1, KeyFrame *pKF2, const Eig
   return nmatches;
 }
 
-int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const float th) {
+int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const float th, vector<MapPoint*> *pvChanged) {
   Eigen::Matrix3d Rcw = pKF->GetRotation();
   Eigen::Vector3d tcw = pKF->GetTranslation();
 
@@ -553,17 +634,15 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
     for (vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++) {
       const size_t idx = *vit;
 
-      const cv::KeyPoint &kp = pKF->mvKeysUn[idx];
-
-      const int &kpLevel= kp.octave;
+      const int kpLevel = pKF->mvKeysUn.octave[idx];
 
       if (kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
         continue;
 
       if (pKF->mvuRight[idx] >= 0) {
         // Check reprojection error in stereo
-        const float &kpx = kp.pt.x;
-        const float &kpy = kp.pt.y;
+        const float &kpx = pKF->mvKeysUn.x[idx];
+        const float &kpy = pKF->mvKeysUn.y[idx];
         const float &kpr = pKF->mvuRight[idx];
         const float ex = u-kpx;
         const float ey = v-kpy;
@@ -573,8 +652,8 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
         if (e2*pKF->mvInvLevelSigma2[kpLevel]>7.8)
           continue;
       } else {
-        const float &kpx = kp.pt.x;
-        const float &kpy = kp.pt.y;
+        const float &kpx = pKF->mvKeysUn.x[idx];
+        const float &kpy = pKF->mvKeysUn.y[idx];
         const float ex = u-kpx;
         const float ey = v-kpy;
         const float e2 = ex*ex+ey*ey;
@@ -602,10 +681,18 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const vector<MapPoint *> &vpMapPoints, const
             pMP->Replace(pMPinKF);
           else
             pMPinKF->Replace(pMP);
+
+          if (pvChanged) {
+            pvChanged->push_back(pMP);
+            pvChanged->push_back(pMPinKF);
+          }
         }
       } else {
         pMP->AddObservation(pKF,bestIdx);
         pKF->AddMapPoint(pMP,bestIdx);
+
+        if (pvChanged)
+          pvChanged->push_back(pMP);
       }
       nFused++;
     }
@@ -699,7 +786,7 @@ int ORBmatcher::Fuse(KeyFrame *pKF, const Eigen::Matrix4d &Scw, const vector<Map
     int bestIdx = -1;
     for (vector<size_t>::const_iterator vit=vIndices.begin(); vit!=vIndices.end(); vit++) {
       const size_t idx = *vit;
-      const int &kpLevel = pKF->mvKeysUn[idx].octave;
+      const int kpLevel = pKF->mvKeysUn.octave[idx];
 
       if (kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
         continue;
@@ -829,9 +916,9 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
     for (vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++) {
       const size_t idx = *vit;
 
-      const cv::KeyPoint &kp = pKF2->mvKeysUn[idx];
+      const int kpLevel = pKF2->mvKeysUn.octave[idx];
 
-      if (kp.octave<nPredictedLevel-1 || kp.octave>nPredictedLevel)
+      if (kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
         continue;
 
       const cv::Mat &dKF = pKF2->mDescriptors.row(idx);
@@ -905,9 +992,9 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
     for (vector<size_t>::const_iterator vit=vIndices.begin(), vend=vIndices.end(); vit!=vend; vit++) {
       const size_t idx = *vit;
 
-      const cv::KeyPoint &kp = pKF1->mvKeysUn[idx];
+      const int kpLevel = pKF1->mvKeysUn.octave[idx];
 
-      if (kp.octave<nPredictedLevel-1 || kp.octave>nPredictedLevel)
+      if (kpLevel<nPredictedLevel-1 || kpLevel>nPredictedLevel)
         continue;
 
       const cv::Mat &dKF = pKF1->mDescriptors.row(idx);
@@ -943,8 +1030,10 @@ int ORBmatcher::SearchBySim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint*> &
   return nFound;
 }
 
-int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame, const float th, const bool bMono) {
+int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame, const float th, const bool bMono,
+                                   const Eigen::Matrix<double, 6, 6> *pPoseCov, bool *pbBounded) {
   int nmatches = 0;
+  bool bBounded = pPoseCov != NULL;
 
   // Rotation Histogram (to check rotation consistency)
   vector<int> rotHist[HISTO_LENGTH];
@@ -994,6 +1083,16 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
         // Search in a window. Size depends on scale
         float radius = th*CurrentFrame.mvScaleFactors[nLastOctave];
 
+        // Shrink window to the pose uncertainty (chi2 95%, 2 dof) plus keypoint uncertainty
+        if (pPoseCov) {
+          const float variance = ProjectionVariance(CurrentFrame, x3Dc, *pPoseCov);
+          const float covRadius = std::sqrt(5.991f*variance) + CurrentFrame.mvScaleFactors[nLastOctave];
+          if (covRadius < radius)
+            radius = covRadius;
+          else
+            bBounded = false;
+        }
+
         vector<size_t> vIndices2;
 
         if (bForward)
@@ -1039,7 +1138,7 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
           nmatches++;
 
           if (mbCheckOrientation) {
-            float rot = LastFrame.mvKeysUn[i].angle-CurrentFrame.mvKeysUn[bestIdx2].angle;
+            float rot = LastFrame.mvKeysUn.angle[i]-CurrentFrame.mvKeysUn.angle[bestIdx2];
             if (rot < 0.0)
               rot+=360.0f;
             int bin = round(rot*factor);
@@ -1053,6 +1152,9 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame,
     }
   }
 
+  if (pbBounded)
+    *pbBounded = bBounded;
+
   //Apply rotation consistency
   if (mbCheckOrientation) {
     int ind1=-1;
@@ -1171,7 +1273,7 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame* pKF, const flo
           nmatches++;
 
           if (mbCheckOrientation) {
-            float rot = pKF->mvKeysUn[i].angle-CurrentFrame.mvKeysUn[bestIdx2].angle;
+            float rot = pKF->mvKeysUn.angle[i]-CurrentFrame.mvKeysUn.angle[bestIdx2];
             if (rot < 0.0)
               rot+=360.0f;
             int bin = round(rot*factor);
@@ -1215,17 +1317,23 @@ int ORBmatcher::SearchByPoints(KeyFrame* currentKF, KeyFrame* pKF, vector<MapPoi
     rotHist[i].reserve(500);
   const float factor = 1.0f/HISTO_LENGTH;
 
-  const vector<cv::KeyPoint> &vKeysUn1 = currentKF->mvKeysUn;
+  const KeyPointArray &vKeysUn1 = currentKF->mvKeysUn;
   const vector<MapPoint*> vpMapPoints1 = currentKF->GetMapPointMatches();
   const cv::Mat &Descriptors1 = currentKF->mDescriptors;
 
-  const vector<cv::KeyPoint> &vKeysUn2 = pKF->mvKeysUn;
+  const KeyPointArray &vKeysUn2 = pKF->mvKeysUn;
   const vector<MapPoint*> vpMapPoints2 = pKF->GetMapPointMatches();
   const cv::Mat &Descriptors2 = pKF->mDescriptors;
 
   matches = vector<MapPoint*>(vpMapPoints1.size(), static_cast<MapPoint*>(NULL));
   vector<bool> vbMatched2(vpMapPoints2.size(), false);
 
+  // Compare only with descriptors sharing a hash bucket, or with all of them
+  const DescriptorIndex *pIndex = Config::UseDescriptorIndex() ? &pKF->GetDescriptorIndex() : NULL;
+  vector<int> vVisited, vCandidates;
+  if (pIndex)
+    vVisited.assign(pIndex->Size(), -1);
+
   for (size_t idx1 = 0; idx1<vpMapPoints1.size(); idx1++) {
     MapPoint* pMP1 = vpMapPoints1[idx1];
     if (!pMP1)
@@ -1240,7 +1348,12 @@ int ORBmatcher::SearchByPoints(KeyFrame* currentKF, KeyFrame* pKF, vector<MapPoi
     int bestIdx2 =-1 ;
     int bestDist2=256;
 
-    for (size_t idx2 = 0; idx2<vpMapPoints2.size(); idx2++) {
+    if (pIndex)
+      pIndex->Query(d1.ptr<uint8_t>(), idx1, vVisited, vCandidates);
+    const size_t nCandidates = pIndex ? vCandidates.size() : vpMapPoints2.size();
+
+    for (size_t k = 0; k<nCandidates; k++) {
+      const size_t idx2 = pIndex ? vCandidates[k] : k;
       MapPoint* pMP2 = vpMapPoints2[idx2];
       if (!pMP2 || vbMatched2[idx2])
         continue;
@@ -1267,7 +1380,7 @@ int ORBmatcher::SearchByPoints(KeyFrame* currentKF, KeyFrame* pKF, vector<MapPoi
         vbMatched2[bestIdx2] = true;
 
         if (mbCheckOrientation){
-          float rot = vKeysUn1[idx1].angle-vKeysUn2[bestIdx2].angle;
+          float rot = vKeysUn1.angle[idx1]-vKeysUn2.angle[bestIdx2];
           if (rot < 0.0)
             rot+=360.0f;
           int bin = round(rot*factor);
@@ -1385,7 +1498,7 @@ int ORBmatcher::SearchByProjection(Frame &CurrentFrame, KeyFrame *pKF, const set
           nmatches++;
 
           if (mbCheckOrientation) {
-            float rot = pKF->mvKeysUn[i].angle-CurrentFrame.mvKeysUn[bestIdx2].angle;
+            float rot = pKF->mvKeysUn.angle[i]-CurrentFrame.mvKeysUn.angle[bestIdx2];
             if (rot < 0.0)
               rot+=360.0f;
             int bin = round(rot*factor);
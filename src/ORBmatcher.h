@@ -43,12 +43,17 @@ class ORBmatcher {
   static int DescriptorDistance(const cv::Mat &a, const cv::Mat &b);
 
   // Search matches between Frame keypoints and projected MapPoints. Returns number of matches
-  // Used to track the local map (Tracking)
-  int SearchByProjection(Frame &F, const std::vector<MapPoint*> &vpMapPoints, const float th=3);
+  // Used to track the local map (Tracking). Points are searched independently, in parallel if
+  // threads > 1: a keypoint claimed by several points goes to the lowest distance (then lowest
+  // index) and the rest search again in order, so results are the same for any number of threads.
+  int SearchByProjection(Frame &F, const std::vector<MapPoint*> &vpMapPoints, const float th=3, int threads=1);
 
   // Project MapPoints tracked in last frame into the current frame and search matches.
-  // Used to track from previous frame (Tracking)
-  int SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame, const float th, const bool bMono);
+  // Used to track from previous frame (Tracking). If the pose covariance is given, each window
+  // covers the 95% region of the projection, up to the fixed window size. pbBounded is set if
+  // every window was smaller than the fixed one, so a larger th would search the same windows.
+  int SearchByProjection(Frame &CurrentFrame, const Frame &LastFrame, const float th, const bool bMono,
+                         const Eigen::Matrix<double, 6, 6> *pPoseCov = NULL, bool *pbBounded = NULL);
   int SearchByProjection(Frame &CurrentFrame, KeyFrame* pKF, const float th, const bool bMono);
 
   // Compare matched points in both keyframes.
@@ -75,7 +80,9 @@ class ORBmatcher {
   int SearchBySim3(KeyFrame* pKF1, KeyFrame* pKF2, std::vector<MapPoint *> &vpMatches12, const float &s12, const Eigen::Matrix3d &R12, const Eigen::Vector3d &t12, const float th);
 
   // Project MapPoints into KeyFrame and search for duplicated MapPoints.
-  int Fuse(KeyFrame* pKF, const std::vector<MapPoint *> &vpMapPoints, const float th=3.0);
+  // MapPoints whose observations changed are added to pvChanged if given
+  int Fuse(KeyFrame* pKF, const std::vector<MapPoint *> &vpMapPoints, const float th=3.0,
+           std::vector<MapPoint*> *pvChanged=NULL);
 
   // Project MapPoints into KeyFrame using a given Sim3 and search for duplicated MapPoints.
   int Fuse(KeyFrame* pKF, const Eigen::Matrix4d &Scw, const std::vector<MapPoint*> &vpPoints, float th, std::vector<MapPoint *> &vpReplacePoint);
@@ -86,10 +93,19 @@ class ORBmatcher {
   static const int HISTO_LENGTH;
 
  protected:
-  bool CheckDistEpipolarLine(const cv::KeyPoint &kp1, const cv::KeyPoint &kp2, const Eigen::Matrix3d &F12, const KeyFrame *pKF);
+  // Epipolar line in second image of point (x1, y1) in first image
+  Eigen::Vector3f EpipolarLine(float x1, float y1, const Eigen::Matrix3d &F12);
+
+  bool CheckDistEpipolarLine(const Eigen::Vector3f &l2, float x2, float y2, int octave2, const KeyFrame *pKF2);
 
   float RadiusByViewingCos(const float &viewCos);
 
+  // Largest variance (pixels^2) of the projection of a point in camera coordinates given the pose covariance
+  float ProjectionVariance(const Frame &F, const Eigen::Vector3d &x3Dc, const Eigen::Matrix<double, 6, 6> &cov);
+
+  // Best keypoint of F for a projected MapPoint, -1 if none (used by SearchByProjection)
+  int SearchPointByProjection(Frame &F, MapPoint *pMP, const float th, int *pDist);
+
   void ComputeThreeMaxima(std::vector<int>* histo, const int L, int &ind1, int &ind2, int &ind3);
 
   float mfNNratio;
@@ -24,9 +24,16 @@
 
 #include "Optimizer.h"
 #include <mutex>
+#include <algorithm>
 #include <Eigen/StdVector>
 #include "Converter.h"
+#include "Config.h"
+#include "BundleAdjuster.h"
+#include "PoseGraphSolver.h"
+#include "extra/timer.h"
+#include "extra/log.h"
 #include "extra/g2o/core/block_solver.h"
+#include "extra/g2o/core/hyper_graph_action.h"
 #include "extra/g2o/core/optimization_algorithm_levenberg.h"
 #include "extra/g2o/solvers/linear_solver_eigen.h"
 #include "extra/g2o/types/types_six_dof_expmap.h"
@@ -43,15 +50,246 @@ using std::unique_lock;
 
 namespace SD_SLAM {
 
+// Stops g2o when the external flag is set or the time budget is exhausted.
+// Called every time errors are computed, so a rejected step is never kept
+class BudgetStopAction : public g2o::HyperGraphAction {
+ public:
+  BudgetStopAction(Timer *pTimer, double budget, bool *pbStopFlag, bool *pbStop) :
+    mpTimer(pTimer), mBudget(budget), mpbStopFlag(pbStopFlag), mpbStop(pbStop) {}
+
+  virtual g2o::HyperGraphAction* operator()(const g2o::HyperGraph* graph, Parameters* parameters = 0) {
+    mpTimer->Stop();
+    *mpbStop = (mpbStopFlag && *mpbStopFlag) || mpTimer->GetMsTime() > mBudget;
+    return this;
+  }
+
+ private:
+  Timer *mpTimer;
+  double mBudget;
+  bool *mpbStopFlag;
+  bool *mpbStop;
+};
+
+void LocalBAProblem::UpdateBudget(double time, double budget, size_t nLocalKFs) {
+  double usage = time/budget;
+  mdBudgetUsage += usage;
+  mnBudgetCalls++;
+
+  // Shrink the window when the budget is exceeded, grow it back when there is margin
+  if (usage > 1.0)
+    mnMaxLocalKFs = std::max<size_t>(2, static_cast<size_t>(nLocalKFs/usage));
+  else if (usage < 0.5 && mnMaxLocalKFs > 0 && nLocalKFs >= mnMaxLocalKFs)
+    mnMaxLocalKFs++;
+
+  LOGD("Local BA used %.2f of %.2fms (%.0f%%, mean %.0f%%), %d local keyframes", time, budget,
+       100.0*usage, 100.0*mdBudgetUsage/mnBudgetCalls, static_cast<int>(nLocalKFs));
+}
+
+void LocalBAProblem::KeyFrameChanged(KeyFrame *pKF) {
+  const vector<MapPoint*> vpMPs = pKF->GetMapPointMatches();
+  for (size_t i = 0; i < vpMPs.size(); i++) {
+    if (vpMPs[i])
+      MapPointChanged(vpMPs[i]);
+  }
+}
+
 void Optimizer::GlobalBundleAdjustemnt(Map* pMap, int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust) {
   vector<KeyFrame*> vpKFs = pMap->GetAllKeyFrames();
   vector<MapPoint*> vpMP = pMap->GetAllMapPoints();
-  BundleAdjustment(vpKFs, vpMP,nIterations,pbStopFlag, nLoopKF, bRobust);
+
+  const int nSubmapKFs = Config::SubmapKeyFrames();
+  if (nSubmapKFs > 0 && static_cast<int>(vpKFs.size()) > 2*nSubmapKFs)
+    PartitionedBundleAdjustment(vpKFs, vpMP, nSubmapKFs, nIterations, pbStopFlag, nLoopKF, bRobust);
+  else
+    BundleAdjustment(vpKFs, vpMP,nIterations,pbStopFlag, nLoopKF, bRobust);
 }
 
+void Optimizer::PartitionedBundleAdjustment(const vector<KeyFrame*> &vpKFs, const vector<MapPoint*> &vpMP, int nSubmapKFs,
+                                            int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust) {
+  Timer total(true);
+
+  // Keyframes sorted by id, so that partitions do not depend on pointer order
+  vector<KeyFrame*> vpGoodKFs;
+  for (size_t i = 0; i < vpKFs.size(); i++) {
+    if (!vpKFs[i]->isBad())
+      vpGoodKFs.push_back(vpKFs[i]);
+  }
+  std::sort(vpGoodKFs.begin(), vpGoodKFs.end(), KeyFrame::lId);
+
+  const int nKFs = vpGoodKFs.size();
+  map<KeyFrame*, int> KFIndices;
+  for (int i = 0; i < nKFs; i++)
+    KFIndices[vpGoodKFs[i]] = i;
+
+  // Grow submaps along the covisibility graph
+  vector<int> vSubmap(nKFs, -1);
+  int nSubmaps = 0;
+  for (int i = 0; i < nKFs; i++) {
+    if (vSubmap[i] >= 0)
+      continue;
+
+    const int nSubmap = nSubmaps++;
+    int nSubmapSize = 0;
+    list<int> lQueue;
+    lQueue.push_back(i);
+    vSubmap[i] = nSubmap;
+
+    while (!lQueue.empty()) {
+      int k = lQueue.front();
+      lQueue.pop_front();
+      nSubmapSize++;
+
+      const vector<KeyFrame*> vNeighs = vpGoodKFs[k]->GetVectorCovisibleKeyFrames();
+      for (size_t j = 0; j < vNeighs.size() && nSubmapSize+static_cast<int>(lQueue.size()) < nSubmapKFs; j++) {
+        map<KeyFrame*, int>::const_iterator it = KFIndices.find(vNeighs[j]);
+        if (it == KFIndices.end() || vSubmap[it->second] >= 0)
+          continue;
+        vSubmap[it->second] = nSubmap;
+        lQueue.push_back(it->second);
+      }
+    }
+  }
+
+  // Same problem as BundleAdjustment. Each submap is a group of cameras: the interior of
+  // each submap is eliminated onto the separator keyframes, so steps are exact
+  BundleAdjuster ba;
+  ba.SetRobust(bRobust);
+  ba.SetThreads(Config::OptimizerThreads());
+
+  for (int i = 0; i < nKFs; i++) {
+    int camera = ba.AddCamera(vpGoodKFs[i]->GetPose(), vpGoodKFs[i]->mnId == 0);
+    ba.SetCameraGroup(camera, vSubmap[i]);
+  }
+
+  vector<MapPoint*> vpGoodMPs;
+  for (size_t i = 0; i < vpMP.size(); i++) {
+    MapPoint* pMP = vpMP[i];
+    if (pMP->isBad())
+      continue;
+
+    const map<KeyFrame*, size_t> observations = pMP->GetObservations();
+    int point = -1;
+    for (map<KeyFrame*, size_t>::const_iterator mit=observations.begin(); mit!=observations.end(); mit++) {
+      map<KeyFrame*, int>::const_iterator it = KFIndices.find(mit->first);
+      if (it == KFIndices.end())
+        continue;
+
+      if (point < 0) {
+        point = ba.AddPoint(pMP->GetWorldPos());
+        vpGoodMPs.push_back(pMP);
+      }
+
+      KeyFrame* pKF = mit->first;
+      const float u = pKF->mvKeysUn.x[mit->second];
+      const float v = pKF->mvKeysUn.y[mit->second];
+      const int octave = pKF->mvKeysUn.octave[mit->second];
+      ba.AddObservation(it->second, point, u, v, pKF->mvuRight[mit->second],
+                        pKF->mvInvLevelSigma2[octave], pKF->fx, pKF->fy, pKF->cx, pKF->cy, pKF->mbf);
+    }
+  }
+
+  ba.Optimize(nIterations, pbStopFlag);
+
+  // Recover optimized data
+  for (int i = 0; i < nKFs; i++) {
+    KeyFrame* pKF = vpGoodKFs[i];
+    if (nLoopKF == 0) {
+      pKF->SetPose(ba.GetCameraPose(i));
+    } else {
+      pKF->mTcwGBA = ba.GetCameraPose(i);
+      pKF->mnBAGlobalForKF = nLoopKF;
+    }
+  }
+
+  for (size_t i = 0; i < vpGoodMPs.size(); i++) {
+    MapPoint* pMP = vpGoodMPs[i];
+    if (nLoopKF == 0) {
+      pMP->SetWorldPos(ba.GetPoint(i));
+      pMP->UpdateNormalAndDepth();
+    } else {
+      pMP->mPosGBA = ba.GetPoint(i);
+      pMP->mnBAGlobalForKF = nLoopKF;
+    }
+  }
+
+  total.Stop();
+  LOGD("Partitioned BA time is %.2fms (%d submaps, %d keyframes, %d separator keyframes, %d points)",
+       total.GetMsTime(), nSubmaps, nKFs, ba.NumSeparatorCameras(), static_cast<int>(vpGoodMPs.size()));
+}
+
+
+void Optimizer::LoopBundleAdjustment(Map* pMap, KeyFrame* pCurKF, KeyFrame* pLoopKF, int nMaxKFs,
+                                     int nIterations, bool* pbStopFlag, const unsigned long nLoopKF) {
+  Timer total(true);
+
+  // Keyframes around the loop: breadth first search on both sides at the same time
+  vector<KeyFrame*> vpKFs;
+  set<KeyFrame*> sRegion;
+  list<KeyFrame*> lQueue;
+  lQueue.push_back(pCurKF);
+  lQueue.push_back(pLoopKF);
+  sRegion.insert(pCurKF);
+  sRegion.insert(pLoopKF);
+
+  while (!lQueue.empty() && static_cast<int>(vpKFs.size()) < nMaxKFs) {
+    KeyFrame* pKFi = lQueue.front();
+    lQueue.pop_front();
+    if (pKFi->isBad())
+      continue;
+    vpKFs.push_back(pKFi);
+
+    const vector<KeyFrame*> vNeighs = pKFi->GetVectorCovisibleKeyFrames();
+    for (size_t i = 0; i < vNeighs.size(); i++) {
+      if (sRegion.insert(vNeighs[i]).second)
+        lQueue.push_back(vNeighs[i]);
+    }
+  }
+  sRegion = set<KeyFrame*>(vpKFs.begin(), vpKFs.end());
+
+  // Their points, and keyframes observing them out of the region as fixed ones
+  vector<MapPoint*> vpMPs;
+  set<MapPoint*> sMPs;
+  set<KeyFrame*> sFixedKFs;
+  for (size_t i = 0; i < vpKFs.size(); i++) {
+    const vector<MapPoint*> vpMPi = vpKFs[i]->GetMapPointMatches();
+    for (size_t j = 0; j < vpMPi.size(); j++) {
+      MapPoint* pMP = vpMPi[j];
+      if (!pMP || pMP->isBad() || !sMPs.insert(pMP).second)
+        continue;
+      vpMPs.push_back(pMP);
+
+      const map<KeyFrame*, size_t> observations = pMP->GetObservations();
+      for (map<KeyFrame*, size_t>::const_iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
+        KeyFrame* pKFi = mit->first;
+        if (!pKFi->isBad() && !sRegion.count(pKFi) && sFixedKFs.insert(pKFi).second)
+          vpKFs.push_back(pKFi);
+      }
+    }
+  }
+
+  // Keyframes out of the problem keep their current pose. Keyframes created later are
+  // still corrected through the spanning tree
+  if (nLoopKF != 0) {
+    const vector<KeyFrame*> vpAllKFs = pMap->GetAllKeyFrames();
+    for (size_t i = 0; i < vpAllKFs.size(); i++) {
+      KeyFrame* pKFi = vpAllKFs[i];
+      if (pKFi->isBad() || sRegion.count(pKFi) || sFixedKFs.count(pKFi))
+        continue;
+      pKFi->mTcwGBA = pKFi->GetPose();
+      pKFi->mnBAGlobalForKF = nLoopKF;
+    }
+  }
+
+  BundleAdjustment(vpKFs, vpMPs, nIterations, pbStopFlag, nLoopKF, false, sFixedKFs);
+
+  total.Stop();
+  LOGD("Loop BA time is %.2fms (%d keyframes, %d fixed, %d points)", total.GetMsTime(),
+       static_cast<int>(sRegion.size()), static_cast<int>(sFixedKFs.size()), static_cast<int>(vpMPs.size()));
+}
 
 void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<MapPoint *> &vpMP,
-                 int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust) {
+                 int nIterations, bool* pbStopFlag, const unsigned long nLoopKF, const bool bRobust,
+                 const set<KeyFrame*> &sFixedKFs) {
   vector<bool> vbNotIncludedMP;
   vbNotIncludedMP.resize(vpMP.size());
 
@@ -64,6 +302,7 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
 
   g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
   optimizer.setAlgorithm(solver);
+  optimizer.setNumThreads(Config::OptimizerThreads());
 
   if (pbStopFlag)
     optimizer.setForceStopFlag(pbStopFlag);
@@ -78,7 +317,7 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
     g2o::VertexSE3Expmap * vSE3 = new g2o::VertexSE3Expmap();
     vSE3->setEstimate(Converter::toSE3Quat(pKF->GetPose()));
     vSE3->setId(pKF->mnId);
-    vSE3->setFixed(pKF->mnId == 0);
+    vSE3->setFixed(pKF->mnId == 0 || sFixedKFs.count(pKF));
     optimizer.addVertex(vSE3);
     if (pKF->mnId>maxKFid)
       maxKFid=pKF->mnId;
@@ -106,23 +345,25 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
     for (map<KeyFrame*, size_t>::const_iterator mit=observations.begin(); mit!=observations.end(); mit++) {
 
       KeyFrame* pKF = mit->first;
-      if (pKF->isBad() || pKF->mnId>maxKFid)
+      if (pKF->isBad() || pKF->mnId>maxKFid || !optimizer.vertex(pKF->mnId))
         continue;
 
       nEdges++;
 
-      const cv::KeyPoint &kpUn = pKF->mvKeysUn[mit->second];
+      const float u = pKF->mvKeysUn.x[mit->second];
+      const float v = pKF->mvKeysUn.y[mit->second];
+      const int octave = pKF->mvKeysUn.octave[mit->second];
 
       if (pKF->mvuRight[mit->second] < 0) {
         Eigen::Matrix<double, 2, 1> obs;
-        obs << kpUn.pt.x, kpUn.pt.y;
+        obs << u, v;
 
         g2o::EdgeSE3ProjectXYZ* e = new g2o::EdgeSE3ProjectXYZ();
 
         e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id)));
         e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKF->mnId)));
         e->setMeasurement(obs);
-        const float &invSigma2 = pKF->mvInvLevelSigma2[kpUn.octave];
+        const float &invSigma2 = pKF->mvInvLevelSigma2[octave];
         e->setInformation(Eigen::Matrix2d::Identity()*invSigma2);
 
         if (bRobust) {
@@ -140,14 +381,14 @@ void Optimizer::BundleAdjustment(const vector<KeyFrame *> &vpKFs, const vector<M
       } else {
         Eigen::Matrix<double, 3, 1> obs;
         const float kp_ur = pKF->mvuRight[mit->second];
-        obs << kpUn.pt.x, kpUn.pt.y, kp_ur;
+        obs << u, v, kp_ur;
 
         g2o::EdgeStereoSE3ProjectXYZ* e = new g2o::EdgeStereoSE3ProjectXYZ();
 
         e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id)));
         e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKF->mnId)));
         e->setMeasurement(obs);
-        const float &invSigma2 = pKF->mvInvLevelSigma2[kpUn.octave];
+        const float &invSigma2 = pKF->mvInvLevelSigma2[octave];
         Eigen::Matrix3d Info = Eigen::Matrix3d::Identity()*invSigma2;
         e->setInformation(Info);
 
@@ -267,14 +508,16 @@ int Optimizer::PoseOptimization(Frame *pFrame) {
         pFrame->mvbOutlier[i] = false;
 
         Eigen::Matrix<double, 2, 1> obs;
-        const cv::KeyPoint &kpUn = pFrame->mvKeysUn[i];
-        obs << kpUn.pt.x, kpUn.pt.y;
+        const float u = pFrame->mvKeysUn.x[i];
+        const float v = pFrame->mvKeysUn.y[i];
+        const int octave = pFrame->mvKeysUn.octave[i];
+        obs << u, v;
 
         g2o::EdgeSE3ProjectXYZOnlyPose* e = new g2o::EdgeSE3ProjectXYZOnlyPose();
 
         e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(0)));
         e->setMeasurement(obs);
-        const float invSigma2 = pFrame->mvInvLevelSigma2[kpUn.octave];
+        const float invSigma2 = pFrame->mvInvLevelSigma2[octave];
         e->setInformation(Eigen::Matrix2d::Identity()*invSigma2);
 
         g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
@@ -300,15 +543,17 @@ int Optimizer::PoseOptimization(Frame *pFrame) {
 
         //SET EDGE
         Eigen::Matrix<double, 3, 1> obs;
-        const cv::KeyPoint &kpUn = pFrame->mvKeysUn[i];
+        const float u = pFrame->mvKeysUn.x[i];
+        const float v = pFrame->mvKeysUn.y[i];
+        const int octave = pFrame->mvKeysUn.octave[i];
         const float &kp_ur = pFrame->mvuRight[i];
-        obs << kpUn.pt.x, kpUn.pt.y, kp_ur;
+        obs << u, v, kp_ur;
 
         g2o::EdgeStereoSE3ProjectXYZOnlyPose* e = new g2o::EdgeStereoSE3ProjectXYZOnlyPose();
 
         e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(0)));
         e->setMeasurement(obs);
-        const float invSigma2 = pFrame->mvInvLevelSigma2[kpUn.octave];
+        const float invSigma2 = pFrame->mvInvLevelSigma2[octave];
         Eigen::Matrix3d Info = Eigen::Matrix3d::Identity()*invSigma2;
         e->setInformation(Info);
 
@@ -414,7 +659,14 @@ int Optimizer::PoseOptimization(Frame *pFrame) {
   return nInitialCorrespondences-nBad;
 }
 
-void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap) {
+void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap, LocalBAProblem *pProblem) {
+  Timer budgetTimer(true);
+  const double budget = pProblem ? Config::LocalBABudget() : 0.0;
+  const size_t nWindow = std::max(Config::LocalBAWindow(), 0);
+  size_t nMaxLocalKFs = nWindow;
+  if (budget > 0 && pProblem->mnMaxLocalKFs > 0 && (nWindow == 0 || pProblem->mnMaxLocalKFs < nWindow))
+    nMaxLocalKFs = pProblem->mnMaxLocalKFs;
+
   // Local KeyFrames: First Breath Search from Current Keyframe
   list<KeyFrame*> lLocalKeyFrames;
 
@@ -423,6 +675,10 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
 
   const vector<KeyFrame*> vNeighKFs = pKF->GetVectorCovisibleKeyFrames();
   for (int i = 0, iend=vNeighKFs.size(); i < iend; i++) {
+    // Keep the most covisible ones if window is limited, the rest will be fixed
+    if (nMaxLocalKFs > 0 && lLocalKeyFrames.size() >= nMaxLocalKFs)
+      break;
+
     KeyFrame* pKFi = vNeighKFs[i];
     pKFi->mnBALocalForKF = pKF->mnId;
     if (!pKFi->isBad())
@@ -446,19 +702,77 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
 
   // Fixed Keyframes. Keyframes that see Local MapPoints but that are not Local Keyframes
   list<KeyFrame*> lFixedCameras;
-  for (list<MapPoint*>::iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++) {
-    map<KeyFrame*, size_t> observations = (*lit)->GetObservations();
-    for (map<KeyFrame*, size_t>::iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
-      KeyFrame* pKFi = mit->first;
+  if (nWindow == 0) {
+    for (list<MapPoint*>::iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++) {
+      map<KeyFrame*, size_t> observations = (*lit)->GetObservations();
+      for (map<KeyFrame*, size_t>::iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
+        KeyFrame* pKFi = mit->first;
+
+        if (pKFi->mnBALocalForKF!=pKF->mnId && pKFi->mnBAFixedForKF!=pKF->mnId) {
+          pKFi->mnBAFixedForKF=pKF->mnId;
+          if (!pKFi->isBad())
+            lFixedCameras.push_back(pKFi);
+        }
+      }
+    }
+  } else {
+    // Bounded window: keep the ones sharing more points, skipping observations already
+    // marginalized into point priors
+    map<KeyFrame*, int> fixedCounter;
+    for (list<MapPoint*>::iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++) {
+      const vector<unsigned long> *pvMarginalized = NULL;
+      if (pProblem) {
+        map<unsigned long, LocalBAProblem::MapPointEntry>::const_iterator mit = pProblem->mMPs.find((*lit)->mnId);
+        if (mit != pProblem->mMPs.end() && !mit->second.marginalized.empty())
+          pvMarginalized = &mit->second.marginalized;
+      }
 
-      if (pKFi->mnBALocalForKF!=pKF->mnId && pKFi->mnBAFixedForKF!=pKF->mnId) {
-        pKFi->mnBAFixedForKF=pKF->mnId;
-        if (!pKFi->isBad())
-          lFixedCameras.push_back(pKFi);
+      map<KeyFrame*, size_t> observations = (*lit)->GetObservations();
+      for (map<KeyFrame*, size_t>::iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
+        KeyFrame* pKFi = mit->first;
+        if (pKFi->mnBALocalForKF == pKF->mnId || pKFi->isBad())
+          continue;
+        if (pvMarginalized && std::find(pvMarginalized->begin(), pvMarginalized->end(), pKFi->mnId) != pvMarginalized->end())
+          continue;
+        fixedCounter[pKFi]++;
       }
     }
+
+    vector<std::pair<int, KeyFrame*> > vPairs;
+    vPairs.reserve(fixedCounter.size());
+    for (map<KeyFrame*, int>::iterator mit=fixedCounter.begin(), mend=fixedCounter.end(); mit != mend; mit++)
+      vPairs.push_back(std::make_pair(mit->second, mit->first));
+
+    // Sort by shared points, then by id to be independent of pointer order
+    std::sort(vPairs.begin(), vPairs.end(), [](const std::pair<int, KeyFrame*> &a, const std::pair<int, KeyFrame*> &b) {
+      return a.first > b.first || (a.first == b.first && a.second->mnId < b.second->mnId);
+    });
+
+    for (size_t i = 0; i < vPairs.size() && i < nWindow; i++) {
+      KeyFrame* pKFi = vPairs[i].second;
+      pKFi->mnBAFixedForKF = pKF->mnId;
+      lFixedCameras.push_back(pKFi);
+    }
+  }
+
+  if (Config::LocalBAEngine() == 1) {
+    budgetTimer.Stop();
+    double remaining = budget > 0 ? std::max(budget - budgetTimer.GetMsTime(), 1e-3) : 0.0;
+    LocalBundleAdjustmentSchur(pKF, lLocalKeyFrames, lFixedCameras, lLocalMapPoints, pbStopFlag, pMap, pProblem, remaining);
+
+    if (budget > 0) {
+      budgetTimer.Stop();
+      pProblem->UpdateBudget(budgetTimer.GetMsTime(), budget, lLocalKeyFrames.size());
+    }
+    return;
   }
 
+  // Only the Schur solver keeps the problem, drop reported changes it would miss
+  if (pProblem)
+    pProblem->Clear();
+
+  Timer total(true);
+
   // Setup optimizer
   g2o::SparseOptimizer optimizer;
   g2o::BlockSolver_6_3::LinearSolverType * linearSolver;
@@ -469,9 +783,17 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
 
   g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
   optimizer.setAlgorithm(solver);
-
-  if (pbStopFlag)
+  optimizer.setNumThreads(Config::OptimizerThreads());
+
+  // With a budget, iterations also stop when time is over
+  bool bStop = false;
+  BudgetStopAction budgetAction(&budgetTimer, budget, pbStopFlag, &bStop);
+  if (budget > 0) {
+    optimizer.addComputeErrorAction(&budgetAction);
+    optimizer.setForceStopFlag(&bStop);
+  } else if (pbStopFlag) {
     optimizer.setForceStopFlag(pbStopFlag);
+  }
 
   unsigned long maxKFid = 0;
 
@@ -538,20 +860,26 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     for (map<KeyFrame*, size_t>::const_iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
       KeyFrame* pKFi = mit->first;
 
+      // Keyframes out of a bounded window are not in the problem
+      if (pKFi->mnBALocalForKF != pKF->mnId && pKFi->mnBAFixedForKF != pKF->mnId)
+        continue;
+
       if (!pKFi->isBad()) {
-        const cv::KeyPoint &kpUn = pKFi->mvKeysUn[mit->second];
+        const float u = pKFi->mvKeysUn.x[mit->second];
+        const float v = pKFi->mvKeysUn.y[mit->second];
+        const int octave = pKFi->mvKeysUn.octave[mit->second];
 
         // Monocular observation
         if (pKFi->mvuRight[mit->second] < 0) {
           Eigen::Matrix<double, 2, 1> obs;
-          obs << kpUn.pt.x, kpUn.pt.y;
+          obs << u, v;
 
           g2o::EdgeSE3ProjectXYZ* e = new g2o::EdgeSE3ProjectXYZ();
 
           e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id)));
           e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKFi->mnId)));
           e->setMeasurement(obs);
-          const float &invSigma2 = pKFi->mvInvLevelSigma2[kpUn.octave];
+          const float &invSigma2 = pKFi->mvInvLevelSigma2[octave];
           e->setInformation(Eigen::Matrix2d::Identity()*invSigma2);
 
           g2o::RobustKernelHuber* rk = new g2o::RobustKernelHuber;
@@ -571,14 +899,14 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
         {
           Eigen::Matrix<double, 3, 1> obs;
           const float kp_ur = pKFi->mvuRight[mit->second];
-          obs << kpUn.pt.x, kpUn.pt.y, kp_ur;
+          obs << u, v, kp_ur;
 
           g2o::EdgeStereoSE3ProjectXYZ* e = new g2o::EdgeStereoSE3ProjectXYZ();
 
           e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id)));
           e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKFi->mnId)));
           e->setMeasurement(obs);
-          const float &invSigma2 = pKFi->mvInvLevelSigma2[kpUn.octave];
+          const float &invSigma2 = pKFi->mvInvLevelSigma2[octave];
           Eigen::Matrix3d Info = Eigen::Matrix3d::Identity()*invSigma2;
           e->setInformation(Info);
 
@@ -614,6 +942,9 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     if (*pbStopFlag)
       bDoMore = false;
 
+  if (bStop)
+    bDoMore = false;
+
   if (bDoMore) {
 
   // Check inlier observations
@@ -652,6 +983,10 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
 
   }
 
+  // Interrupted optimizations may have cached the errors of a rejected step
+  if (bStop)
+    optimizer.computeActiveErrors();
+
   vector<std::pair<KeyFrame*,MapPoint*> > vToErase;
   vToErase.reserve(vpEdgesMono.size()+vpEdgesStereo.size());
 
@@ -682,6 +1017,11 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     }
   }
 
+  total.Stop();
+  LOGD("Local BA time is %.2fms (%d keyframes, %d points, %d observations)", total.GetMsTime(),
+       static_cast<int>(lLocalKeyFrames.size()+lFixedCameras.size()), static_cast<int>(lLocalMapPoints.size()),
+       static_cast<int>(vpEdgesMono.size()+vpEdgesStereo.size()));
+
   // Get Map Mutex
   unique_lock<mutex> lock(pMap->mMutexMapUpdate);
 
@@ -711,23 +1051,386 @@ void Optimizer::LocalBundleAdjustment(KeyFrame *pKF, bool* pbStopFlag, Map* pMap
     pMP->SetWorldPos(vPoint->estimate());
     pMP->UpdateNormalAndDepth();
   }
+
+  if (budget > 0) {
+    budgetTimer.Stop();
+    pProblem->UpdateBudget(budgetTimer.GetMsTime(), budget, lLocalKeyFrames.size());
+  }
 }
 
+void Optimizer::LocalBundleAdjustmentSchur(KeyFrame *pKF, const list<KeyFrame*> &lLocalKeyFrames,
+                                           const list<KeyFrame*> &lFixedCameras, const list<MapPoint*> &lLocalMapPoints,
+                                           bool* pbStopFlag, Map* pMap, LocalBAProblem *pProblem, double budget) {
+  Timer total(true);
+  Timer budgetTimer(true);
+
+  LocalBAProblem localProblem;
+  LocalBAProblem &problem = pProblem ? *pProblem : localProblem;
+  BundleAdjuster &ba = problem.mBA;
+  const bool bMarginalize = pProblem && Config::LocalBAWindow() > 0;
+
+  typedef map<unsigned long, LocalBAProblem::KeyFrameEntry>::iterator KFIterator;
+  typedef map<unsigned long, LocalBAProblem::MapPointEntry>::iterator MPIterator;
+
+  // Window keyframes by id, and whether they are local
+  map<unsigned long, std::pair<KeyFrame*, bool> > mWindow;
+  for (list<KeyFrame*>::const_iterator lit=lLocalKeyFrames.begin(), lend=lLocalKeyFrames.end(); lit!=lend; lit++)
+    mWindow[(*lit)->mnId] = std::make_pair(*lit, true);
+  for (list<KeyFrame*>::const_iterator lit=lFixedCameras.begin(), lend=lFixedCameras.end(); lit!=lend; lit++)
+    mWindow[(*lit)->mnId] = std::make_pair(*lit, false);
+
+  // Points to update: the reported ones and the ones of keyframes entering, leaving or
+  // changing role in the window
+  map<unsigned long, MapPoint*> mCandidates;
+  mCandidates.swap(problem.mChangedMPs);
+
+  auto addCandidates = [&](KeyFrame* pKFi) {
+    const vector<MapPoint*> vpMPs = pKFi->GetMapPointMatches();
+    for (size_t i = 0; i < vpMPs.size(); i++) {
+      if (vpMPs[i])
+        mCandidates[vpMPs[i]->mnId] = vpMPs[i];
+    }
+  };
+
+  // Remove a point from the keyframes in its prior
+  auto unlinkPrior = [&](const unsigned long nMPId, LocalBAProblem::MapPointEntry &mpe) {
+    for (size_t i = 0; i < mpe.marginalized.size(); i++) {
+      map<unsigned long, vector<unsigned long> >::iterator mit = problem.mMarginalizedKFs.find(mpe.marginalized[i]);
+      if (mit == problem.mMarginalizedKFs.end())
+        continue;
+      vector<unsigned long> &vPoints = mit->second;
+      vPoints.erase(std::remove(vPoints.begin(), vPoints.end(), nMPId), vPoints.end());
+      if (vPoints.empty())
+        problem.mMarginalizedKFs.erase(mit);
+    }
+    mpe.marginalized.clear();
+  };
+
+  auto removePoint = [&](MPIterator pit) {
+    LocalBAProblem::MapPointEntry &mpe = pit->second;
+    for (map<unsigned long, int>::const_iterator oit=mpe.obs.begin(), oend=mpe.obs.end(); oit!=oend; oit++) {
+      ba.RemoveObservation(oit->second);
+      problem.mKFs[oit->first].obs.erase(pit->first);
+    }
+    unlinkPrior(pit->first, mpe);
+    ba.RemovePoint(mpe.point);
+    problem.mMPs.erase(pit);
+  };
+
+  // Keyframes that become local
+  vector<unsigned long> vEntering;
+
+  // Keyframes leaving the window or changing role
+  for (KFIterator it=problem.mKFs.begin(); it!=problem.mKFs.end();) {
+    LocalBAProblem::KeyFrameEntry &kfe = it->second;
+    map<unsigned long, std::pair<KeyFrame*, bool> >::const_iterator wit = mWindow.find(it->first);
+    const bool bIn = wit != mWindow.end() && !kfe.pKF->isBad();
+    const bool bLocal = bIn && wit->second.second;
+    if (bIn && bLocal == kfe.local) {
+      it++;
+      continue;
+    }
+
+    // Their points may enter or leave the window too
+    for (map<unsigned long, int>::const_iterator oit=kfe.obs.begin(), oend=kfe.obs.end(); oit!=oend; oit++)
+      mCandidates[oit->first] = problem.mMPs[oit->first].pMP;
+    if (!kfe.pKF->isBad())
+      addCandidates(kfe.pKF);
+    if (bLocal)
+      vEntering.push_back(it->first);
+
+    // With a bounded window, keyframes that stop being local are marginalized into priors
+    // of the points they observe and their observations are not used again
+    const bool bMarginalized = bMarginalize && kfe.local && !bLocal && !kfe.pKF->isBad();
+    if (bMarginalized)
+      ba.MarginalizeCamera(kfe.camera);
+
+    if (bMarginalized || !bIn) {
+      for (map<unsigned long, int>::const_iterator oit=kfe.obs.begin(), oend=kfe.obs.end(); oit!=oend; oit++) {
+        LocalBAProblem::MapPointEntry &mpe = problem.mMPs[oit->first];
+        if (bMarginalized && ba.IsActive(oit->second)) {
+          mpe.marginalized.push_back(it->first);
+          problem.mMarginalizedKFs[it->first].push_back(oit->first);
+        }
+        ba.RemoveObservation(oit->second);
+        mpe.obs.erase(it->first);
+      }
+      kfe.obs.clear();
+    }
+
+    if (bIn) {
+      kfe.local = bLocal;
+      it++;
+    } else {
+      ba.RemoveCamera(kfe.camera);
+      problem.mKFs.erase(it++);
+    }
+  }
+
+  // Add keyframes entering the window and refresh the poses of the other ones
+  for (map<unsigned long, std::pair<KeyFrame*, bool> >::const_iterator wit=mWindow.begin(), wend=mWindow.end(); wit!=wend; wit++) {
+    KeyFrame* pKFi = wit->second.first;
+    const bool bLocal = wit->second.second;
+    const bool bFixed = !bLocal || pKFi->mnId == 0;
+
+    KFIterator it = problem.mKFs.find(wit->first);
+    if (it != problem.mKFs.end()) {
+      ba.SetCamera(it->second.camera, pKFi->GetPose(), bFixed);
+      continue;
+    }
+
+    LocalBAProblem::KeyFrameEntry &kfe = problem.mKFs[wit->first];
+    kfe.pKF = pKFi;
+    kfe.camera = ba.AddCamera(pKFi->GetPose(), bFixed);
+    kfe.local = bLocal;
+    addCandidates(pKFi);
+    if (bLocal)
+      vEntering.push_back(wit->first);
+  }
+
+  // A marginalized keyframe back in the window would count twice, drop the priors it is in.
+  // Other keyframes in those priors are used again as fixed ones
+  for (size_t i = 0; i < vEntering.size(); i++) {
+    map<unsigned long, vector<unsigned long> >::iterator mit = problem.mMarginalizedKFs.find(vEntering[i]);
+    if (mit == problem.mMarginalizedKFs.end())
+      continue;
+
+    const vector<unsigned long> vPoints = mit->second;
+    for (size_t j = 0; j < vPoints.size(); j++) {
+      MPIterator pit = problem.mMPs.find(vPoints[j]);
+      if (pit == problem.mMPs.end())
+        continue;
+
+      unlinkPrior(pit->first, pit->second);
+      ba.ClearPointPrior(pit->second.point);
+      mCandidates[pit->first] = pit->second.pMP;
+    }
+  }
+
+  // Add, remove or update candidate points and their observations in window keyframes
+  auto updatePoints = [&](const map<unsigned long, MapPoint*> &mPoints) {
+    for (map<unsigned long, MapPoint*>::const_iterator cit=mPoints.begin(), cend=mPoints.end(); cit!=cend; cit++) {
+      MapPoint* pMP = cit->second;
+      MPIterator pit = problem.mMPs.find(cit->first);
+      if (pMP->isBad() || pMP->mnBALocalForKF != pKF->mnId) {
+        if (pit != problem.mMPs.end())
+          removePoint(pit);
+        continue;
+      }
+
+      if (pit == problem.mMPs.end()) {
+        LocalBAProblem::MapPointEntry &mpe = problem.mMPs[cit->first];
+        mpe.pMP = pMP;
+        mpe.point = ba.AddPoint(pMP->GetWorldPos());
+        pit = problem.mMPs.find(cit->first);
+      }
+      LocalBAProblem::MapPointEntry &mpe = pit->second;
+
+      // Observations in window keyframes by keyframe id, without the ones in the prior
+      map<unsigned long, std::pair<KeyFrame*, size_t> > mObs;
+      const map<KeyFrame*, size_t> observations = pMP->GetObservations();
+      for (map<KeyFrame*, size_t>::const_iterator mit=observations.begin(), mend=observations.end(); mit != mend; mit++) {
+        KeyFrame* pKFi = mit->first;
+        if (pKFi->isBad() || !problem.mKFs.count(pKFi->mnId))
+          continue;
+        if (std::find(mpe.marginalized.begin(), mpe.marginalized.end(), pKFi->mnId) != mpe.marginalized.end())
+          continue;
+        mObs[pKFi->mnId] = std::make_pair(pKFi, mit->second);
+      }
+
+      // Observations erased from the map
+      for (map<unsigned long, int>::iterator oit=mpe.obs.begin(); oit!=mpe.obs.end();) {
+        if (mObs.count(oit->first)) {
+          oit++;
+          continue;
+        }
+        ba.RemoveObservation(oit->second);
+        problem.mKFs[oit->first].obs.erase(cit->first);
+        mpe.obs.erase(oit++);
+      }
+
+      for (map<unsigned long, std::pair<KeyFrame*, size_t> >::const_iterator mit=mObs.begin(), mend=mObs.end(); mit != mend; mit++) {
+        KeyFrame* pKFi = mit->second.first;
+        const size_t idx = mit->second.second;
+        const float u = pKFi->mvKeysUn.x[idx];
+        const float v = pKFi->mvKeysUn.y[idx];
+        const int octave = pKFi->mvKeysUn.octave[idx];
+        const float &invSigma2 = pKFi->mvInvLevelSigma2[octave];
+
+        map<unsigned long, int>::const_iterator oit = mpe.obs.find(mit->first);
+        if (oit != mpe.obs.end()) {
+          ba.SetObservation(oit->second, u, v, pKFi->mvuRight[idx], invSigma2,
+                            pKFi->fx, pKFi->fy, pKFi->cx, pKFi->cy, pKFi->mbf);
+          continue;
+        }
+
+        LocalBAProblem::KeyFrameEntry &kfe = problem.mKFs[mit->first];
+        const int obs = ba.AddObservation(kfe.camera, mpe.point, u, v, pKFi->mvuRight[idx], invSigma2,
+                                          pKFi->fx, pKFi->fy, pKFi->cx, pKFi->cy, pKFi->mbf);
+        mpe.obs[mit->first] = obs;
+        kfe.obs[cit->first] = obs;
+      }
+    }
+  };
+
+  updatePoints(mCandidates);
+
+  // Changes not reported (map modified outside local mapping), update all points
+  if (problem.mMPs.size() != lLocalMapPoints.size()) {
+    LOGD("Local BA problem has %d points instead of %d, updating all of them",
+         static_cast<int>(problem.mMPs.size()), static_cast<int>(lLocalMapPoints.size()));
+    map<unsigned long, MapPoint*> mAll;
+    for (MPIterator pit=problem.mMPs.begin(), pend=problem.mMPs.end(); pit!=pend; pit++)
+      mAll[pit->first] = pit->second.pMP;
+    for (list<MapPoint*>::const_iterator lit=lLocalMapPoints.begin(), lend=lLocalMapPoints.end(); lit!=lend; lit++)
+      mAll[(*lit)->mnId] = *lit;
+    updatePoints(mAll);
+    mCandidates.swap(mAll);
+  }
+
+  // Estimates may have been moved since last call (global BA, loop correction)
+  for (MPIterator pit=problem.mMPs.begin(), pend=problem.mMPs.end(); pit!=pend; pit++)
+    ba.SetPoint(pit->second.point, pit->second.pMP->GetWorldPos());
+
+  // Outliers excluded in last call and not erased from the map are used again
+  ba.EnableObservations();
+
+  total.Stop();
+  double setupTime = total.GetMsTime();
+  problem.mdSetupTime = setupTime;
+  total.Start();
+
+  if (pbStopFlag)
+    if (*pbStopFlag)
+      return;
+
+  // Remaining budget, estimates are kept when time is over
+  double remaining = 0.0;
+  if (budget > 0) {
+    budgetTimer.Stop();
+    remaining = std::max(budget - budgetTimer.GetMsTime(), 1e-3);
+  }
+
+  ba.SetRobust(true);
+  ba.Optimize(5, pbStopFlag, remaining);
+
+  bool bDoMore = true;
+  if (pbStopFlag)
+    if (*pbStopFlag)
+      bDoMore = false;
+
+  if (budget > 0) {
+    budgetTimer.Stop();
+    remaining = budget - budgetTimer.GetMsTime();
+    if (remaining <= 0)
+      bDoMore = false;
+  }
+
+  if (bDoMore) {
+    // Optimize again without the outliers
+    ba.DisableOutliers();
+    ba.SetRobust(false);
+    ba.Optimize(10, pbStopFlag, remaining);
+  }
+
+  // Outliers are erased from the problem now and from the map below
+  vector<std::pair<KeyFrame*,MapPoint*> > vToErase;
+  for (MPIterator pit=problem.mMPs.begin(), pend=problem.mMPs.end(); pit!=pend; pit++) {
+    LocalBAProblem::MapPointEntry &mpe = pit->second;
+    if (mpe.pMP->isBad())
+      continue;
+
+    for (map<unsigned long, int>::iterator oit=mpe.obs.begin(); oit!=mpe.obs.end();) {
+      if (!ba.IsOutlier(oit->second)) {
+        oit++;
+        continue;
+      }
+
+      LocalBAProblem::KeyFrameEntry &kfe = problem.mKFs[oit->first];
+      vToErase.push_back(std::make_pair(kfe.pKF, mpe.pMP));
+      ba.RemoveObservation(oit->second);
+      kfe.obs.erase(pit->first);
+      mpe.obs.erase(oit++);
+    }
+  }
+
+  total.Stop();
+  LOGD("Local BA (Schur) time is %.2fms + %.2fms setup (%d keyframes, %d points, %d observations, %d points updated)",
+       total.GetMsTime(), setupTime, ba.NumCameras(), ba.NumPoints(), ba.NumObservations(),
+       static_cast<int>(mCandidates.size()));
+
+  // Get Map Mutex
+  unique_lock<mutex> lock(pMap->mMutexMapUpdate);
+
+  for (size_t i = 0; i < vToErase.size(); i++) {
+    KeyFrame* pKFi = vToErase[i].first;
+    MapPoint* pMPi = vToErase[i].second;
+    pKFi->EraseMapPointMatch(pMPi);
+    pMPi->EraseObservation(pKFi);
+
+    // It may leave the window or be removed
+    problem.MapPointChanged(pMPi);
+  }
+
+  // Recover optimized data
+  for (list<KeyFrame*>::const_iterator lit=lLocalKeyFrames.begin(), lend=lLocalKeyFrames.end(); lit!=lend; lit++) {
+    KeyFrame* pKFi = *lit;
+    pKFi->SetPose(ba.GetCameraPose(problem.mKFs[pKFi->mnId].camera));
+  }
+
+  for (MPIterator pit=problem.mMPs.begin(), pend=problem.mMPs.end(); pit!=pend; pit++) {
+    MapPoint* pMP = pit->second.pMP;
+    pMP->SetWorldPos(ba.GetPoint(pit->second.point));
+    pMP->UpdateNormalAndDepth();
+  }
+}
 
 void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* pCurKF,
                      const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
                      const LoopClosing::KeyFrameAndPose &CorrectedSim3,
-                     const map<KeyFrame *, set<KeyFrame *> > &LoopConnections, const bool &bFixScale) {
-  // Setup optimizer
+                     const map<KeyFrame *, set<KeyFrame *> > &LoopConnections, const bool &bFixScale,
+                     PoseGraphSolver *pSolver) {
+  Timer total(true);
+
+  // Dedicated solver, reusing the elimination order of the last loop if given
+  const bool bOwnSolver = Config::EssentialGraphEngine() == 1;
+  PoseGraphSolver localSolver;
+  PoseGraphSolver &poseGraph = pSolver ? *pSolver : localSolver;
+  if (bOwnSolver) {
+    poseGraph.Clear();
+    poseGraph.SetFixScale(bFixScale);
+    poseGraph.SetNumThreads(Config::OptimizerThreads());
+  }
+
+  // Setup optimizer, only needed without a dedicated solver
   g2o::SparseOptimizer optimizer;
-  optimizer.setVerbose(false);
-  g2o::BlockSolver_7_3::LinearSolverType * linearSolver =
-       new g2o::LinearSolverEigen<g2o::BlockSolver_7_3::PoseMatrixType>();
-  g2o::BlockSolver_7_3 * solver_ptr= new g2o::BlockSolver_7_3(linearSolver);
-  g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+  if (!bOwnSolver) {
+    optimizer.setVerbose(false);
+    g2o::BlockSolver_7_3::LinearSolverType * linearSolver =
+         new g2o::LinearSolverEigen<g2o::BlockSolver_7_3::PoseMatrixType>();
+    g2o::BlockSolver_7_3 * solver_ptr= new g2o::BlockSolver_7_3(linearSolver);
+    g2o::OptimizationAlgorithmLevenberg* solver = new g2o::OptimizationAlgorithmLevenberg(solver_ptr);
+
+    solver->setUserLambdaInit(1e-16);
+    optimizer.setAlgorithm(solver);
+    optimizer.setNumThreads(Config::OptimizerThreads());
+  }
 
-  solver->setUserLambdaInit(1e-16);
-  optimizer.setAlgorithm(solver);
+  const Eigen::Matrix<double, 7, 7> matLambda = Eigen::Matrix<double, 7, 7>::Identity();
+
+  auto addEdge = [&](unsigned long nIDi, unsigned long nIDj, const g2o::Sim3 &Sji) {
+    if (bOwnSolver) {
+      poseGraph.AddEdge(nIDi, nIDj, Sji);
+      return;
+    }
+
+    g2o::EdgeSim3* e = new g2o::EdgeSim3();
+    e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDj)));
+    e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
+    e->setMeasurement(Sji);
+    e->information() = matLambda;
+    optimizer.addEdge(e);
+  };
 
   const vector<KeyFrame*> vpKFs = pMap->GetAllKeyFrames();
   const vector<MapPoint*> vpMPs = pMap->GetAllMapPoints();
@@ -745,7 +1448,6 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
     KeyFrame* pKF = vpKFs[i];
     if (pKF->isBad())
       continue;
-    g2o::VertexSim3Expmap* VSim3 = new g2o::VertexSim3Expmap();
 
     const int nIDi = pKF->mnId;
 
@@ -753,15 +1455,21 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
 
     if (it!=CorrectedSim3.end()) {
       vScw[nIDi] = it->second;
-      VSim3->setEstimate(it->second);
     } else {
       Eigen::Matrix<double, 3, 3> Rcw = pKF->GetRotation();
       Eigen::Matrix<double, 3, 1> tcw = pKF->GetTranslation();
       g2o::Sim3 Siw(Rcw, tcw, 1.0);
       vScw[nIDi] = Siw;
-      VSim3->setEstimate(Siw);
     }
 
+    if (bOwnSolver) {
+      poseGraph.AddVertex(nIDi, vScw[nIDi], pKF==pLoopKF);
+      continue;
+    }
+
+    g2o::VertexSim3Expmap* VSim3 = new g2o::VertexSim3Expmap();
+    VSim3->setEstimate(vScw[nIDi]);
+
     if (pKF==pLoopKF)
       VSim3->setFixed(true);
 
@@ -777,8 +1485,6 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
 
   set<std::pair<long unsigned int,long unsigned int> > sInsertedEdges;
 
-  const Eigen::Matrix<double, 7, 7> matLambda = Eigen::Matrix<double, 7, 7>::Identity();
-
   // Set Loop edges
   for (map<KeyFrame *, set<KeyFrame *> >::const_iterator mit = LoopConnections.begin(), mend=LoopConnections.end(); mit != mend; mit++) {
     KeyFrame* pKF = mit->first;
@@ -795,14 +1501,7 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
       const g2o::Sim3 Sjw = vScw[nIDj];
       const g2o::Sim3 Sji = Sjw * Swi;
 
-      g2o::EdgeSim3* e = new g2o::EdgeSim3();
-      e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDj)));
-      e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-      e->setMeasurement(Sji);
-
-      e->information() = matLambda;
-
-      optimizer.addEdge(e);
+      addEdge(nIDi, nIDj, Sji);
 
       sInsertedEdges.insert(std::make_pair(std::min(nIDi,nIDj), std::max(nIDi,nIDj)));
     }
@@ -840,13 +1539,7 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
 
       g2o::Sim3 Sji = Sjw * Swi;
 
-      g2o::EdgeSim3* e = new g2o::EdgeSim3();
-      e->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDj)));
-      e->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-      e->setMeasurement(Sji);
-
-      e->information() = matLambda;
-      optimizer.addEdge(e);
+      addEdge(nIDi, nIDj, Sji);
     }
 
     // Loop edges
@@ -864,12 +1557,7 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
           Slw = vScw[pLKF->mnId];
 
         g2o::Sim3 Sli = Slw * Swi;
-        g2o::EdgeSim3* el = new g2o::EdgeSim3();
-        el->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pLKF->mnId)));
-        el->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-        el->setMeasurement(Sli);
-        el->information() = matLambda;
-        optimizer.addEdge(el);
+        addEdge(nIDi, pLKF->mnId, Sli);
       }
     }
 
@@ -892,21 +1580,22 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
             Snw = vScw[pKFn->mnId];
 
           g2o::Sim3 Sni = Snw * Swi;
-
-          g2o::EdgeSim3* en = new g2o::EdgeSim3();
-          en->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(pKFn->mnId)));
-          en->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(nIDi)));
-          en->setMeasurement(Sni);
-          en->information() = matLambda;
-          optimizer.addEdge(en);
+          addEdge(nIDi, pKFn->mnId, Sni);
         }
       }
     }
   }
 
   // Optimize!
-  optimizer.initializeOptimization();
-  optimizer.optimize(20);
+  if (bOwnSolver) {
+    poseGraph.Optimize(20, 1e-16);
+  } else {
+    optimizer.initializeOptimization();
+    optimizer.optimize(20);
+  }
+
+  total.Stop();
+  LOGD("Essential graph time is %.2fms", total.GetMsTime());
 
   unique_lock<mutex> lock(pMap->mMutexMapUpdate);
 
@@ -916,8 +1605,11 @@ void Optimizer::OptimizeEssentialGraph(Map* pMap, KeyFrame* pLoopKF, KeyFrame* p
 
     const int nIDi = pKFi->mnId;
 
-    g2o::VertexSim3Expmap* VSim3 = static_cast<g2o::VertexSim3Expmap*>(optimizer.vertex(nIDi));
-    g2o::Sim3 CorrectedSiw =  VSim3->estimate();
+    g2o::Sim3 CorrectedSiw;
+    if (bOwnSolver)
+      CorrectedSiw = poseGraph.GetVertex(nIDi);
+    else
+      CorrectedSiw = static_cast<g2o::VertexSim3Expmap*>(optimizer.vertex(nIDi))->estimate();
     vCorrectedSwc[nIDi]=CorrectedSiw.inverse();
     Eigen::Matrix3d eigR = CorrectedSiw.rotation().toRotationMatrix();
     Eigen::Vector3d eigt = CorrectedSiw.translation();
@@ -1045,14 +1737,16 @@ int Optimizer::OptimizeSim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &
 
     // Set edge x1 = S12*X2
     Eigen::Matrix<double, 2, 1> obs1;
-    const cv::KeyPoint &kpUn1 = pKF1->mvKeysUn[i];
-    obs1 << kpUn1.pt.x, kpUn1.pt.y;
+    const float u1 = pKF1->mvKeysUn.x[i];
+    const float v1 = pKF1->mvKeysUn.y[i];
+    const int octave1 = pKF1->mvKeysUn.octave[i];
+    obs1 << u1, v1;
 
     g2o::EdgeSim3ProjectXYZ* e12 = new g2o::EdgeSim3ProjectXYZ();
     e12->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id2)));
     e12->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(0)));
     e12->setMeasurement(obs1);
-    const float &invSigmaSquare1 = pKF1->mvInvLevelSigma2[kpUn1.octave];
+    const float &invSigmaSquare1 = pKF1->mvInvLevelSigma2[octave1];
     e12->setInformation(Eigen::Matrix2d::Identity()*invSigmaSquare1);
 
     g2o::RobustKernelHuber* rk1 = new g2o::RobustKernelHuber;
@@ -1062,15 +1756,17 @@ int Optimizer::OptimizeSim3(KeyFrame *pKF1, KeyFrame *pKF2, vector<MapPoint *> &
 
     // Set edge x2 = S21*X1
     Eigen::Matrix<double, 2, 1> obs2;
-    const cv::KeyPoint &kpUn2 = pKF2->mvKeysUn[i2];
-    obs2 << kpUn2.pt.x, kpUn2.pt.y;
+    const float u2 = pKF2->mvKeysUn.x[i2];
+    const float v2 = pKF2->mvKeysUn.y[i2];
+    const int octave2 = pKF2->mvKeysUn.octave[i2];
+    obs2 << u2, v2;
 
     g2o::EdgeInverseSim3ProjectXYZ* e21 = new g2o::EdgeInverseSim3ProjectXYZ();
 
     e21->setVertex(0, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(id1)));
     e21->setVertex(1, dynamic_cast<g2o::OptimizableGraph::Vertex*>(optimizer.vertex(0)));
     e21->setMeasurement(obs2);
-    float invSigmaSquare2 = pKF2->mvInvLevelSigma2[kpUn2.octave];
+    float invSigmaSquare2 = pKF2->mvInvLevelSigma2[octave2];
     e21->setInformation(Eigen::Matrix2d::Identity()*invSigmaSquare2);
 
     g2o::RobustKernelHuber* rk2 = new g2o::RobustKernelHuber;
@@ -25,25 +25,93 @@
 #ifndef SD_SLAM_OPTIMIZER_H
 #define SD_SLAM_OPTIMIZER_H
 
+#include <list>
+#include <set>
 #include "Map.h"
 #include "MapPoint.h"
 #include "KeyFrame.h"
 #include "LoopClosing.h"
 #include "Frame.h"
+#include "BundleAdjuster.h"
+#include "PoseGraphSolver.h"
 #include "extra/g2o/types/types_seven_dof_expmap.h"
 
 namespace SD_SLAM {
 
 class LoopClosing;
 
+// Local BA problem kept between calls, so that only the changes of the window
+// are applied to it and its buffers are reused. Local mapping reports the points whose
+// observations changed, which are updated together with the points of keyframes
+// entering or leaving the window. Elements are kept by id, so the problem does not
+// depend on memory addresses. Also keeps the time budget state and, with a bounded
+// window, the keyframes marginalized into point priors
+struct LocalBAProblem {
+  LocalBAProblem() : mnMaxLocalKFs(0), mdBudgetUsage(0.0), mnBudgetCalls(0), mdSetupTime(0.0) {}
+
+  // Observations of the points of a keyframe changed (new or culled keyframe)
+  void KeyFrameChanged(KeyFrame *pKF);
+
+  // Observations of a point changed (new, fused or culled point)
+  inline void MapPointChanged(MapPoint *pMP) { mChangedMPs[pMP->mnId] = pMP; }
+
+  // Adapt window size to the time used in last call and report budget usage
+  void UpdateBudget(double time, double budget, size_t nLocalKFs);
+
+  void Clear() {
+    mBA.Clear();
+    mKFs.clear();
+    mMPs.clear();
+    mChangedMPs.clear();
+    mMarginalizedKFs.clear();
+  }
+
+  struct KeyFrameEntry {
+    KeyFrame* pKF;
+    int camera;
+    bool local;                         // Local or fixed keyframe
+    std::map<unsigned long, int> obs;   // Observation of each point id
+  };
+
+  struct MapPointEntry {
+    MapPoint* pMP;
+    int point;
+    std::map<unsigned long, int> obs;         // Observation of each keyframe id
+    std::vector<unsigned long> marginalized;  // Keyframes in the point prior
+  };
+
+  BundleAdjuster mBA;
+  std::map<unsigned long, KeyFrameEntry> mKFs;
+  std::map<unsigned long, MapPointEntry> mMPs;
+  std::map<unsigned long, MapPoint*> mChangedMPs;                         // Reported since last call
+  std::map<unsigned long, std::vector<unsigned long> > mMarginalizedKFs;  // Points with each keyframe in their prior
+
+  size_t mnMaxLocalKFs;   // Max local keyframes with a time budget (0 = no limit)
+  double mdBudgetUsage;   // Sum of used budget ratios
+  int mnBudgetCalls;
+  double mdSetupTime;     // Setup time of last call (ms)
+};
+
 class Optimizer {
  public:
   void static BundleAdjustment(const std::vector<KeyFrame*> &vpKF, const std::vector<MapPoint*> &vpMP,
                  int nIterations = 5, bool *pbStopFlag=NULL, const unsigned long nLoopKF = 0,
-                 const bool bRobust = true);
+                 const bool bRobust = true, const std::set<KeyFrame*> &sFixedKFs = std::set<KeyFrame*>());
   void static GlobalBundleAdjustemnt(Map* pMap, int nIterations=5, bool *pbStopFlag=NULL,
                      const unsigned long nLoopKF = 0, const bool bRobust = true);
-  void static LocalBundleAdjustment(KeyFrame* pKF, bool *pbStopFlag, Map *pMap);
+  // Global BA split in submaps of nSubmapKFs keyframes grown along the covisibility graph.
+  // Each step eliminates submap interiors in parallel onto the separator keyframes (the ones
+  // sharing points with other submaps) and recovers them by back substitution, so it is
+  // the same step as the flat problem
+  void static PartitionedBundleAdjustment(const std::vector<KeyFrame*> &vpKF, const std::vector<MapPoint*> &vpMP,
+                          int nSubmapKFs, int nIterations = 5, bool *pbStopFlag=NULL,
+                          const unsigned long nLoopKF = 0, const bool bRobust = true);
+  // BA of the nMaxKFs keyframes around both sides of a loop, keyframes observing their points
+  // are fixed. Results are stored as in GlobalBundleAdjustemnt, other keyframes keep their pose
+  void static LoopBundleAdjustment(Map* pMap, KeyFrame* pCurKF, KeyFrame* pLoopKF, int nMaxKFs,
+                   int nIterations=5, bool *pbStopFlag=NULL, const unsigned long nLoopKF = 0);
+  // pProblem keeps the problem between calls when using the Schur complement solver
+  void static LocalBundleAdjustment(KeyFrame* pKF, bool *pbStopFlag, Map *pMap, LocalBAProblem *pProblem = NULL);
   int static PoseOptimization(Frame* pFrame);
 
   // if bFixScale is true, 6DoF optimization (stereo, rgbd), 7DoF otherwise (mono)
@@ -51,11 +119,17 @@ class Optimizer {
                      const LoopClosing::KeyFrameAndPose &NonCorrectedSim3,
                      const LoopClosing::KeyFrameAndPose &CorrectedSim3,
                      const std::map<KeyFrame *, std::set<KeyFrame *> > &LoopConnections,
-                     const bool &bFixScale);
+                     const bool &bFixScale, PoseGraphSolver *pSolver = NULL);
 
   // if bFixScale is true, optimize SE3 (stereo, rgbd), Sim3 otherwise (mono)
   static int OptimizeSim3(KeyFrame* pKF1, KeyFrame* pKF2, std::vector<MapPoint *> &vpMatches1,
               g2o::Sim3 &g2oS12, const float th2, const bool bFixScale);
+
+ private:
+  // Local BA solved with BundleAdjuster instead of g2o
+  void static LocalBundleAdjustmentSchur(KeyFrame* pKF, const std::list<KeyFrame*> &lLocalKeyFrames,
+                     const std::list<KeyFrame*> &lFixedCameras, const std::list<MapPoint*> &lLocalMapPoints,
+                     bool *pbStopFlag, Map *pMap, LocalBAProblem *pProblem, double budget);
 };
 
 }  // namespace SD_SLAM
@@ -84,10 +84,8 @@ PnPsolver::PnPsolver(const Frame &F, const vector<MapPoint*> &vpMapPointMatches)
 
     if (pMP) {
       if (!pMP->isBad()) {
-        const cv::KeyPoint &kp = F.mvKeysUn[i];
-
-        mvP2D.push_back(kp.pt);
-        mvSigma2.push_back(F.mvLevelSigma2[kp.octave]);
+        mvP2D.push_back(F.mvKeysUn.pt(i));
+        mvSigma2.push_back(F.mvLevelSigma2[F.mvKeysUn.octave[i]]);
 
         Eigen::Vector3d Pos = pMP->GetWorldPos();
         mvP3Dw.push_back(cv::Point3f(Pos(0), Pos(1), Pos(2)));
@@ -0,0 +1,442 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#include "PoseGraphSolver.h"
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <map>
+#include "extra/parallel_for.h"
+
+using std::vector;
+
+namespace SD_SLAM {
+
+namespace {
+
+// Levenberg-Marquardt parameters, same as g2o defaults
+const double kTau = 1e-5;
+const double kGoodStepLowerScale = 1./3.;
+const double kGoodStepUpperScale = 2./3.;
+const int kMaxTrialsAfterFailure = 10;
+
+// Numeric differentiation step, same as g2o::BaseBinaryEdge
+const double kDelta = 1e-9;
+
+// The last elimination order is reused while new vertices are at most this ratio
+const double kMaxNewVerticesRatio = 0.2;
+
+}  // namespace
+
+PoseGraphSolver::PoseGraphSolver() {
+  fix_scale_ = false;
+  threads_ = 1;
+  n_blocks_ = 0;
+}
+
+void PoseGraphSolver::Clear() {
+  ids_.clear();
+  vertices_.clear();
+  fixed_.clear();
+  indices_.clear();
+  edges_.clear();
+}
+
+void PoseGraphSolver::Reset() {
+  Clear();
+  order_.clear();
+  order_edges_.clear();
+}
+
+void PoseGraphSolver::AddVertex(unsigned long id, const g2o::Sim3 &Siw, bool fixed) {
+  indices_[id] = vertices_.size();
+  ids_.push_back(id);
+  vertices_.push_back(Siw);
+  fixed_.push_back(fixed);
+}
+
+void PoseGraphSolver::AddEdge(unsigned long id_i, unsigned long id_j, const g2o::Sim3 &Sji) {
+  Edge e;
+  e.i = indices_.at(id_i);
+  e.j = indices_.at(id_j);
+  e.Sji = Sji;
+  e.block = -1;
+  edges_.push_back(e);
+}
+
+const g2o::Sim3 &PoseGraphSolver::GetVertex(unsigned long id) const {
+  return vertices_[indices_.at(id)];
+}
+
+int PoseGraphSolver::Optimize(int iterations, double lambda_init) {
+  ComputeOrdering();
+  BuildStructure();
+
+  double lambda = 0.0;
+  int ni = 2;
+  int n_bad = 0;
+  int it = 0;
+
+  while (it < iterations) {
+    double current_chi2 = ComputeChi2();
+    double ini_chi2 = current_chi2;
+
+    BuildSystem();
+
+    if (it == 0) {
+      double max_diag = 0.0;
+      for (int i = 0; i < n_blocks_; i++)
+        max_diag = std::max(max_diag, Hdiag_[i].diagonal().cwiseAbs().maxCoeff());
+      lambda = lambda_init > 0 ? lambda_init : kTau*max_diag;
+      ni = 2;
+      n_bad = 0;
+    }
+    it++;
+
+    double rho = 0;
+    int trials = 0;
+    do {
+      vertices_backup_ = vertices_;
+
+      double temp_chi2 = std::numeric_limits<double>::max();
+      double scale = 0.0;
+      if (Solve(lambda)) {
+        scale = dx_.dot(lambda*dx_ + b_);
+        Update();
+        temp_chi2 = ComputeChi2();
+      }
+
+      rho = (current_chi2-temp_chi2)/(scale+1e-3);
+
+      if (rho > 0 && std::isfinite(temp_chi2)) {
+        // Good step, decrease damping
+        double alpha = 1.0-std::pow(2*rho-1, 3);
+        alpha = std::min(alpha, kGoodStepUpperScale);
+        lambda *= std::max(kGoodStepLowerScale, alpha);
+        ni = 2;
+        current_chi2 = temp_chi2;
+      } else {
+        // Bad step, restore estimates and increase damping
+        lambda *= ni;
+        ni *= 2;
+        vertices_.swap(vertices_backup_);
+      }
+      trials++;
+    } while (rho < 0 && trials < kMaxTrialsAfterFailure);
+
+    if (trials == kMaxTrialsAfterFailure || rho == 0)
+      break;
+
+    // Stop if chi2 does not decrease in several iterations
+    if ((ini_chi2-current_chi2)*1e3 < ini_chi2)
+      n_bad++;
+    else
+      n_bad = 0;
+
+    if (n_bad >= 3)
+      break;
+  }
+
+  return it;
+}
+
+g2o::Sim3 PoseGraphSolver::Plus(const g2o::Sim3 &S, const Vector7d &dx) const {
+  Vector7d update = dx;
+  if (fix_scale_)
+    update[6] = 0;
+  return g2o::Sim3(update)*S;
+}
+
+double PoseGraphSolver::ComputeChi2() {
+  chi2_.resize(edges_.size());
+  ParallelFor(0, edges_.size(), threads_, [&](int k) {
+    const Edge &e = edges_[k];
+    chi2_[k] = Error(e, vertices_[e.i], vertices_[e.j]).squaredNorm();
+  });
+
+  // Sum in edge order, results do not depend on the number of threads
+  double chi2 = 0.0;
+  for (size_t k = 0; k < chi2_.size(); k++)
+    chi2 += chi2_[k];
+  return chi2;
+}
+
+void PoseGraphSolver::ComputeOrdering() {
+  const int n = vertices_.size();
+  block_.assign(n, -1);
+
+  int n_free = 0;
+  for (int i = 0; i < n; i++) {
+    if (!fixed_[i])
+      n_free++;
+  }
+  n_blocks_ = n_free;
+
+  // Reuse last order for known vertices, new ones are eliminated last
+  int n_reused = 0;
+  for (size_t k = 0; k < order_.size(); k++) {
+    std::unordered_map<unsigned long, int>::const_iterator it = indices_.find(order_[k]);
+    if (it == indices_.end() || fixed_[it->second])
+      continue;
+    block_[it->second] = n_reused++;
+  }
+
+  // New edges between ordered vertices (loop closures) can cause heavy fill-in
+  bool new_edges = false;
+  for (size_t k = 0; k < edges_.size() && !new_edges; k++) {
+    const Edge &e = edges_[k];
+    if (block_[e.i] < 0 || block_[e.j] < 0 || e.i == e.j)
+      continue;
+    std::pair<unsigned long, unsigned long> key(std::min(ids_[e.i], ids_[e.j]), std::max(ids_[e.i], ids_[e.j]));
+    new_edges = order_edges_.count(key) == 0;
+  }
+
+  if (n_reused > 0 && !new_edges && n_free-n_reused <= kMaxNewVerticesRatio*n_free) {
+    int next = n_reused;
+    for (int i = 0; i < n; i++) {
+      if (!fixed_[i] && block_[i] < 0)
+        block_[i] = next++;
+    }
+  } else {
+    // Minimum degree ordering of the block pattern
+    vector<int> free_index(n, -1);
+    int next = 0;
+    for (int i = 0; i < n; i++) {
+      if (!fixed_[i])
+        free_index[i] = next++;
+    }
+
+    vector<Eigen::Triplet<double> > triplets;
+    triplets.reserve(n_free + 2*edges_.size());
+    for (int i = 0; i < n_free; i++)
+      triplets.push_back(Eigen::Triplet<double>(i, i, 1.0));
+    for (size_t k = 0; k < edges_.size(); k++) {
+      int a = free_index[edges_[k].i], b = free_index[edges_[k].j];
+      if (a < 0 || b < 0)
+        continue;
+      triplets.push_back(Eigen::Triplet<double>(a, b, 1.0));
+      triplets.push_back(Eigen::Triplet<double>(b, a, 1.0));
+    }
+
+    SparseMatrix pattern(n_free, n_free);
+    pattern.setFromTriplets(triplets.begin(), triplets.end());
+
+    // Returns the inverse permutation: block eliminated k-th
+    Eigen::PermutationMatrix<Eigen::Dynamic, Eigen::Dynamic, int> pinv;
+    Eigen::AMDOrdering<int> amd;
+    amd(pattern, pinv);
+
+    vector<int> free_vertices;
+    free_vertices.reserve(n_free);
+    for (int i = 0; i < n; i++) {
+      if (!fixed_[i])
+        free_vertices.push_back(i);
+    }
+    for (int k = 0; k < n_free; k++)
+      block_[free_vertices[pinv.indices()(k)]] = k;
+  }
+
+  // Save order for next optimization
+  order_.assign(n_free, 0);
+  for (int i = 0; i < n; i++) {
+    if (block_[i] >= 0)
+      order_[block_[i]] = ids_[i];
+  }
+
+  order_edges_.clear();
+  for (size_t k = 0; k < edges_.size(); k++) {
+    const Edge &e = edges_[k];
+    if (block_[e.i] >= 0 && block_[e.j] >= 0)
+      order_edges_.insert(std::make_pair(std::min(ids_[e.i], ids_[e.j]), std::max(ids_[e.i], ids_[e.j])));
+  }
+}
+
+void PoseGraphSolver::BuildStructure() {
+  // Off-diagonal blocks, one per pair of free vertices
+  std::map<std::pair<int, int>, int> blocks;
+  off_blocks_.clear();
+  for (size_t k = 0; k < edges_.size(); k++) {
+    Edge &e = edges_[k];
+    int a = block_[e.i], b = block_[e.j];
+    e.block = -1;
+    if (a < 0 || b < 0 || a == b)
+      continue;
+
+    std::pair<int, int> key(std::min(a, b), std::max(a, b));
+    std::map<std::pair<int, int>, int>::const_iterator it = blocks.find(key);
+    if (it == blocks.end()) {
+      e.block = off_blocks_.size();
+      blocks[key] = e.block;
+      off_blocks_.push_back(key);
+    } else {
+      e.block = it->second;
+    }
+  }
+
+  // Upper triangle pattern
+  vector<Eigen::Triplet<double> > triplets;
+  triplets.reserve(28*n_blocks_ + 49*off_blocks_.size());
+  for (int p = 0; p < n_blocks_; p++) {
+    for (int c = 0; c < 7; c++) {
+      for (int r = 0; r <= c; r++)
+        triplets.push_back(Eigen::Triplet<double>(7*p+r, 7*p+c, 0.0));
+    }
+  }
+  for (size_t k = 0; k < off_blocks_.size(); k++) {
+    int a = off_blocks_[k].first, b = off_blocks_[k].second;
+    for (int c = 0; c < 7; c++) {
+      for (int r = 0; r < 7; r++)
+        triplets.push_back(Eigen::Triplet<double>(7*a+r, 7*b+c, 0.0));
+    }
+  }
+
+  H_.resize(7*n_blocks_, 7*n_blocks_);
+  H_.setFromTriplets(triplets.begin(), triplets.end());
+  H_.makeCompressed();
+
+  // Rows of a block are consecutive in each column, store where they start
+  const int *outer = H_.outerIndexPtr();
+  const int *inner = H_.innerIndexPtr();
+  auto offset = [&](int row, int col) {
+    return static_cast<int>(std::lower_bound(inner+outer[col], inner+outer[col+1], row) - inner);
+  };
+
+  diag_offsets_.resize(7*n_blocks_);
+  for (int p = 0; p < n_blocks_; p++) {
+    for (int c = 0; c < 7; c++)
+      diag_offsets_[7*p+c] = offset(7*p, 7*p+c);
+  }
+
+  off_offsets_.resize(7*off_blocks_.size());
+  for (size_t k = 0; k < off_blocks_.size(); k++) {
+    int a = off_blocks_[k].first, b = off_blocks_[k].second;
+    for (int c = 0; c < 7; c++)
+      off_offsets_[7*k+c] = offset(7*a, 7*b+c);
+  }
+
+  // Natural ordering, vertices are already numbered in elimination order
+  if (n_blocks_ > 0)
+    ldlt_.analyzePattern(H_);
+
+  Ji_.resize(edges_.size());
+  Jj_.resize(edges_.size());
+  errors_.resize(edges_.size());
+  Hdiag_.resize(n_blocks_);
+  Hoff_.resize(off_blocks_.size());
+  b_.resize(7*n_blocks_);
+}
+
+void PoseGraphSolver::BuildSystem() {
+  // Jacobians by central differences, without touching shared estimates
+  ParallelFor(0, edges_.size(), threads_, [&](int k) {
+    const Edge &e = edges_[k];
+    const g2o::Sim3 &Si = vertices_[e.i];
+    const g2o::Sim3 &Sj = vertices_[e.j];
+    errors_[k] = Error(e, Si, Sj);
+
+    Vector7d add = Vector7d::Zero();
+    for (int d = 0; d < 7; d++) {
+      if (block_[e.i] >= 0) {
+        add[d] = kDelta;
+        Vector7d ep = Error(e, Plus(Si, add), Sj);
+        add[d] = -kDelta;
+        Vector7d em = Error(e, Plus(Si, add), Sj);
+        Ji_[k].col(d) = (ep-em)/(2*kDelta);
+      }
+
+      if (block_[e.j] >= 0) {
+        add[d] = kDelta;
+        Vector7d ep = Error(e, Si, Plus(Sj, add));
+        add[d] = -kDelta;
+        Vector7d em = Error(e, Si, Plus(Sj, add));
+        Jj_[k].col(d) = (ep-em)/(2*kDelta);
+      }
+      add[d] = 0.0;
+    }
+  });
+
+  for (int p = 0; p < n_blocks_; p++)
+    Hdiag_[p].setZero();
+  for (size_t k = 0; k < Hoff_.size(); k++)
+    Hoff_[k].setZero();
+  b_.setZero();
+
+  // Accumulate in edge order
+  for (size_t k = 0; k < edges_.size(); k++) {
+    const Edge &e = edges_[k];
+    int a = block_[e.i], b = block_[e.j];
+
+    if (a >= 0) {
+      Hdiag_[a].noalias() += Ji_[k].transpose()*Ji_[k];
+      b_.segment<7>(7*a).noalias() -= Ji_[k].transpose()*errors_[k];
+    }
+    if (b >= 0) {
+      Hdiag_[b].noalias() += Jj_[k].transpose()*Jj_[k];
+      b_.segment<7>(7*b).noalias() -= Jj_[k].transpose()*errors_[k];
+    }
+    if (e.block >= 0) {
+      if (a < b)
+        Hoff_[e.block].noalias() += Ji_[k].transpose()*Jj_[k];
+      else
+        Hoff_[e.block].noalias() += Jj_[k].transpose()*Ji_[k];
+    }
+  }
+}
+
+bool PoseGraphSolver::Solve(double lambda) {
+  if (n_blocks_ == 0) {
+    dx_.resize(0);
+    return true;
+  }
+
+  double *values = H_.valuePtr();
+  for (int p = 0; p < n_blocks_; p++) {
+    for (int c = 0; c < 7; c++) {
+      double *col = values + diag_offsets_[7*p+c];
+      for (int r = 0; r <= c; r++)
+        col[r] = Hdiag_[p](r, c);
+      col[c] += lambda;
+    }
+  }
+  for (size_t k = 0; k < Hoff_.size(); k++) {
+    for (int c = 0; c < 7; c++) {
+      double *col = values + off_offsets_[7*k+c];
+      for (int r = 0; r < 7; r++)
+        col[r] = Hoff_[k](r, c);
+    }
+  }
+
+  ldlt_.factorize(H_);
+  if (ldlt_.info() != Eigen::Success)
+    return false;
+
+  dx_ = ldlt_.solve(b_);
+  return dx_.allFinite();
+}
+
+void PoseGraphSolver::Update() {
+  for (size_t i = 0; i < vertices_.size(); i++) {
+    int p = block_[i];
+    if (p < 0)
+      continue;
+    vertices_[i] = Plus(vertices_[i], dx_.segment<7>(7*p));
+  }
+}
+
+}  // namespace SD_SLAM
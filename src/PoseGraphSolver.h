@@ -0,0 +1,148 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_POSEGRAPHSOLVER_H_
+#define SD_SLAM_POSEGRAPHSOLVER_H_
+
+#include <vector>
+#include <set>
+#include <utility>
+#include <unordered_map>
+#include <Eigen/Dense>
+#include <Eigen/Sparse>
+#include <Eigen/StdVector>
+#include "extra/g2o/types/sim3.h"
+
+namespace SD_SLAM {
+
+// Levenberg-Marquardt optimization of Sim3 pose graphs (essential graph).
+// Edges are stored contiguously and linearized in parallel, errors and Jacobians
+// are the same as g2o::EdgeSim3 with identity information. The elimination order
+// of the last optimization is kept, so the next graph only has to order the new
+// vertices instead of running AMD on the whole graph again, unless new edges join
+// vertices that were already ordered.
+class PoseGraphSolver {
+ public:
+  PoseGraphSolver();
+
+  // Remove vertices and edges, the elimination order is kept
+  void Clear();
+
+  // Forget the elimination order too
+  void Reset();
+
+  // Vertex ids are arbitrary (keyframe ids)
+  void AddVertex(unsigned long id, const g2o::Sim3 &Siw, bool fixed);
+
+  // Relative measurement Sji between vertices i and j, error is log(Sji*Siw*Sjw^-1)
+  void AddEdge(unsigned long id_i, unsigned long id_j, const g2o::Sim3 &Sji);
+
+  // Optimize scale too or not (stereo, rgbd)
+  inline void SetFixScale(bool fix_scale) { fix_scale_ = fix_scale; }
+
+  inline void SetNumThreads(int threads) { threads_ = threads; }
+
+  // Optimize, returns number of iterations done. lambda_init <= 0 uses tau*max(diag(H))
+  int Optimize(int iterations, double lambda_init = 0.0);
+
+  const g2o::Sim3 &GetVertex(unsigned long id) const;
+
+  inline int NumVertices() const { return vertices_.size(); }
+  inline int NumEdges() const { return edges_.size(); }
+
+ private:
+  typedef Eigen::Matrix<double, 7, 1> Vector7d;
+  typedef Eigen::Matrix<double, 7, 7> Matrix7d;
+  typedef Eigen::SparseMatrix<double, Eigen::ColMajor> SparseMatrix;
+
+  struct Edge {
+    int i;
+    int j;
+    g2o::Sim3 Sji;
+    int block;  // Off-diagonal block in the system, -1 if a vertex is fixed
+  };
+
+  // Error of an edge for given vertex estimates
+  inline Vector7d Error(const Edge &e, const g2o::Sim3 &Si, const g2o::Sim3 &Sj) const {
+    return (e.Sji*Si*Sj.inverse()).log();
+  }
+
+  // Vertex update, as g2o::VertexSim3Expmap::oplusImpl
+  g2o::Sim3 Plus(const g2o::Sim3 &S, const Vector7d &dx) const;
+
+  // Sum of chi2 over edges, edge errors evaluated in parallel
+  double ComputeChi2();
+
+  // Elimination order of free vertices, reusing the last one when possible
+  void ComputeOrdering();
+
+  // Sparse pattern of the upper triangle and value offsets of every block
+  void BuildStructure();
+
+  // Linearize edges in parallel and accumulate H and b
+  void BuildSystem();
+
+  // Solve damped system, result in dx_
+  bool Solve(double lambda);
+
+  // Apply dx_ to free vertices
+  void Update();
+
+  std::vector<unsigned long> ids_;
+  std::vector<g2o::Sim3, Eigen::aligned_allocator<g2o::Sim3> > vertices_;
+  std::vector<bool> fixed_;
+  std::unordered_map<unsigned long, int> indices_;
+  std::vector<Edge, Eigen::aligned_allocator<Edge> > edges_;
+
+  bool fix_scale_;
+  int threads_;
+
+  // Elimination order (vertex ids) of the last optimization
+  std::vector<unsigned long> order_;
+  // Edges (vertex ids) between free vertices when that order was computed
+  std::set<std::pair<unsigned long, unsigned long> > order_edges_;
+
+  // Structure
+  std::vector<int> block_;                  // Position in the system of each vertex, -1 if fixed
+  int n_blocks_;
+  std::vector<std::pair<int, int> > off_blocks_;
+  std::vector<int> diag_offsets_;           // Value offsets of each column of diagonal blocks
+  std::vector<int> off_offsets_;            // Value offsets of each column of off-diagonal blocks
+
+  // Linear system
+  std::vector<Matrix7d, Eigen::aligned_allocator<Matrix7d> > Ji_;
+  std::vector<Matrix7d, Eigen::aligned_allocator<Matrix7d> > Jj_;
+  std::vector<Vector7d, Eigen::aligned_allocator<Vector7d> > errors_;
+  std::vector<double> chi2_;
+  std::vector<Matrix7d, Eigen::aligned_allocator<Matrix7d> > Hdiag_;
+  std::vector<Matrix7d, Eigen::aligned_allocator<Matrix7d> > Hoff_;
+  Eigen::VectorXd b_;
+  Eigen::VectorXd dx_;
+  SparseMatrix H_;
+  Eigen::SimplicialLDLT<SparseMatrix, Eigen::Upper, Eigen::NaturalOrdering<int> > ldlt_;
+
+  std::vector<g2o::Sim3, Eigen::aligned_allocator<g2o::Sim3> > vertices_backup_;
+
+ public:
+  EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_POSEGRAPHSOLVER_H_
@@ -34,7 +34,7 @@ using std::vector;
 namespace SD_SLAM {
 
 Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *> &vpMatched12, const bool bFixScale):
-  mnIterations(0), mnBestInliers(0), mbFixScale(bFixScale) {
+  mnIterations(0), mnBestInliers(0), mbFixScale(bFixScale), mRng(pKF1->mnId*7919 + pKF2->mnId) {
   mpKF1 = pKF1;
   mpKF2 = pKF2;
 
@@ -74,11 +74,11 @@ Sim3Solver::Sim3Solver(KeyFrame *pKF1, KeyFrame *pKF2, const vector<MapPoint *>
       if (indexKF1 < 0 || indexKF2 < 0)
         continue;
 
-      const cv::KeyPoint &kp1 = pKF1->mvKeysUn[indexKF1];
-      const cv::KeyPoint &kp2 = pKF2->mvKeysUn[indexKF2];
+      const int octave1 = pKF1->mvKeysUn.octave[indexKF1];
+      const int octave2 = pKF2->mvKeysUn.octave[indexKF2];
 
-      const float sigmaSquare1 = pKF1->mvLevelSigma2[kp1.octave];
-      const float sigmaSquare2 = pKF2->mvLevelSigma2[kp2.octave];
+      const float sigmaSquare1 = pKF1->mvLevelSigma2[octave1];
+      const float sigmaSquare2 = pKF2->mvLevelSigma2[octave2];
 
       mvnMaxError1.push_back(9.210*sigmaSquare1);
       mvnMaxError2.push_back(9.210*sigmaSquare2);
@@ -158,7 +158,7 @@ Eigen::Matrix4d Sim3Solver::iterate(int nIterations, bool &bNoMore, vector<bool>
 
     // Get min set of points
     for (short i = 0; i < 3; ++i) {
-      int randi = Random(0, vAvailableIndices.size()-1);
+      int randi = Random(0, vAvailableIndices.size()-1, mRng);
 
       int idx = vAvailableIndices[randi];
 
@@ -26,6 +26,7 @@
 #define SD_SLAM_SIM3SOLVER_H
 
 #include <vector>
+#include <random>
 #include <opencv2/opencv.hpp>
 #include <Eigen/Dense>
 #include "KeyFrame.h"
@@ -101,6 +102,10 @@ class Sim3Solver {
   // Indices for random selection
   std::vector<size_t> mvAllIndices;
 
+  // Own generator, seeded with the keyframe ids, so that solvers running at once
+  // do not share the global one and results do not depend on the order they run
+  std::mt19937 mRng;
+
   // Projections
   std::vector<Eigen::Vector2d> mvP1im1;
   std::vector<Eigen::Vector2d> mvP2im2;
@@ -134,7 +134,7 @@ Eigen::Matrix4d System::TrackRGBD(const cv::Mat &im, const cv::Mat &depthmap, co
   unique_lock<mutex> lock2(mMutexState);
   mTrackingState = mpTracker->GetState();
   mTrackedMapPoints = mpTracker->GetCurrentFrame().mvpMapPoints;
-  mTrackedKeyPointsUn = mpTracker->GetCurrentFrame().mvKeysUn;
+  mTrackedKeyPointsUn = mpTracker->GetCurrentFrame().mvKeysUn.ToKeyPoints();
   return Tcw;
 }
 
@@ -188,7 +188,7 @@ Eigen::Matrix4d System::TrackMonocular(const cv::Mat &im, const std::string file
   unique_lock<mutex> lock2(mMutexState);
   mTrackingState = mpTracker->GetState();
   mTrackedMapPoints = mpTracker->GetCurrentFrame().mvpMapPoints;
-  mTrackedKeyPointsUn = mpTracker->GetCurrentFrame().mvKeysUn;
+  mTrackedKeyPointsUn = mpTracker->GetCurrentFrame().mvKeysUn.ToKeyPoints();
 
   return Tcw;
 }
@@ -223,11 +223,15 @@ Eigen::Matrix4d System::TrackFusion(const cv::Mat &im, const vector<double> &mea
   unique_lock<mutex> lock2(mMutexState);
   mTrackingState = mpTracker->GetState();
   mTrackedMapPoints = mpTracker->GetCurrentFrame().mvpMapPoints;
-  mTrackedKeyPointsUn = mpTracker->GetCurrentFrame().mvKeysUn;
+  mTrackedKeyPointsUn = mpTracker->GetCurrentFrame().mvKeysUn.ToKeyPoints();
 
   return Tcw;
 }
 
+void System::SetPosePrior(const Eigen::Matrix4d &pose) {
+  mpTracker->SetPosePrior(pose);
+}
+
 void System::ActivateLocalizationMode() {
   unique_lock<mutex> lock(mMutexMode);
   mbActivateLocalizationMode = true;
@@ -76,6 +76,9 @@ class System {
   // Returns the camera pose (empty if tracking fails).
   Eigen::Matrix4d TrackFusion(const cv::Mat &im, const std::vector<double> &measurements, const std::string filename = "");
 
+  // External pose hint (GPS-like) of the next frame to track, see PlaceRecognition.PriorRadius
+  void SetPosePrior(const Eigen::Matrix4d &pose);
+
   // This stops local mapping thread (map building) and performs only camera tracking.
   void ActivateLocalizationMode();
   // This resumes local mapping thread and performs SLAM again.
@@ -41,7 +41,8 @@ namespace SD_SLAM {
 
 Tracking::Tracking(System *pSys, Map *pMap, const int sensor):
   mState(NO_IMAGES_YET), mSensor(sensor), mpInitializer(static_cast<Initializer*>(NULL)),
-  mpPatternDetector(), mpSystem(pSys), mpMap(pMap), mnLastRelocFrameId(0), mbOnlyTracking(false) {
+  mpPatternDetector(), mpSystem(pSys), mpMap(pMap), mnLastRelocFrameId(0), mbOnlyTracking(false),
+  has_pose_prior_(false), has_frame_prior_(false), external_frame_prior_(false) {
   // Load camera parameters
   float fx = Config::fx();
   float fy = Config::fy();
@@ -120,6 +121,9 @@ Tracking::Tracking(System *pSys, Map *pMap, const int sensor):
   threshold_ = 8;
   usePattern = Config::UsePattern();
   align_image_ = true;
+  optical_flow_ = Config::OpticalFlow();
+  extract_orb_ = true;
+  orb_inliers_ = 0;
 
   if (usePattern)
     std::cout << "Use pattern for initialization" << std::endl;
@@ -147,7 +151,12 @@ Eigen::Matrix4d Tracking::GrabImageRGBD(const cv::Mat &im, const cv::Mat &imD, c
   if ((fabs(mDepthMapFactor-1.0f) > 1e-5) || imD.type() != CV_32F)
     imDepth.convertTo(imDepth, CV_32F, mDepthMapFactor);
 
-  mCurrentFrame = Frame(im, imDepth, mpORBextractorLeft, mK, mDistCoef, mbf, mThDepth);
+  image_ = im;
+  depth_ = imDepth;
+  if (UseOpticalFlow())
+    mCurrentFrame = Frame(im, imDepth, mLastFrame);
+  else
+    mCurrentFrame = Frame(im, imDepth, mpORBextractorLeft, mK, mDistCoef, mbf, mThDepth);
 
   Track();
 
@@ -159,8 +168,12 @@ Eigen::Matrix4d Tracking::GrabImageMonocular(const cv::Mat &im, const std::strin
   // Image must be in gray scale
   assert(im.channels() == 1);
 
+  image_ = im;
+  depth_ = cv::Mat();
   if (mState==NOT_INITIALIZED || mState==NO_IMAGES_YET)
     mCurrentFrame = Frame(im, mpIniORBextractor, mK, mDistCoef, mbf, mThDepth);
+  else if (UseOpticalFlow())
+    mCurrentFrame = Frame(im, cv::Mat(), mLastFrame);
   else
     mCurrentFrame = Frame(im, mpORBextractorLeft, mK, mDistCoef, mbf, mThDepth);
 
@@ -169,6 +182,24 @@ Eigen::Matrix4d Tracking::GrabImageMonocular(const cv::Mat &im, const std::strin
   return mCurrentFrame.GetPose();
 }
 
+void Tracking::SetPosePrior(const Eigen::Matrix4d &pose) {
+  pose_prior_ = pose;
+  has_pose_prior_ = true;
+
+  frame_prior_ = pose;
+  has_frame_prior_ = true;
+  external_frame_prior_ = true;
+}
+
+void Tracking::SetFramePrior(const Eigen::Matrix4d &predicted_pose) {
+  // External hints are kept over predictions
+  if (external_frame_prior_)
+    return;
+
+  frame_prior_ = predicted_pose;
+  has_frame_prior_ = true;
+}
+
 Frame Tracking::CreateFrame(const cv::Mat &im) {
   return Frame(im, mpORBextractorLeft, mK, mDistCoef, mbf, mThDepth);
 }
@@ -212,7 +243,15 @@ void Tracking::Track() {
       // Local Mapping might have changed some MapPoints tracked in last frame
       CheckReplacedInLastFrame();
 
-      if (!motion_model_->Started() || mCurrentFrame.mnId < mnLastRelocFrameId+2) {
+      if (mCurrentFrame.mbOpticalFlow) {
+        bOK = TrackWithOpticalFlow();
+        if (!bOK) {
+          // Extract features in the same frame and track as usual
+          mCurrentFrame.ExtractFeatures(image_, depth_);
+          bOK = TrackReferenceKeyFrame();
+          motion_model_->Restart();
+        }
+      } else if (!motion_model_->Started() || mCurrentFrame.mnId < mnLastRelocFrameId+2) {
         bOK = TrackReferenceKeyFrame();
       } else {
         bOK = TrackWithMotionModel();
@@ -239,6 +278,8 @@ void Tracking::Track() {
 
     // If tracking were good, check if we insert a keyframe
     if (bOK) {
+      pose_prior_ = mCurrentFrame.GetPose();
+      has_pose_prior_ = true;
 
       // Update motion sensor
       if (!mLastFrame.GetPose().isZero())
@@ -263,9 +304,17 @@ void Tracking::Track() {
       }
       mlpTemporalPoints.clear();
 
-      // Check if we need to insert a new keyframe
-      if (NeedNewKeyFrame())
-        CreateNewKeyFrame();
+      // Check if we need to insert a new keyframe. Keyframes need features, so they are
+      // delayed to the next frame when keypoints were propagated
+      if (mCurrentFrame.mbOpticalFlow) {
+        if (NeedNewKeyFrame() || mnMatchesInliers < 0.5*orb_inliers_)
+          extract_orb_ = true;
+      } else {
+        extract_orb_ = false;
+        orb_inliers_ = mnMatchesInliers;
+        if (NeedNewKeyFrame())
+          CreateNewKeyFrame();
+      }
 
       // We allow points with high innovation (considererd outliers by the Huber Function)
       // pass to the new keyframe, so that bundle adjustment will finally decide
@@ -292,6 +341,10 @@ void Tracking::Track() {
     mLastFrame = Frame(mCurrentFrame);
   }
 
+  // Priors only describe the frame they were given for
+  has_frame_prior_ = false;
+  external_frame_prior_ = false;
+
   // Store relative pose
   if (!mCurrentFrame.GetPose().isZero()) {
     Eigen::Matrix4d Tcr = mCurrentFrame.GetPose()*mCurrentFrame.mpReferenceKF->GetPoseInverse();
@@ -356,7 +409,7 @@ void Tracking::MonocularInitialization() {
       mLastFrame = Frame(mCurrentFrame);
       mvbPrevMatched.resize(mCurrentFrame.mvKeysUn.size());
       for (size_t i = 0; i<mCurrentFrame.mvKeysUn.size(); i++)
-        mvbPrevMatched[i] = mCurrentFrame.mvKeysUn[i].pt;
+        mvbPrevMatched[i] = mCurrentFrame.mvKeysUn.pt(i);
 
       if (mpInitializer)
         delete mpInitializer;
@@ -660,6 +713,13 @@ bool Tracking::TrackWithMotionModel() {
   // Predict initial pose with motion model
   Eigen::Matrix4d predicted_pose = motion_model_->Predict(mLastFrame.GetPose());
   mCurrentFrame.SetPose(predicted_pose);
+  SetFramePrior(predicted_pose);
+
+  // Windows from the predicted pose covariance, fixed ones otherwise
+  Eigen::Matrix<double, 6, 6> pose_cov;
+  const Eigen::Matrix<double, 6, 6> *pPoseCov = NULL;
+  if (Config::CovarianceWindows() && motion_model_->GetPoseCovariance(&pose_cov))
+    pPoseCov = &pose_cov;
 
   LOGD("Predicted pose: [%.4f, %.4f, %.4f]", predicted_pose(0, 3), predicted_pose(1, 3), predicted_pose(2, 3));
 
@@ -674,14 +734,16 @@ bool Tracking::TrackWithMotionModel() {
 
   // Project points seen in previous frame
   fill(mCurrentFrame.mvpMapPoints.begin(), mCurrentFrame.mvpMapPoints.end(), static_cast<MapPoint*>(NULL));
-  int nmatches = matcher.SearchByProjection(mCurrentFrame, mLastFrame, threshold_, mSensor!=System::RGBD);
+  bool bBounded = false;
+  int nmatches = matcher.SearchByProjection(mCurrentFrame, mLastFrame, threshold_, mSensor!=System::RGBD, pPoseCov, &bBounded);
 
-  // If few matches, ignores alignment and uses a wider window search
-  if (nmatches<20) {
+  // If few matches, ignores alignment and uses a wider window search. Not done if the pose
+  // covariance already bounded every window, a wider threshold would give the same windows
+  if (nmatches<20 && !bBounded) {
     LOGD("Not enough matches [%d], double threshold", nmatches);
     mCurrentFrame.SetPose(predicted_pose);
     fill(mCurrentFrame.mvpMapPoints.begin(), mCurrentFrame.mvpMapPoints.end(), static_cast<MapPoint*>(NULL));
-    nmatches = matcher.SearchByProjection(mCurrentFrame, mLastFrame, 2*threshold_, mSensor!=System::RGBD);
+    nmatches = matcher.SearchByProjection(mCurrentFrame, mLastFrame, 2*threshold_, mSensor!=System::RGBD, pPoseCov);
   }
 
   if (nmatches<20) {
@@ -717,6 +779,71 @@ bool Tracking::TrackWithMotionModel() {
   return true;
 }
 
+bool Tracking::UseOpticalFlow() {
+  if (!optical_flow_ || extract_orb_ || mState != OK)
+    return false;
+
+  // Same conditions as motion model tracking
+  return motion_model_->Started() && Frame::nNextId >= mnLastRelocFrameId+2;
+}
+
+bool Tracking::TrackWithOpticalFlow() {
+  // Update last frame pose according to its reference keyframe
+  UpdateLastFrame();
+
+  // Predict initial pose with motion model
+  Eigen::Matrix4d predicted_pose = motion_model_->Predict(mLastFrame.GetPose());
+  mCurrentFrame.SetPose(predicted_pose);
+  SetFramePrior(predicted_pose);
+
+  LOGD("Predicted pose: [%.4f, %.4f, %.4f]", predicted_pose(0, 3), predicted_pose(1, 3), predicted_pose(2, 3));
+
+  // Local Mapping might have changed some propagated MapPoints
+  int nmatches = 0;
+  for (int i  = 0; i<mCurrentFrame.N; i++) {
+    MapPoint* pMP = mCurrentFrame.mvpMapPoints[i];
+    MapPoint* pRep = pMP->GetReplaced();
+    if (pRep)
+      pMP = mCurrentFrame.mvpMapPoints[i] = pRep;
+    if (pMP->isBad())
+      mCurrentFrame.mvpMapPoints[i] = static_cast<MapPoint*>(NULL);
+    else
+      nmatches++;
+  }
+
+  if (nmatches<Config::OpticalFlowMinPoints()) {
+    LOGD("Not enough propagated points [%d], extract features", nmatches);
+    return false;
+  }
+
+  // Optimize frame pose with propagated points
+  Optimizer::PoseOptimization(&mCurrentFrame);
+
+  // Discard outliers
+  int nmatchesMap = 0;
+  for (int i  = 0; i<mCurrentFrame.N; i++) {
+    if (mCurrentFrame.mvpMapPoints[i]) {
+      if (mCurrentFrame.mvbOutlier[i]) {
+        MapPoint* pMP = mCurrentFrame.mvpMapPoints[i];
+
+        mCurrentFrame.mvpMapPoints[i] = static_cast<MapPoint*>(NULL);
+        mCurrentFrame.mvbOutlier[i]=false;
+        pMP->mbTrackInView = false;
+        pMP->mnLastFrameSeen = mCurrentFrame.mnId;
+        nmatches--;
+      } else if (mCurrentFrame.mvpMapPoints[i]->Observations() > 0)
+        nmatchesMap++;
+    }
+  }
+
+  if (nmatchesMap<Config::OpticalFlowMinPoints()/2) {
+    LOGD("Not enough inliers [%d], extract features", nmatchesMap);
+    return false;
+  }
+
+  return true;
+}
+
 bool Tracking::TrackLocalMap() {
   // We have an estimation of the camera pose and some map points tracked in the frame.
   // We retrieve the local map and try to find matches to points in the local map.
@@ -887,6 +1014,10 @@ void Tracking::CreateNewKeyFrame() {
     }
   }
 
+  // Before inserting the keyframe, loop closing reads the prior when it gets there
+  if (mpLoopClosing && has_frame_prior_)
+    mpLoopClosing->SetPosePrior(pKF, frame_prior_);
+
   mpLocalMapper->InsertKeyFrame(pKF);
 
   mpLocalMapper->SetNotStop(false);
@@ -912,15 +1043,26 @@ void Tracking::SearchLocalPoints() {
 
   int nToMatch = 0;
 
-  // Project points in frame and check its visibility
-  for (vector<MapPoint*>::iterator vit = mvpLocalMapPoints.begin(), vend = mvpLocalMapPoints.end(); vit!=vend; vit++) {
-    MapPoint* pMP = *vit;
+  // Project all points in frame at once, local points are gathered by UpdateLocalPoints
+  if (mLocalPointsArray.size() != mvpLocalMapPoints.size())
+    mLocalPointsArray.Assign(mvpLocalMapPoints);
+  mCurrentFrame.isInFrustum(mLocalPointsArray, 0.5);
+
+  // Fill MapPoint variables for matching
+  for (size_t i = 0; i < mvpLocalMapPoints.size(); i++) {
+    MapPoint* pMP = mvpLocalMapPoints[i];
     if (pMP->mnLastFrameSeen == mCurrentFrame.mnId)
       continue;
     if (pMP->isBad())
       continue;
-    // Project (this fills MapPoint variables for matching)
-    if (mCurrentFrame.isInFrustum(pMP, 0.5)) {
+
+    pMP->mbTrackInView = mLocalPointsArray.visible[i];
+    if (pMP->mbTrackInView) {
+      pMP->mTrackProjX = mLocalPointsArray.u[i];
+      pMP->mTrackProjXR = mLocalPointsArray.ur[i];
+      pMP->mTrackProjY = mLocalPointsArray.v[i];
+      pMP->mnTrackScaleLevel = mLocalPointsArray.level[i];
+      pMP->mTrackViewCos = mLocalPointsArray.view_cos[i];
       pMP->IncreaseVisible();
       nToMatch++;
     }
@@ -934,7 +1076,7 @@ void Tracking::SearchLocalPoints() {
     // If the camera has been relocalised recently, perform a coarser search
     if (mCurrentFrame.mnId<mnLastRelocFrameId+2)
       th=5;
-    matcher.SearchByProjection(mCurrentFrame, mvpLocalMapPoints, th);
+    matcher.SearchByProjection(mCurrentFrame, mvpLocalMapPoints, th, Config::LocalMapThreads());
   }
 }
 
@@ -966,6 +1108,24 @@ void Tracking::UpdateLocalPoints() {
       }
     }
   }
+
+  // Add points in view not reached through covisibility (revisited areas)
+  const int nMaxCandidates = Config::MaxLocalMapCandidates();
+  if (nMaxCandidates > 0) {
+    const vector<MapPoint*> vpCandidates = mpMap->GetMapPointsInView(mCurrentFrame.GetPose(), nMaxCandidates,
+                                                                       Config::LocalMapMaxDepth());
+    for (vector<MapPoint*>::const_iterator itMP=vpCandidates.begin(), itEndMP=vpCandidates.end(); itMP!=itEndMP; itMP++) {
+      MapPoint* pMP = *itMP;
+      if (pMP->mnTrackReferenceForFrame == mCurrentFrame.mnId)
+        continue;
+      if (!pMP->isBad()) {
+        mvpLocalMapPoints.push_back(pMP);
+        pMP->mnTrackReferenceForFrame = mCurrentFrame.mnId;
+      }
+    }
+  }
+
+  mLocalPointsArray.Assign(mvpLocalMapPoints);
 }
 
 
@@ -1065,17 +1225,56 @@ bool Tracking::Relocalization() {
   ORBmatcher matcher(0.75, true);
   int nmatches, nGood;
 
-  // Compare to all keyframes starting from the last one
+  // Compare to keyframes near the pose prior first, then to the rest starting from the last one
   vector<KeyFrame*> kfs = mpMap->GetAllKeyFrames();
+  vector<KeyFrame*> candidates;
+  candidates.reserve(kfs.size());
+
+  set<KeyFrame*> near;
+  if (has_pose_prior_ && Config::PriorRadius() > 0.0) {
+    candidates = mpMap->GetKeyFramesNearPose(pose_prior_, Config::PriorRadius(), Config::PriorMaxAngle()*M_PI/180.0);
+    near.insert(candidates.begin(), candidates.end());
+  }
+
+  const size_t nNear = candidates.size();
   for (auto it=kfs.rbegin(); it != kfs.rend(); it++) {
-    KeyFrame* kf = *it;
+    if (!near.count(*it))
+      candidates.push_back(*it);
+  }
+
+  // With several threads, align all candidates at the coarsest level first and try them
+  // sorted by error, keyframes near the prior still go first. Rejected candidates would
+  // also fail the first level of the fast alignment
+  const int nThreads = Config::PlaceRecognitionThreads();
+  vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > coarsePoses;
+  if (nThreads > 1) {
+    vector<Eigen::Matrix4d, Eigen::aligned_allocator<Eigen::Matrix4d> > coarsePosesFar;
+    vector<KeyFrame*> vNear(candidates.begin(), candidates.begin()+nNear);
+    vector<KeyFrame*> vFar(candidates.begin()+nNear, candidates.end());
+    vector<std::pair<KeyFrame*, double> > ranked = ImageAlign::RankKeyFrames(mCurrentFrame, vNear, nThreads, &coarsePoses);
+    vector<std::pair<KeyFrame*, double> > rankedFar = ImageAlign::RankKeyFrames(mCurrentFrame, vFar, nThreads, &coarsePosesFar);
+    ranked.insert(ranked.end(), rankedFar.begin(), rankedFar.end());
+    coarsePoses.insert(coarsePoses.end(), coarsePosesFar.begin(), coarsePosesFar.end());
+
+    candidates.clear();
+    for (size_t i = 0; i < ranked.size(); i++)
+      candidates.push_back(ranked[i].first);
+  }
 
-    mCurrentFrame.SetPose(kf->GetPose());
+  for (size_t i = 0; i < candidates.size(); i++) {
+    KeyFrame* kf = candidates[i];
 
-    // Try to align current frame and candidate keyframe
+    // Try to align current frame and candidate keyframe, continuing from the coarse alignment if done
     ImageAlign image_align;
-    if (!image_align.ComputePose(mCurrentFrame, kf, true))
-      continue;
+    if (nThreads > 1) {
+      mCurrentFrame.SetPose(coarsePoses[i]);
+      if (!image_align.ComputeFinePose(mCurrentFrame, kf))
+        continue;
+    } else {
+      mCurrentFrame.SetPose(kf->GetPose());
+      if (!image_align.ComputePose(mCurrentFrame, kf, true))
+        continue;
+    }
 
     fill(mCurrentFrame.mvpMapPoints.begin(), mCurrentFrame.mvpMapPoints.end(), static_cast<MapPoint*>(NULL));
 
@@ -1124,6 +1323,9 @@ void Tracking::Reset() {
 
   lastRelativePose_.setZero();
   motion_model_->Restart();
+  has_pose_prior_ = false;
+  has_frame_prior_ = false;
+  external_frame_prior_ = false;
 }
 
 void Tracking::InformOnlyTracking(const bool &flag) {
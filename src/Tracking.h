@@ -82,6 +82,10 @@ class Tracking {
     measurements_ = measurements;
   }
 
+  // External pose hint (GPS-like) of the next frame, used to search relocalization and
+  // loop candidates first. Without it keyframes use the motion model prediction
+  void SetPosePrior(const Eigen::Matrix4d &pose);
+
   inline void SetReferenceKeyFrame(KeyFrame * kf) {
     mpReferenceKF = kf;
   }
@@ -126,6 +130,10 @@ class Tracking {
   void UpdateLastFrame();
   bool TrackWithMotionModel();
 
+  // Optical flow mode: MapPoints propagated from last frame, no ORB extraction
+  bool UseOpticalFlow();
+  bool TrackWithOpticalFlow();
+
   bool Relocalization();
 
   void UpdateLocalMap();
@@ -138,6 +146,9 @@ class Tracking {
   bool NeedNewKeyFrame();
   void CreateNewKeyFrame();
 
+  // Motion model prediction as loop prior of the current frame
+  void SetFramePrior(const Eigen::Matrix4d &predicted_pose);
+
   // Other Thread Pointers
   LocalMapping* mpLocalMapper;
   LoopClosing* mpLoopClosing;
@@ -164,6 +175,7 @@ class Tracking {
   KeyFrame* mpReferenceKF;
   std::vector<KeyFrame*> mvpLocalKeyFrames;
   std::vector<MapPoint*> mvpLocalMapPoints;
+  MapPointArray mLocalPointsArray;  // Fields of mvpLocalMapPoints for frustum culling
 
   // System
   System* mpSystem;
@@ -222,6 +234,21 @@ class Tracking {
   // Image align
   bool align_image_;
 
+  // Optical flow tracking
+  bool optical_flow_;
+  bool extract_orb_;          // Next frame must extract ORB features
+  int orb_inliers_;           // Inliers of last ORB frame
+  cv::Mat image_, depth_;     // Current input, to extract ORB features if optical flow fails
+
+  // Pose prior for relocalization (last tracked pose or external hint)
+  bool has_pose_prior_;
+  Eigen::Matrix4d pose_prior_;
+
+  // Pose prior of the current frame for loop detection (external hint or prediction)
+  bool has_frame_prior_;
+  bool external_frame_prior_;
+  Eigen::Matrix4d frame_prior_;
+
  public:
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
 };
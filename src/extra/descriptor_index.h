@@ -0,0 +1,100 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_DESCRIPTOR_INDEX_H_
+#define SD_SLAM_DESCRIPTOR_INDEX_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <algorithm>
+
+namespace SD_SLAM {
+
+// Multi-index hash of 256 bit binary descriptors.
+// Every byte of the descriptor is a key of its own table, a query returns the
+// descriptors that share at least one byte with it. Two descriptors at Hamming
+// distance d share a byte with high probability while d is small compared with
+// the 32 substrings (d < 32 always, ~99.8% of pairs at d = 50 for random flips).
+// Read only after Build, can be queried from several threads.
+class DescriptorIndex {
+ public:
+  static const int kBytes = 32;
+
+  DescriptorIndex() : rows_(0) {}
+
+  inline int Size() const { return rows_; }
+  inline bool Empty() const { return rows_ == 0; }
+
+  // Index rows descriptors of kBytes, step bytes apart
+  void Build(const uint8_t *data, int rows, size_t step) {
+    rows_ = rows;
+    offsets_.assign(kBytes*(kBuckets+1), 0);
+    indices_.resize(static_cast<size_t>(kBytes)*rows);
+
+    // Bucket sizes and offsets of every table (CSR)
+    for (int i = 0; i < rows; i++) {
+      const uint8_t *d = data + i*step;
+      for (int t = 0; t < kBytes; t++)
+        offsets_[t*(kBuckets+1) + d[t] + 1]++;
+    }
+    for (int t = 0; t < kBytes; t++) {
+      int *off = &offsets_[t*(kBuckets+1)];
+      off[0] = t*rows;
+      for (int b = 1; b <= kBuckets; b++)
+        off[b] += off[b-1];
+    }
+
+    std::vector<int> fill(offsets_);
+    for (int i = 0; i < rows; i++) {
+      const uint8_t *d = data + i*step;
+      for (int t = 0; t < kBytes; t++)
+        indices_[fill[t*(kBuckets+1) + d[t]]++] = i;
+    }
+  }
+
+  // Indices of descriptors sharing a byte with desc, sorted and without duplicates.
+  // visited is scratch space of the caller, Size() elements initialized to -1,
+  // query must be different for each call that reuses it.
+  void Query(const uint8_t *desc, int query, std::vector<int> &visited, std::vector<int> &candidates) const {
+    candidates.clear();
+    for (int t = 0; t < kBytes; t++) {
+      const int *off = &offsets_[t*(kBuckets+1) + desc[t]];
+      for (int k = off[0]; k < off[1]; k++) {
+        const int i = indices_[k];
+        if (visited[i] != query) {
+          visited[i] = query;
+          candidates.push_back(i);
+        }
+      }
+    }
+    std::sort(candidates.begin(), candidates.end());
+  }
+
+ private:
+  static const int kBuckets = 256;
+
+  int rows_;
+  std::vector<int> offsets_;
+  std::vector<int> indices_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_DESCRIPTOR_INDEX_H_
@@ -90,6 +90,9 @@ namespace g2o {
 
       virtual void constructQuadraticForm() ;
 
+      virtual void linearizeOplusInPlace();
+      virtual void constructQuadraticFormForVertex(int vertexIndex);
+
       virtual void mapHessianMemory(double* d, int i, int j, bool rowMajor);
 
       using BaseEdge<D, E>::resize;
@@ -108,6 +111,10 @@ namespace g2o {
       JacobianXiOplusType _jacobianOplusXi;
       JacobianXjOplusType _jacobianOplusXj;
 
+      // edge owned Jacobian memory for the parallel linearization
+      VectorXd _jacobianStorageXi;
+      VectorXd _jacobianStorageXj;
+
     public:
       EIGEN_MAKE_ALIGNED_OPERATOR_NEW
   };
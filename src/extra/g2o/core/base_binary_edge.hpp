@@ -119,6 +119,74 @@ void BaseBinaryEdge<D, E, VertexXiType, VertexXjType>::constructQuadraticForm()
   }
 }
 
+template <int D, typename E, typename VertexXiType, typename VertexXjType>
+void BaseBinaryEdge<D, E, VertexXiType, VertexXjType>::constructQuadraticFormForVertex(int vertexIndex)
+{
+  // Same operations as constructQuadraticForm(), restricted to one vertex.
+  // The off-diagonal block belongs to the edge and is built with vertex 0.
+  VertexXiType* from = static_cast<VertexXiType*>(_vertices[0]);
+  VertexXjType* to   = static_cast<VertexXjType*>(_vertices[1]);
+
+  const JacobianXiOplusType& A = jacobianOplusXi();
+  const JacobianXjOplusType& B = jacobianOplusXj();
+
+  bool fromNotFixed = !(from->fixed());
+  bool toNotFixed = !(to->fixed());
+
+  const InformationType& omega = _information;
+  Matrix<double, D, 1> omega_r = - omega * _error;
+  if (this->robustKernel() == 0) {
+    if (vertexIndex == 0 && fromNotFixed) {
+      Matrix<double, VertexXiType::Dimension, D> AtO = A.transpose() * omega;
+      from->b().noalias() += A.transpose() * omega_r;
+      from->A().noalias() += AtO*A;
+      if (toNotFixed ) {
+        if (_hessianRowMajor) // we have to write to the block as transposed
+          _hessianTransposed.noalias() += B.transpose() * AtO.transpose();
+        else
+          _hessian.noalias() += AtO * B;
+      }
+    }
+    if (vertexIndex == 1 && toNotFixed) {
+      to->b().noalias() += B.transpose() * omega_r;
+      to->A().noalias() += B.transpose() * omega * B;
+    }
+  } else { // robust (weighted) error according to some kernel
+    double error = this->chi2();
+    Eigen::Vector3d rho;
+    this->robustKernel()->robustify(error, rho);
+    InformationType weightedOmega = this->robustInformation(rho);
+
+    omega_r *= rho[1];
+    if (vertexIndex == 0 && fromNotFixed) {
+      from->b().noalias() += A.transpose() * omega_r;
+      from->A().noalias() += A.transpose() * weightedOmega * A;
+      if (toNotFixed ) {
+        if (_hessianRowMajor) // we have to write to the block as transposed
+          _hessianTransposed.noalias() += B.transpose() * weightedOmega * A;
+        else
+          _hessian.noalias() += A.transpose() * weightedOmega * B;
+      }
+    }
+    if (vertexIndex == 1 && toNotFixed) {
+      to->b().noalias() += B.transpose() * omega_r;
+      to->A().noalias() += B.transpose() * weightedOmega * B;
+    }
+  }
+}
+
+template <int D, typename E, typename VertexXiType, typename VertexXjType>
+void BaseBinaryEdge<D, E, VertexXiType, VertexXjType>::linearizeOplusInPlace()
+{
+  if (_jacobianStorageXi.size() != _dimension * Di) {
+    _jacobianStorageXi.resize(_dimension * Di);
+    _jacobianStorageXj.resize(_dimension * Dj);
+  }
+  new (&_jacobianOplusXi) JacobianXiOplusType(_jacobianStorageXi.data(), D, Di);
+  new (&_jacobianOplusXj) JacobianXjOplusType(_jacobianStorageXj.data(), D, Dj);
+  linearizeOplus();
+}
+
 template <int D, typename E, typename VertexXiType, typename VertexXjType>
 void BaseBinaryEdge<D, E, VertexXiType, VertexXjType>::linearizeOplus(JacobianWorkspace& jacobianWorkspace)
 {
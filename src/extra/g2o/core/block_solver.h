@@ -31,6 +31,7 @@
 #include "linear_solver.h"
 #include "sparse_block_matrix.h"
 #include "sparse_block_matrix_diagonal.h"
+#include "optimizable_graph.h"
 #include "openmp_mutex.h"
 #include "../config.h"
 
@@ -147,6 +148,9 @@ namespace g2o {
 
       void deallocate();
 
+      //! fill _vertexEdges if every active edge supports the parallel linearization
+      void buildParallelStructure();
+
       SparseBlockMatrix<PoseMatrixType>* _Hpp;
       SparseBlockMatrix<LandmarkMatrixType>* _Hll;
       SparseBlockMatrix<PoseLandmarkMatrixType>* _Hpl;
@@ -168,6 +172,11 @@ namespace g2o {
 
       bool _doSchur;
 
+      //! edges (and the index of the vertex in each edge) acting on each Hessian index,
+      //! in the order of the active edges, used by the parallel buildSystem()
+      std::vector<std::vector<std::pair<OptimizableGraph::Edge*, int> > > _vertexEdges;
+      bool _parallelLinearization;
+
       double* _coefficients;
       double* _bschur;
 
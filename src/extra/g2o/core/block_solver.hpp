@@ -32,6 +32,7 @@
 #include "../stuff/timeutil.h"
 #include "../stuff/macros.h"
 #include "../stuff/misc.h"
+#include "parallel_for.h"
 
 namespace g2o {
 
@@ -59,6 +60,7 @@ BlockSolver<Traits>::BlockSolver(LinearSolverType* linearSolver) :
   _sizePoses = 0;
   _sizeLandmarks = 0;
   _doSchur=true;
+  _parallelLinearization = false;
 }
 
 template <typename Traits>
@@ -253,6 +255,8 @@ bool BlockSolver<Traits>::buildStructure(bool zeroBlocks)
     }
   }
 
+  buildParallelStructure();
+
   if (! _doSchur)
     return true;
 
@@ -294,6 +298,30 @@ bool BlockSolver<Traits>::buildStructure(bool zeroBlocks)
   return true;
 }
 
+template <typename Traits>
+void BlockSolver<Traits>::buildParallelStructure()
+{
+  _parallelLinearization = false;
+  _vertexEdges.clear();
+
+  const SparseOptimizer::EdgeContainer& edges = _optimizer->activeEdges();
+  for (size_t k = 0; k < edges.size(); ++k) {
+    if (! edges[k]->supportsParallelLinearization())
+      return;
+  }
+
+  _vertexEdges.resize(_optimizer->indexMapping().size());
+  for (size_t k = 0; k < edges.size(); ++k) {
+    OptimizableGraph::Edge* e = edges[k];
+    for (size_t i = 0; i < e->vertices().size(); ++i) {
+      int ind = static_cast<OptimizableGraph::Vertex*>(e->vertex(i))->hessianIndex();
+      if (ind >= 0)
+        _vertexEdges[ind].push_back(std::make_pair(e, static_cast<int>(i)));
+    }
+  }
+  _parallelLinearization = true;
+}
+
 template <typename Traits>
 bool BlockSolver<Traits>::updateStructure(const std::vector<HyperGraph::Vertex*>& vset, const HyperGraph::EdgeSet& edges)
 {
@@ -317,6 +345,10 @@ bool BlockSolver<Traits>::updateStructure(const std::vector<HyperGraph::Vertex*>
   }
   resizeVector(_sizePoses + _sizeLandmarks);
 
+  // incremental updates always use the serial linearization
+  _parallelLinearization = false;
+  _vertexEdges.clear();
+
   for (HyperGraph::EdgeSet::const_iterator it = edges.begin(); it != edges.end(); ++it) {
     OptimizableGraph::Edge* e = static_cast<OptimizableGraph::Edge*>(*it);
 
@@ -516,32 +548,49 @@ bool BlockSolver<Traits>::buildSystem()
     _Hpl->clear();
   }
 
-  // resetting the terms for the pairwise constraints
-  // built up the current system by storing the Hessian blocks in the edges and vertices
+  const int numThreads = _optimizer->numThreads();
+  if (numThreads > 1 && _parallelLinearization) {
+    // Jacobians are stored in the edges, then each vertex accumulates its own
+    // blocks following the order of the active edges, which gives the same
+    // sums as the serial loop below. Off-diagonal blocks are written by the
+    // task of the first vertex of the edge.
+    const SparseOptimizer::EdgeContainer& edges = _optimizer->activeEdges();
+    parallelFor(0, static_cast<int>(edges.size()), numThreads, [&edges](int k) {
+      edges[k]->linearizeOplusInPlace();
+    });
+    parallelFor(0, static_cast<int>(_vertexEdges.size()), numThreads, [this](int i) {
+      const std::vector<std::pair<OptimizableGraph::Edge*, int> >& vedges = _vertexEdges[i];
+      for (size_t k = 0; k < vedges.size(); ++k)
+        vedges[k].first->constructQuadraticFormForVertex(vedges[k].second);
+    });
+  } else {
+    // resetting the terms for the pairwise constraints
+    // built up the current system by storing the Hessian blocks in the edges and vertices
 # ifndef G2O_OPENMP
-  // no threading, we do not need to copy the workspace
-  JacobianWorkspace& jacobianWorkspace = _optimizer->jacobianWorkspace();
+    // no threading, we do not need to copy the workspace
+    JacobianWorkspace& jacobianWorkspace = _optimizer->jacobianWorkspace();
 # else
-  // if running with threads need to produce copies of the workspace for each thread
-  JacobianWorkspace jacobianWorkspace = _optimizer->jacobianWorkspace();
+    // if running with threads need to produce copies of the workspace for each thread
+    JacobianWorkspace jacobianWorkspace = _optimizer->jacobianWorkspace();
 # pragma omp parallel for default (shared) firstprivate(jacobianWorkspace) if (_optimizer->activeEdges().size() > 100)
 # endif
-  for (int k = 0; k < static_cast<int>(_optimizer->activeEdges().size()); ++k) {
-    OptimizableGraph::Edge* e = _optimizer->activeEdges()[k];
-    e->linearizeOplus(jacobianWorkspace); // jacobian of the nodes' oplus (manifold)
-    e->constructQuadraticForm();
+    for (int k = 0; k < static_cast<int>(_optimizer->activeEdges().size()); ++k) {
+      OptimizableGraph::Edge* e = _optimizer->activeEdges()[k];
+      e->linearizeOplus(jacobianWorkspace); // jacobian of the nodes' oplus (manifold)
+      e->constructQuadraticForm();
 #  ifndef NDEBUG
-    for (size_t i = 0; i < e->vertices().size(); ++i) {
-      const OptimizableGraph::Vertex* v = static_cast<const OptimizableGraph::Vertex*>(e->vertex(i));
-      if (! v->fixed()) {
-        bool hasANan = arrayHasNaN(jacobianWorkspace.workspaceForVertex(i), e->dimension() * v->dimension());
-        if (hasANan) {
-          cerr << "buildSystem(): NaN within Jacobian for edge " << e << " for vertex " << i << endl;
-          break;
+      for (size_t i = 0; i < e->vertices().size(); ++i) {
+        const OptimizableGraph::Vertex* v = static_cast<const OptimizableGraph::Vertex*>(e->vertex(i));
+        if (! v->fixed()) {
+          bool hasANan = arrayHasNaN(jacobianWorkspace.workspaceForVertex(i), e->dimension() * v->dimension());
+          if (hasANan) {
+            cerr << "buildSystem(): NaN within Jacobian for edge " << e << " for vertex " << i << endl;
+            break;
+          }
         }
       }
-    }
 #  endif
+    }
   }
 
   // flush the current system in a sparse block matrix
@@ -453,6 +453,16 @@ namespace g2o {
          */
         virtual void linearizeOplus(JacobianWorkspace& jacobianWorkspace) = 0;
 
+        /**
+         * Deterministic multi-threaded linearization. Edges returning true store their
+         * Jacobians internally (linearizeOplusInPlace) and build the quadratic form one
+         * vertex at a time (constructQuadraticFormForVertex), so that different vertices
+         * can be processed concurrently while keeping the serial summation order.
+         */
+        virtual bool supportsParallelLinearization() const { return false; }
+        virtual void linearizeOplusInPlace() {}
+        virtual void constructQuadraticFormForVertex(int vertexIndex) { (void) vertexIndex; }
+
         /** set the estimate of the to vertex, based on the estimate of the from vertices in the edge. */
         virtual void initialEstimate(const OptimizableGraph::VertexSet& from, OptimizableGraph::Vertex* to) = 0;
 
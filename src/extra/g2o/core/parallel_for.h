@@ -0,0 +1,71 @@
+// g2o - General Graph Optimization
+// Copyright (C) 2011 R. Kuemmerle, G. Grisetti, W. Burgard
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+// * Redistributions of source code must retain the above copyright notice,
+//   this list of conditions and the following disclaimer.
+// * Redistributions in binary form must reproduce the above copyright
+//   notice, this list of conditions and the following disclaimer in the
+//   documentation and/or other materials provided with the distribution.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+// IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+// TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+// PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+// TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+// PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+// LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+// NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+// SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#ifndef G2O_PARALLEL_FOR_H
+#define G2O_PARALLEL_FOR_H
+
+#include <thread>
+#include <vector>
+
+namespace g2o {
+
+  /**
+   * \brief run f(i) for i in [begin, end) using up to numThreads threads
+   *
+   * Indices are distributed in a strided way (thread t processes begin+t,
+   * begin+t+numThreads, ...), which balances the load when the cost per
+   * index varies smoothly. Each index is processed exactly once, the caller
+   * must ensure f(i) and f(j) do not write the same memory.
+   */
+  template <typename F>
+  void parallelFor(int begin, int end, int numThreads, const F& f)
+  {
+    const int n = end - begin;
+    if (numThreads > n)
+      numThreads = n;
+    if (numThreads <= 1) {
+      for (int i = begin; i < end; ++i)
+        f(i);
+      return;
+    }
+
+    std::vector<std::thread> workers;
+    workers.reserve(numThreads - 1);
+    for (int t = 1; t < numThreads; ++t) {
+      workers.push_back(std::thread([&f, begin, end, numThreads, t]() {
+        for (int i = begin + t; i < end; i += numThreads)
+          f(i);
+      }));
+    }
+    for (int i = begin; i < end; i += numThreads)
+      f(i);
+    for (size_t t = 0; t < workers.size(); ++t)
+      workers[t].join();
+  }
+
+} // end namespace
+
+#endif
@@ -37,6 +37,7 @@
 #include "optimization_algorithm.h"
 #include "batch_stats.h"
 #include "hyper_graph_action.h"
+#include "parallel_for.h"
 #include "robust_kernel.h"
 #include "../stuff/timeutil.h"
 #include "../stuff/macros.h"
@@ -48,7 +49,7 @@ namespace g2o{
 
 
   SparseOptimizer::SparseOptimizer() :
-    _forceStopFlag(0), _verbose(false), _algorithm(0), _computeBatchStatistics(false)
+    _forceStopFlag(0), _verbose(false), _numThreads(1), _algorithm(0), _computeBatchStatistics(false)
   {
     _graphActions.resize(AT_NUM_ELEMENTS);
   }
@@ -67,12 +68,19 @@ namespace g2o{
         (*(*it))(this);
     }
 
+    if (_numThreads > 1 && _activeEdges.size() > 50) {
+      // errors are independent per edge, no reduction involved
+      parallelFor(0, static_cast<int>(_activeEdges.size()), _numThreads, [this](int k) {
+        _activeEdges[k]->computeError();
+      });
+    } else {
 #   ifdef G2O_OPENMP
 #   pragma omp parallel for default (shared) if (_activeEdges.size() > 50)
 #   endif
-    for (int k = 0; k < static_cast<int>(_activeEdges.size()); ++k) {
-      OptimizableGraph::Edge* e = _activeEdges[k];
-      e->computeError();
+      for (int k = 0; k < static_cast<int>(_activeEdges.size()); ++k) {
+        OptimizableGraph::Edge* e = _activeEdges[k];
+        e->computeError();
+      }
     }
 
 #  ifndef NDEBUG
@@ -178,6 +178,10 @@ namespace g2o {
     bool verbose()  const {return _verbose;}
     void setVerbose(bool verbose);
 
+    //! number of threads used to compute errors and linearize edges (1 = serial)
+    int numThreads() const {return _numThreads;}
+    void setNumThreads(int numThreads) { _numThreads = numThreads < 1 ? 1 : numThreads;}
+
     /**
      * sets a variable checked at every iteration to force a user stop. The iteration exits when the variable is true;
      */
@@ -289,6 +293,7 @@ namespace g2o {
     protected:
     bool* _forceStopFlag;
     bool _verbose;
+    int _numThreads;
 
     VertexContainer _ivMap;
     VertexContainer _activeVertices;   ///< sorted according to VertexIDCompare
@@ -102,6 +102,7 @@ public:
     
 
   virtual void linearizeOplus();
+  virtual bool supportsParallelLinearization() const { return true; }
 
   Vector2d cam_project(const Vector3d & trans_xyz) const;
 
@@ -134,6 +135,7 @@ public:
 
 
   virtual void linearizeOplus();
+  virtual bool supportsParallelLinearization() const { return true; }
 
   Vector3d cam_project(const Vector3d & trans_xyz, const float &bf) const;
 
@@ -0,0 +1,77 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_KEYPOINTS_H_
+#define SD_SLAM_KEYPOINTS_H_
+
+#include <cstdint>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+namespace SD_SLAM {
+
+// Struct-of-arrays storage of undistorted keypoints, holding only the fields used
+// by matching kernels. cv::KeyPoint views are built on demand, size and response
+// are left unset (they are kept in the distorted keypoints).
+struct KeyPointArray {
+  std::vector<float> x;
+  std::vector<float> y;
+  std::vector<float> angle;
+  std::vector<uint8_t> octave;
+
+  inline size_t size() const { return x.size(); }
+  inline bool empty() const { return x.empty(); }
+
+  inline cv::Point2f pt(size_t i) const { return cv::Point2f(x[i], y[i]); }
+
+  // KeyPoint copy of element i, kernels should read the arrays instead
+  inline cv::KeyPoint operator[](size_t i) const {
+    cv::KeyPoint kp;
+    kp.pt.x = x[i];
+    kp.pt.y = y[i];
+    kp.angle = angle[i];
+    kp.octave = octave[i];
+    return kp;
+  }
+
+  void Assign(const std::vector<cv::KeyPoint> &kps) {
+    const size_t n = kps.size();
+    x.resize(n);
+    y.resize(n);
+    angle.resize(n);
+    octave.resize(n);
+    for (size_t i = 0; i < n; i++) {
+      x[i] = kps[i].pt.x;
+      y[i] = kps[i].pt.y;
+      angle[i] = kps[i].angle;
+      octave[i] = static_cast<uint8_t>(kps[i].octave);
+    }
+  }
+
+  std::vector<cv::KeyPoint> ToKeyPoints() const {
+    std::vector<cv::KeyPoint> kps(size());
+    for (size_t i = 0; i < kps.size(); i++)
+      kps[i] = (*this)[i];
+    return kps;
+  }
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_KEYPOINTS_H_
@@ -0,0 +1,59 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_PARALLEL_FOR_H_
+#define SD_SLAM_PARALLEL_FOR_H_
+
+#include <thread>
+#include <vector>
+
+namespace SD_SLAM {
+
+// Run f(i) for i in [begin, end) using up to threads threads. Indices are distributed
+// in a strided way (thread t processes begin+t, begin+t+threads, ...), each index is
+// processed exactly once. The caller must ensure f(i) and f(j) do not write the same memory.
+// With a single thread f is called in order in the calling thread.
+template <typename F>
+void ParallelFor(int begin, int end, int threads, const F &f) {
+  const int n = end - begin;
+  if (threads > n)
+    threads = n;
+  if (threads <= 1) {
+    for (int i = begin; i < end; i++)
+      f(i);
+    return;
+  }
+
+  std::vector<std::thread> workers;
+  workers.reserve(threads-1);
+  for (int t = 1; t < threads; t++) {
+    workers.push_back(std::thread([&f, begin, end, threads, t]() {
+      for (int i = begin+t; i < end; i += threads)
+        f(i);
+    }));
+  }
+  for (int i = begin; i < end; i += threads)
+    f(i);
+  for (size_t t = 0; t < workers.size(); t++)
+    workers[t].join();
+}
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_PARALLEL_FOR_H_
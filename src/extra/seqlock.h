@@ -0,0 +1,120 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_SEQLOCK_H_
+#define SD_SLAM_SEQLOCK_H_
+
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <cstring>
+
+namespace SD_SLAM {
+
+// Small, trivially copyable value (pose, position) published through a SeqLock.
+// It is stored as relaxed atomic words, so a reader copying it while a writer
+// stores it is not a data race; torn copies are discarded by the sequence check.
+template<typename T>
+class SeqLockValue {
+ public:
+  SeqLockValue() {}
+  explicit SeqLockValue(const T &value) { Store(value); }
+
+  // Writer side, inside a SeqLockWriter (or before the object is shared)
+  inline void Store(const T &value) {
+    uintptr_t buf[kWords] = {};
+    std::memcpy(buf, static_cast<const void*>(&value), sizeof(T));
+    for (size_t i = 0; i < kWords; i++)
+      words_[i].store(buf[i], std::memory_order_relaxed);
+  }
+
+  // Plain copy. Consistent only with the writer mutex held, use SeqLock::Read otherwise
+  inline T Load() const {
+    uintptr_t buf[kWords];
+    for (size_t i = 0; i < kWords; i++)
+      buf[i] = words_[i].load(std::memory_order_relaxed);
+    T value;
+    std::memcpy(static_cast<void*>(&value), buf, sizeof(T));
+    return value;
+  }
+
+ private:
+  static const size_t kWords = (sizeof(T)+sizeof(uintptr_t)-1)/sizeof(uintptr_t);
+  std::atomic<uintptr_t> words_[kWords];
+};
+
+// Sequence lock for SeqLockValue data.
+// Writers must be serialized externally (they keep their mutex), readers
+// never block and retry if a write happened while they were copying.
+class SeqLock {
+ public:
+  SeqLock() : seq_(0) {}
+
+  // Writer side, call with the writer mutex held
+  inline void WriteBegin() {
+    unsigned int s = seq_.load(std::memory_order_relaxed);
+    seq_.store(s+1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+  }
+
+  inline void WriteEnd() {
+    unsigned int s = seq_.load(std::memory_order_relaxed);
+    seq_.store(s+1, std::memory_order_release);
+  }
+
+  // Reader side, returns a copy of data once a consistent snapshot is read
+  template<typename T>
+  inline T Read(const SeqLockValue<T> &data) const {
+    T copy;
+    unsigned int s1, s2;
+    do {
+      s1 = seq_.load(std::memory_order_acquire);
+      while (s1 & 1) {
+        std::this_thread::yield();
+        s1 = seq_.load(std::memory_order_acquire);
+      }
+      copy = data.Load();
+      std::atomic_thread_fence(std::memory_order_acquire);
+      s2 = seq_.load(std::memory_order_relaxed);
+    } while (s1 != s2);
+    return copy;
+  }
+
+ private:
+  std::atomic<unsigned int> seq_;
+};
+
+// Guard for the writer side
+class SeqLockWriter {
+ public:
+  explicit SeqLockWriter(SeqLock &lock) : lock_(lock) {
+    lock_.WriteBegin();
+  }
+
+  ~SeqLockWriter() {
+    lock_.WriteEnd();
+  }
+
+ private:
+  SeqLock &lock_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_SEQLOCK_H_
@@ -25,6 +25,10 @@ int Random(int min, int max) {
   return static_cast<int>(((static_cast<double>(rand())/(static_cast<double>(RAND_MAX) + 1.0)) * d) + min);
 }
 
+int Random(int min, int max, std::mt19937 &rng) {
+  return std::uniform_int_distribution<int>(min, max)(rng);
+}
+
 }  // namespace SD_SLAM
 
 
@@ -20,12 +20,16 @@
 #define SD_SLAM_UTILS_H_
 
 #include <cstdlib>
+#include <random>
 
 namespace SD_SLAM {
 
 // Get a random int in range [min..max]
 int Random(int min, int max);
 
+// Same, drawing from a given generator instead of the global one
+int Random(int min, int max, std::mt19937 &rng);
+
 }  // namespace SD_SLAM
 
 #endif  // SD_SLAM_UTILS_H_
@@ -0,0 +1,208 @@
+/**
+ *
+ *  Copyright (C) 2018 Eduardo Perdices <eperdices at gsyc dot es>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU Library General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program. If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef SD_SLAM_VOXEL_GRID_H_
+#define SD_SLAM_VOXEL_GRID_H_
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <Eigen/Dense>
+
+namespace SD_SLAM {
+
+// Sparse voxel hash storing pointers by 3D position.
+// Not thread safe, owner must lock it.
+template<typename T>
+class VoxelGrid {
+ public:
+  explicit VoxelGrid(double size) : size_(size), inv_size_(1.0/size) {}
+
+  inline double GetSize() const { return size_; }
+  inline size_t Size() const { return elements_.size(); }
+  inline bool Contains(T *elem) const { return elements_.count(elem) > 0; }
+
+  // Add element, or move it if it was already added
+  void Insert(T *elem, const Eigen::Vector3d &pos) {
+    int64_t key = GetKey(pos);
+    typename std::unordered_map<T*, int64_t>::iterator it = elements_.find(elem);
+    if (it != elements_.end()) {
+      if (it->second == key)
+        return;
+      RemoveFromCell(elem, it->second);
+      it->second = key;
+    } else {
+      elements_[elem] = key;
+    }
+    cells_[key].push_back(elem);
+  }
+
+  // Move element only if it was already added
+  void Update(T *elem, const Eigen::Vector3d &pos) {
+    typename std::unordered_map<T*, int64_t>::iterator it = elements_.find(elem);
+    if (it == elements_.end())
+      return;
+
+    int64_t key = GetKey(pos);
+    if (it->second == key)
+      return;
+    RemoveFromCell(elem, it->second);
+    it->second = key;
+    cells_[key].push_back(elem);
+  }
+
+  void Erase(T *elem) {
+    typename std::unordered_map<T*, int64_t>::iterator it = elements_.find(elem);
+    if (it == elements_.end())
+      return;
+    RemoveFromCell(elem, it->second);
+    elements_.erase(it);
+  }
+
+  void Clear() {
+    cells_.clear();
+    elements_.clear();
+  }
+
+  // Call f(center, elements) for every non empty voxel overlapping the box [min, max].
+  // Cost is the number of voxels in the box, or of occupied voxels if they are fewer
+  template<typename F>
+  void ForEachCellInBox(const Eigen::Vector3d &min, const Eigen::Vector3d &max, F f) const {
+    const int x0 = Coord(min(0)), y0 = Coord(min(1)), z0 = Coord(min(2));
+    const int x1 = Coord(max(0)), y1 = Coord(max(1)), z1 = Coord(max(2));
+    const double volume = static_cast<double>(x1-x0+1)*(y1-y0+1)*(z1-z0+1);
+
+    if (volume < cells_.size()) {
+      for (int x = x0; x <= x1; x++) {
+        for (int y = y0; y <= y1; y++) {
+          for (int z = z0; z <= z1; z++) {
+            int64_t key = MakeKey(x, y, z);
+            typename CellMap::const_iterator it = cells_.find(key);
+            if (it != cells_.end())
+              f(GetCenter(key), it->second);
+          }
+        }
+      }
+    } else {
+      for (typename CellMap::const_iterator it = cells_.begin(); it != cells_.end(); it++) {
+        int x, y, z;
+        GetCoords(it->first, &x, &y, &z);
+        if (x < x0 || x > x1 || y < y0 || y > y1 || z < z0 || z > z1)
+          continue;
+        f(GetCenter(it->first), it->second);
+      }
+    }
+  }
+
+  // Elements stored in voxels overlapping the sphere (center, radius)
+  std::vector<T*> GetInRadius(const Eigen::Vector3d &center, double radius) const {
+    std::vector<T*> elems;
+    const double rv = std::ceil(radius*inv_size_);
+    const double max_dist = radius + 0.87*size_;  // Radius plus half voxel diagonal
+
+    // Scan neighbour voxels only if they are fewer than occupied ones. Counted in double,
+    // so that large radius to voxel ratios do not overflow
+    const double volume = (2*rv+1)*(2*rv+1)*(2*rv+1);
+    if (volume < cells_.size()) {
+      const int r = static_cast<int>(rv);
+      const int cx = Coord(center(0)), cy = Coord(center(1)), cz = Coord(center(2));
+      for (int x = cx-r; x <= cx+r; x++) {
+        for (int y = cy-r; y <= cy+r; y++) {
+          for (int z = cz-r; z <= cz+r; z++) {
+            int64_t key = MakeKey(x, y, z);
+            typename CellMap::const_iterator it = cells_.find(key);
+            if (it == cells_.end())
+              continue;
+            if ((GetCenter(key)-center).norm() > max_dist)
+              continue;
+            elems.insert(elems.end(), it->second.begin(), it->second.end());
+          }
+        }
+      }
+    } else {
+      for (typename CellMap::const_iterator it = cells_.begin(); it != cells_.end(); it++) {
+        if ((GetCenter(it->first)-center).norm() > max_dist)
+          continue;
+        elems.insert(elems.end(), it->second.begin(), it->second.end());
+      }
+    }
+
+    return elems;
+  }
+
+ private:
+  typedef std::unordered_map<int64_t, std::vector<T*> > CellMap;
+
+  static const int kBits = 21;
+  static const int64_t kMask = (1LL << kBits) - 1;
+  static const int kOffset = 1 << (kBits-1);
+
+  inline int Coord(double v) const {
+    return static_cast<int>(std::floor(v*inv_size_));
+  }
+
+  inline int64_t MakeKey(int x, int y, int z) const {
+    return ((static_cast<int64_t>(x+kOffset) & kMask) << (2*kBits)) |
+           ((static_cast<int64_t>(y+kOffset) & kMask) << kBits) |
+           (static_cast<int64_t>(z+kOffset) & kMask);
+  }
+
+  inline int64_t GetKey(const Eigen::Vector3d &pos) const {
+    return MakeKey(Coord(pos(0)), Coord(pos(1)), Coord(pos(2)));
+  }
+
+  inline void GetCoords(int64_t key, int *x, int *y, int *z) const {
+    *x = static_cast<int>((key >> (2*kBits)) & kMask) - kOffset;
+    *y = static_cast<int>((key >> kBits) & kMask) - kOffset;
+    *z = static_cast<int>(key & kMask) - kOffset;
+  }
+
+  inline Eigen::Vector3d GetCenter(int64_t key) const {
+    int x, y, z;
+    GetCoords(key, &x, &y, &z);
+    return Eigen::Vector3d((x+0.5)*size_, (y+0.5)*size_, (z+0.5)*size_);
+  }
+
+  void RemoveFromCell(T *elem, int64_t key) {
+    typename CellMap::iterator it = cells_.find(key);
+    if (it == cells_.end())
+      return;
+
+    std::vector<T*> &cell = it->second;
+    typename std::vector<T*>::iterator eit = std::find(cell.begin(), cell.end(), elem);
+    if (eit != cell.end()) {
+      *eit = cell.back();
+      cell.pop_back();
+    }
+    if (cell.empty())
+      cells_.erase(it);
+  }
+
+  double size_;
+  double inv_size_;
+
+  CellMap cells_;
+  std::unordered_map<T*, int64_t> elements_;
+};
+
+}  // namespace SD_SLAM
+
+#endif  // SD_SLAM_VOXEL_GRID_H_
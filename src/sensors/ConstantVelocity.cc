@@ -158,6 +158,12 @@ Eigen::MatrixXd ConstantVelocity::R(const Eigen::VectorXd &X, double time) {
   return R;
 }
 
+bool ConstantVelocity::PoseCovariance(const Eigen::MatrixXd &P, Eigen::Matrix<double, 6, 6> *cov) {
+  // Predicted pose is Exp(v, w) * last pose, so the velocity covariance is the pose covariance
+  *cov = P.block<6, 6>(0, 0);
+  return true;
+}
+
 Eigen::Matrix4d ConstantVelocity::Exp(const Eigen::Matrix<double, 6, 1> &update) {
   Eigen::Vector3d upsilon = update.head<3>();
   Eigen::Vector3d omega = update.tail<3>();
@@ -48,6 +48,8 @@ class ConstantVelocity : public Sensor {
   Eigen::MatrixXd jH(const Eigen::VectorXd &X, double time);
   Eigen::MatrixXd R(const Eigen::VectorXd &X, double time);
 
+  bool PoseCovariance(const Eigen::MatrixXd &P, Eigen::Matrix<double, 6, 6> *cov);
+
  private:
   Eigen::Matrix4d Exp(const Eigen::Matrix<double, 6, 1> &update);
   Eigen::Matrix<double, 6, 1> Log(const Eigen::Matrix4d &pose);
@@ -103,6 +103,12 @@ void EKF::Update(const Eigen::Matrix4d &pose, const vector<double> &params) {
   timer_.Start();
 }
 
+bool EKF::GetPoseCovariance(Eigen::Matrix<double, 6, 6> *cov) {
+  if (!updated_)
+    return false;
+  return sensor_->PoseCovariance(P_, cov);
+}
+
 void EKF::Restart() {
   updated_ = false;
   sensor_->Init(X_, P_);
@@ -43,6 +43,9 @@ class EKF {
   // Restart filter
   void Restart();
 
+  // Covariance of the last predicted pose, false if not available
+  bool GetPoseCovariance(Eigen::Matrix<double, 6, 6> *cov);
+
  private:
   Sensor* sensor_;    // Motion sensor
 
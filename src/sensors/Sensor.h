@@ -73,6 +73,10 @@ class Sensor {
   // Measurement noise covariance
   virtual Eigen::MatrixXd R(const Eigen::VectorXd &X, double time) = 0;
 
+  // Covariance of the predicted pose as a left perturbation [v, w] in camera frame.
+  // Returns false if the state does not provide it
+  virtual bool PoseCovariance(const Eigen::MatrixXd &P, Eigen::Matrix<double, 6, 6> *cov) { return false; }
+
  protected:
   // Calculate quaternion from angular velocity
   Eigen::Quaterniond QuaternionFromAngularVelocity(const Eigen::Vector3d &w);
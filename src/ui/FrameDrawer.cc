@@ -136,7 +136,7 @@ void FrameDrawer::Update(const cv::Mat &im, const Eigen::Matrix4d &pose, Trackin
   else
     im.copyTo(mIm);
   if (undistort)
-    mvCurrentKeys = currentFrame.mvKeysUn;
+    mvCurrentKeys = currentFrame.mvKeysUn.ToKeyPoints();
   else
     mvCurrentKeys = currentFrame.mvKeys;
   int n = mvCurrentKeys.size();
@@ -146,7 +146,7 @@ void FrameDrawer::Update(const cv::Mat &im, const Eigen::Matrix4d &pose, Trackin
 
   if (pTracker->GetLastState() == Tracking::NOT_INITIALIZED)  {
     if (undistort)
-      mvIniKeys = pTracker->GetInitialFrame().mvKeysUn;
+      mvIniKeys = pTracker->GetInitialFrame().mvKeysUn.ToKeyPoints();
     else
       mvIniKeys = pTracker->GetInitialFrame().mvKeys;
     mvIniMatches = pTracker->GetInitialMatches();